@@ -0,0 +1,201 @@
+#pragma once
+// A small framework to run all analyses in a single pass over the user data
+// Author: Jochen jens Heinrich 2022
+
+#include <iostream>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <memory>
+#include "NC_User.h"
+#include "NC_Parallel.h"
+#include "NC_Trace.h"
+
+using namespace std;
+
+// Description of a covariate whose impact on the time to pregnancy we want to study
+struct NC_Covariate {
+  string name;		// Name used in the summary
+  string label;		// Axis label
+  string par_name;	// Used to name the output files
+  NC_Field field;
+  // Binning of numeric fields, categorical ones get a bin per label found in the data
+  int x_bins;
+  float x_low;
+  float x_high;
+};
+
+// Longest time to pregnancy the analyses resolve, ten years of cycles. Anything longer is an outlier or a broken row and is
+// censored here, so a single bad value cannot blow up tables that are indexed by cycle
+constexpr int kNC_MaxCycles = 120;
+
+
+// Base class for everything that wants to look at the users during the pass over the data
+class NC_Accumulator {
+
+public:
+
+  virtual ~NC_Accumulator() {}
+  // Called once per pass before the first block, on the accumulator the copies for the threads are cloned from afterwards,
+  // for state that is derived from whole columns and shared by the copies
+  virtual void prepare(const NC_Users &users, int n_threads) {}
+  // Called for consecutive blocks of users [begin, end)
+  virtual void process(const NC_Users &users, int begin, int end) = 0;
+  // Accumulators that support it hand out an empty copy for each thread, the copies are merged back in input order
+  virtual NC_Accumulator *clone() const { return nullptr; }
+  virtual void merge(const NC_Accumulator &other) {}
+  // Binary state for checkpoints, so a later run can continue where this one stopped; load expects an accumulator that has
+  // not seen any users yet and returns false if the state was written by a different kind or configuration of accumulator
+  virtual bool save(FILE *file) const { return false; }
+  virtual bool load(FILE *file) { return false; }
+  // Translates the category codes of field, codes[old] is the new code and there are n_codes of them afterwards;
+  // needed when states built with different dictionaries are merged. Accumulators that store no codes ignore it
+  virtual void remapCodes(NC_Field field, const vector<NC_Code> &codes, int n_codes) {}
+
+protected:
+
+  template<class T> static bool writeValue(FILE *file, const T &value) { return fwrite(&value, sizeof(T), 1, file) == 1; }
+  template<class T> static bool readValue(FILE *file, T &value) { return fread(&value, sizeof(T), 1, file) == 1; }
+  // Vectors of plain values as their length followed by the values
+  template<class T> static bool writeVector(FILE *file, const vector<T> &values);
+  template<class T> static bool readVector(FILE *file, vector<T> &values);
+
+};
+
+
+template<class T> bool NC_Accumulator::writeVector(FILE *file, const vector<T> &values) {
+  uint64_t size = values.size();
+  return writeValue(file, size) && fwrite(values.data(), sizeof(T), size, file) == size;
+}
+
+
+template<class T> bool NC_Accumulator::readVector(FILE *file, vector<T> &values) {
+  uint64_t size;
+  // A corrupt length must not turn into a huge allocation
+  if (!readValue(file, size) || size > (1ULL << 36) / sizeof(T)) return false;
+  values.resize(size);
+  return fread(values.data(), sizeof(T), size, file) == size;
+}
+
+
+// Runs all registered accumulators over the users, block by block, so every block is still in cache for the next accumulator
+class NC_Analysis {
+
+public:
+
+  NC_Analysis() {}
+  ~NC_Analysis() {}
+  // The accumulators are not owned and have to outlive the analysis
+  void add(NC_Accumulator *accumulator) { m_accumulators.push_back(accumulator); }
+  // With more than one thread the users are split into contiguous ranges, as long as all accumulators can be cloned
+  void run(const NC_Users &users, int n_threads = 1);
+  // Number of users handed to the accumulators at a time
+  static const int kBlockSize = 4096;
+
+private:
+
+  vector<NC_Accumulator*> m_accumulators;
+
+};
+
+
+// Counts the pregnancies per cycle, bin 0 and n_cycles+1 collect everything out of range like a histogram would
+class NC_CycleHistogram : public NC_Accumulator {
+
+public:
+
+  NC_CycleHistogram(int n_cycles) : m_counts(n_cycles+2, 0) {}
+  ~NC_CycleHistogram() {}
+  void process(const NC_Users &users, int begin, int end);
+  NC_Accumulator *clone() const { return new NC_CycleHistogram(m_counts.size()-2); }
+  void merge(const NC_Accumulator &other);
+  bool save(FILE *file) const { return writeVector(file, m_counts); }
+  bool load(FILE *file);
+  const vector<int> &counts() const { return m_counts; }
+
+private:
+
+  vector<int> m_counts;
+
+};
+
+
+void NC_Analysis::run(const NC_Users &users, int n_threads) {
+
+  NC_TraceScope trace_scope("analysis");
+  int n_users = users.number_of_users();
+  NC_Trace::count("rows analysed", n_users);
+  int n_tasks = min(NC_Parallel::nThreads(n_threads), (n_users + kBlockSize - 1) / kBlockSize);
+  for (NC_Accumulator *accumulator : m_accumulators) accumulator->prepare(users, n_threads);
+
+  // Every task gets its own copies of the accumulators
+  vector<vector<unique_ptr<NC_Accumulator>>> copies(n_tasks > 1 ? n_tasks : 0);
+  for (int task = 0; task < copies.size(); ++task) {
+	for (int i_acc = 0; i_acc < m_accumulators.size(); ++i_acc) {
+		copies[task].emplace_back(m_accumulators[i_acc]->clone());
+		if (!copies[task].back()) {
+			copies.clear();
+			break;
+		}
+	}
+  }
+
+  if (copies.empty()) {
+	for (int begin = 0; begin < n_users; begin += kBlockSize) {
+		int end = min(begin + kBlockSize, n_users);
+		for (int i_acc = 0; i_acc < m_accumulators.size(); ++i_acc) m_accumulators[i_acc]->process(users, begin, end);
+	}
+	return;
+  }
+
+  NC_Parallel::forEach(n_tasks, n_threads, [&](int task, int) {
+	NC_TraceScope task_scope("analysisTask");
+	int task_end = (long) n_users * (task+1) / n_tasks;
+	for (int begin = (long) n_users * task / n_tasks; begin < task_end; begin += kBlockSize) {
+		int end = min(begin + kBlockSize, task_end);
+		for (int i_acc = 0; i_acc < m_accumulators.size(); ++i_acc) copies[task][i_acc]->process(users, begin, end);
+	}
+  });
+
+  // Merging in task order keeps everything that depends on the input order identical to a serial run
+  for (int task = 0; task < n_tasks; ++task) {
+	for (int i_acc = 0; i_acc < m_accumulators.size(); ++i_acc) m_accumulators[i_acc]->merge(*copies[task][i_acc]);
+  }
+
+  return;
+}
+
+
+void NC_CycleHistogram::process(const NC_Users &users, int begin, int end) {
+
+  const int *n_cycles_trying = users.column<kNCyclesTrying>();
+  const NC_Code *outcome = users.column<kOutcome>();
+  int n_cycles = m_counts.size()-2;
+
+  for (int i = begin; i < end; ++i) {
+
+	// Women who did not get pregnant can be ignored for this question
+	if (outcome[i] != kPregnant) continue;
+
+	// FIXME Could also do this in days, but only have cycle information for point of pregnancy so no need to pretend to have a more precise number than we do
+	int cycle = n_cycles_trying[i];
+	++m_counts[cycle < 1 ? 0 : (cycle > n_cycles ? n_cycles+1 : cycle)];
+  }
+
+  return;
+}
+
+
+void NC_CycleHistogram::merge(const NC_Accumulator &other) {
+  const NC_CycleHistogram &hist = dynamic_cast<const NC_CycleHistogram&>(other);
+  for (int i_bin = 0; i_bin < m_counts.size(); ++i_bin) m_counts[i_bin] += hist.m_counts[i_bin];
+}
+
+
+// The number of cycles has to be the same as when the state was saved
+bool NC_CycleHistogram::load(FILE *file) {
+  vector<int> counts;
+  if (!readVector(file, counts) || counts.size() != m_counts.size()) return false;
+  m_counts = counts;
+  return true;
+}
@@ -0,0 +1,192 @@
+// Script to time every stage of the analysis on synthetic inputs of different sizes and with different numbers of threads
+// Author: Jochen jens Heinrich 2022
+
+#include <iostream>
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "NC_DataChallenge.cxx"
+#include "NC_GenerateData.cxx"
+
+using namespace std;
+
+// One line of the report
+struct NC_BenchmarkEntry {
+  long n_rows;
+  int n_threads;
+  string stage;
+  double seconds;
+  size_t bytes;
+  long peak_rss_kb;
+};
+
+
+// Sizes and thread counts are comma separated lists, 0 threads means one per core.
+// Input files nc_benchmark_<rows>.list are generated in directory unless they exist already.
+// Rates are given relative to the number of rows and the size of the input file; the peak RSS is that of the whole process so far
+void NC_Benchmark(string sizes = "10000,100000,1000000", string thread_counts = "1,0", bool render = false, string report_file = "",
+		string directory = ".") {
+
+  auto parse_list = [](string list) {
+	vector<long> values;
+	istringstream stream(list);
+	string value;
+	while (std::getline(stream, value, ',')) values.push_back(atol(value.c_str()));
+	return values;
+  };
+  vector<long> row_counts = parse_list(sizes), thread_list = parse_list(thread_counts);
+
+  vector<NC_BenchmarkEntry> entries;
+  auto peak_rss = []() {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (long) usage.ru_maxrss;
+  };
+  // Times func and adds it to the report
+  auto time_stage = [&](long n_rows, int n_threads, string stage, size_t bytes, auto func) {
+	auto start = chrono::steady_clock::now();
+	func();
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	entries.push_back({n_rows, n_threads, stage, seconds, bytes, peak_rss()});
+	printf("  %-40s %10.4f s\n", stage.c_str(), seconds);
+  };
+
+  const int n_cycles = 15;
+  const vector<NC_Covariate> covariates = NC_DefaultCovariates();
+
+  for (long n_rows : row_counts) {
+
+	string file_name = directory + "/nc_benchmark_" + to_string(n_rows) + ".list";
+	struct stat file_stat;
+	if (stat(file_name.c_str(), &file_stat) != 0) {
+		printf("\nGenerating %ld rows\n", n_rows);
+		time_stage(n_rows, 0, "generate", 0, [&]() { NC_GenerateData(file_name, n_rows); });
+		stat(file_name.c_str(), &file_stat);
+	}
+	size_t bytes = file_stat.st_size;
+
+	for (long thread_count : thread_list) {
+
+		int n_threads = NC_Parallel::nThreads(thread_count);
+		printf("\n%ld rows, %d threads\n", n_rows, n_threads);
+		NC_Users users;
+		remove((file_name + ".snapshot").c_str());
+		time_stage(n_rows, n_threads, "readData (parse)", bytes, [&]() { users.readData(file_name, n_threads, false); });
+		users.readData(file_name, n_threads, true);
+		time_stage(n_rows, n_threads, "readData (snapshot)", bytes, [&]() { users.readData(file_name, n_threads, true); });
+
+		// Every analysis loop on its own, and all of them in the single pass the analysis really does
+		NC_Survival survival;
+		NC_CycleHistogram cycle_histogram(n_cycles);
+		NC_Bootstrap bootstrap(n_cycles);
+		NC_CorrelationInputs correlation_inputs(covariates, users);
+		vector<pair<string,NC_Accumulator*>> loops = {{"survival loop", &survival}, {"cycle histogram loop", &cycle_histogram},
+			{"bootstrap pair loop", &bootstrap}, {"correlation loop", &correlation_inputs}};
+		for (auto &loop : loops) {
+			unique_ptr<NC_Accumulator> accumulator(loop.second->clone());
+			NC_Analysis analysis;
+			analysis.add(accumulator.get());
+			time_stage(n_rows, n_threads, loop.first, bytes, [&]() { analysis.run(users, n_threads); });
+		}
+		NC_Analysis analysis;
+		for (auto &loop : loops) analysis.add(loop.second);
+		time_stage(n_rows, n_threads, "single pass (all loops)", bytes, [&]() { analysis.run(users, n_threads); });
+
+		NC_Results results;
+		results.n_cycles = n_cycles;
+		time_stage(n_rows, n_threads, "survival curve", bytes, [&]() {
+			survival.getProbability(n_cycles, results.cumulative_probability, results.cumulative_uncertainty);
+		});
+		results.cycle_histogram.assign(cycle_histogram.counts().begin(), cycle_histogram.counts().end());
+		time_stage(n_rows, n_threads, "bootstrap (2000 resamples)", bytes, [&]() {
+			bootstrap.getBands(2000, 0.95, results.probability_lower, results.probability_upper, 1, n_threads);
+		});
+		for (int i_cov = 0; i_cov < covariates.size(); ++i_cov) {
+			time_stage(n_rows, n_threads, "correlation " + covariates[i_cov].name, bytes, [&]() {
+				results.correlations.push_back(correlation_inputs.result(i_cov));
+			});
+		}
+		time_stage(n_rows, n_threads, "fits", bytes, [&]() { NC_FitResults(&results, 1, n_threads); });
+		if (render) time_stage(n_rows, n_threads, "rendering", bytes, [&]() { NC_PlotResults(results); });
+	}
+  }
+
+  // Summary of everything
+  printf("\n%12s %8s  %-40s %10s %14s %12s %12s\n", "rows", "threads", "stage", "seconds", "rows/s", "MB/s", "peak RSS MB");
+  for (const NC_BenchmarkEntry &entry : entries) {
+	printf("%12ld %8d  %-40s %10.4f %14.4g %12.4g %12.1f\n", entry.n_rows, entry.n_threads, entry.stage.c_str(), entry.seconds,
+		entry.n_rows / entry.seconds, entry.bytes / entry.seconds / 1e6, entry.peak_rss_kb / 1024.0);
+  }
+
+  if (!report_file.empty()) {
+	FILE *file = fopen(report_file.c_str(), "w");
+	if (!file) {
+		printf("...Could not write report '%s'\n", report_file.c_str());
+		return;
+	}
+	fprintf(file, "rows,threads,stage,seconds,rows_per_second,bytes_per_second,peak_rss_kb\n");
+	for (const NC_BenchmarkEntry &entry : entries) {
+		fprintf(file, "%ld,%d,%s,%.6g,%.6g,%.6g,%ld\n", entry.n_rows, entry.n_threads, entry.stage.c_str(), entry.seconds,
+			entry.n_rows / entry.seconds, entry.bytes / entry.seconds, entry.peak_rss_kb);
+	}
+	fclose(file);
+	printf("Wrote report to %s\n", report_file.c_str());
+  }
+
+  return;
+}
+
+
+// Fits the same series as NC_FitResults with Minuit through TF1::Fit and compares parameters and errors with NC_Fitter,
+// returns true if all of them agree to tolerance relative; needs ROOT
+bool NC_CompareFits(string file_name = "data.list", double tolerance = 1e-4, int n_threads = 0) {
+
+#ifdef NC_NO_ROOT
+  printf("...Built without ROOT, there are no Minuit fits to compare with\n");
+  return false;
+#else
+  NC_Users users;
+  users.readData(file_name, n_threads);
+  NC_Results results = NC_Analyse(users, NC_DefaultCovariates(), 15, n_threads, false, "", 0, 0.95, kProbability | kDuration);
+  int size = results.n_cycles;
+
+  // The same points and ranges as NC_FitResults, started close to the native result so both find the same minimum
+  vector<double> cycle(size), zero(size, 0.0), probability(results.cumulative_probability.begin(), results.cumulative_probability.end()),
+	probability_error(results.cumulative_uncertainty.begin(), results.cumulative_uncertainty.end());
+  for (int i = 0; i < size; ++i) cycle[i] = i+1;
+  TGraphErrors graph(size, cycle.data(), probability.data(), zero.data(), probability_error.data());
+  TF1 probability_fit("compare_probability_fit", "[0]*(1-exp(-1.0*[1]*x))", 1.0, size);
+  probability_fit.SetParameters(1.1 * results.probability_fit[0], 0.9 * results.probability_fit[1]);
+  graph.Fit(&probability_fit, "RQ0");
+
+  TH1F hist("compare_hist", "", size, 0.5, size+0.5);
+  hist.SetDirectory(nullptr);
+  for (int i_bin = 0; i_bin < results.cycle_histogram.size(); ++i_bin) hist.SetBinContent(i_bin, results.cycle_histogram[i_bin]);
+  TF1 histogram_fit("compare_histogram_fit", "[0]*exp(-1.0*[1]*x)", 0.5, size);
+  histogram_fit.SetParameters(1.1 * results.histogram_fit[0], 0.9 * results.histogram_fit[1]);
+  hist.Fit(&histogram_fit, "RQ0");
+
+  bool agree = true;
+  auto compare = [&](const char *name, double native, double minuit) {
+	double difference = fabs(native - minuit) / max(fabs(minuit), 1e-300);
+	bool ok = difference <= tolerance;
+	agree = agree && ok;
+	printf("  %-28s %14.8g %14.8g %10.2e %s\n", name, native, minuit, difference, ok ? "" : "<- too far off");
+  };
+  printf("  %-28s %14s %14s %10s\n", "", "NC_Fitter", "Minuit", "relative");
+  compare("probability [0]", results.probability_fit[0], probability_fit.GetParameter(0));
+  compare("probability [1]", results.probability_fit[1], probability_fit.GetParameter(1));
+  compare("probability error [0]", results.probability_fit_error[0], probability_fit.GetParError(0));
+  compare("probability error [1]", results.probability_fit_error[1], probability_fit.GetParError(1));
+  compare("histogram [0]", results.histogram_fit[0], histogram_fit.GetParameter(0));
+  compare("histogram [1]", results.histogram_fit[1], histogram_fit.GetParameter(1));
+  compare("histogram error [0]", results.histogram_fit_error[0], histogram_fit.GetParError(0));
+  compare("histogram error [1]", results.histogram_fit_error[1], histogram_fit.GetParError(1));
+  printf(agree ? "Native and Minuit fits agree to %g\n" : "...Native and Minuit fits differ by more than %g\n", tolerance);
+
+  return agree;
+#endif
+}
@@ -0,0 +1,151 @@
+#pragma once
+// Bootstrap confidence bands for the cumulative pregnancy probability, which also take the correlations between the cycles into account
+// Author: Jochen jens Heinrich 2022
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+#include "NC_User.h"
+#include "NC_Analysis.h"
+#include "NC_Parallel.h"
+#include "NC_Trace.h"
+
+using namespace std;
+
+// For the cumulative probability a user is nothing but her pair (cycles, outcome), and there are only a few different pairs.
+// The accumulator counts how often each pair occurs, so drawing all users with replacement becomes a multinomial draw over the pairs.
+class NC_Bootstrap : public NC_Accumulator {
+
+public:
+
+  NC_Bootstrap(int n_cycles) : m_n_cycles(n_cycles), m_pairs(2*(n_cycles+2), 0) {}
+  ~NC_Bootstrap() {}
+  void process(const NC_Users &users, int begin, int end);
+  NC_Accumulator *clone() const { return new NC_Bootstrap(m_n_cycles); }
+  void merge(const NC_Accumulator &other);
+  bool save(FILE *file) const { return writeValue(file, m_n_cycles) && writeVector(file, m_pairs); }
+  bool load(FILE *file);
+  // Lower and upper edge in percent of the central interval with the given confidence level for every cycle, from n_resamples resamples
+  // Every resample has its own random number sequence, so the result only depends on the seed and not on the number of threads
+  void getBands(int n_resamples, float level, vector<float> &lower, vector<float> &upper, unsigned int seed = 1, int n_threads = 0) const;
+
+private:
+
+  // Pair index: cycles below 1 go to 0, cycles beyond the studied range to n_cycles+1
+  int pair(int cycles, bool pregnant) const { return 2*(cycles < 1 ? 0 : (cycles > m_n_cycles ? m_n_cycles+1 : cycles)) + pregnant; }
+  // Kaplan-Meier estimate as in NC_Survival, starting from the pair counts
+  void cumulativeProbability(const vector<long> &pairs, float *probability) const;
+  static float quantile(vector<float> &values, double level);
+
+  int m_n_cycles;
+  vector<long> m_pairs;
+
+};
+
+
+void NC_Bootstrap::process(const NC_Users &users, int begin, int end) {
+
+  const int *n_cycles_trying = users.column<kNCyclesTrying>();
+  const NC_Code *outcome = users.column<kOutcome>();
+
+  for (int i = begin; i < end; ++i) ++m_pairs[pair(n_cycles_trying[i], outcome[i] == kPregnant)];
+
+  return;
+}
+
+
+void NC_Bootstrap::merge(const NC_Accumulator &other) {
+  const NC_Bootstrap &bootstrap = dynamic_cast<const NC_Bootstrap&>(other);
+  for (int i_pair = 0; i_pair < m_pairs.size(); ++i_pair) m_pairs[i_pair] += bootstrap.m_pairs[i_pair];
+}
+
+
+bool NC_Bootstrap::load(FILE *file) {
+  int n_cycles;
+  vector<long> pairs;
+  if (!readValue(file, n_cycles) || n_cycles != m_n_cycles || !readVector(file, pairs) || pairs.size() != m_pairs.size()) return false;
+  m_pairs = pairs;
+  return true;
+}
+
+
+void NC_Bootstrap::cumulativeProbability(const vector<long> &pairs, float *probability) const {
+
+  // Everybody who tried for more than j cycles was trying in cycle j
+  long all_attempts = 0;
+  for (int cycles = 1; cycles <= m_n_cycles+1; ++cycles) all_attempts += pairs[2*cycles] + pairs[2*cycles+1];
+
+  double cumm_prob = 0.0;
+  for (int j = 0; j < m_n_cycles; ++j) {
+	long pregnancies = pairs[2*(j+1)+1];
+	double frac = all_attempts > 0 ? (double) pregnancies / (double) all_attempts : 0.0;
+	cumm_prob = cumm_prob+((1.0-cumm_prob)*frac);
+	probability[j] = cumm_prob * 100.0;
+	all_attempts -= pairs[2*(j+1)] + pregnancies;
+  }
+
+  return;
+}
+
+
+void NC_Bootstrap::getBands(int n_resamples, float level, vector<float> &lower, vector<float> &upper, unsigned int seed, int n_threads) const {
+
+  lower.assign(m_n_cycles, NAN);
+  upper.assign(m_n_cycles, NAN);
+  if (n_resamples < 1) return;
+  NC_TraceScope trace_scope("bootstrap");
+  NC_Trace::count("bootstrap resamples", n_resamples);
+
+  long n_users = 0;
+  for (long count : m_pairs) n_users += count;
+
+  // One row of cumulative probabilities per resample
+  vector<float> resampled((size_t) n_resamples * m_n_cycles);
+  const int kResamplesPerTask = 64;
+  int n_tasks = (n_resamples + kResamplesPerTask - 1) / kResamplesPerTask;
+
+  NC_Parallel::forEach(n_tasks, n_threads, [&](int task, int) {
+	NC_TraceScope task_scope("bootstrapTask");
+	vector<long> pairs(m_pairs.size());
+	int end = min(n_resamples, (task+1) * kResamplesPerTask);
+	for (int resample = task * kResamplesPerTask; resample < end; ++resample) {
+		seed_seq sequence = {seed, (unsigned int) resample};
+		mt19937_64 generator(sequence);
+
+		// Draw n_users users with replacement as a chain of binomials, one for every pair
+		long remaining_users = n_users, remaining_count = n_users;
+		for (int i_pair = 0; i_pair < pairs.size(); ++i_pair) {
+			long count = m_pairs[i_pair];
+			if (remaining_users == 0 || count == 0) pairs[i_pair] = 0;
+			else if (count == remaining_count) pairs[i_pair] = remaining_users;
+			else pairs[i_pair] = binomial_distribution<long>(remaining_users, (double) count / remaining_count)(generator);
+			remaining_users -= pairs[i_pair];
+			remaining_count -= count;
+		}
+		cumulativeProbability(pairs, &resampled[(size_t) resample * m_n_cycles]);
+	}
+  });
+
+  // Percentile band per cycle
+  vector<float> values(n_resamples);
+  for (int j = 0; j < m_n_cycles; ++j) {
+	for (int resample = 0; resample < n_resamples; ++resample) values[resample] = resampled[(size_t) resample * m_n_cycles + j];
+	lower[j] = quantile(values, 0.5 * (1.0 - level));
+	upper[j] = quantile(values, 0.5 * (1.0 + level));
+  }
+
+  return;
+}
+
+
+// Linear interpolation between the closest ranks, the values are reordered
+float NC_Bootstrap::quantile(vector<float> &values, double level) {
+  double position = level * (values.size() - 1);
+  size_t below = (size_t) position;
+  nth_element(values.begin(), values.begin() + below, values.end());
+  float value = values[below];
+  if (below + 1 >= values.size()) return value;
+  float next = *min_element(values.begin() + below + 1, values.end());
+  return value + (position - below) * (next - value);
+}
@@ -0,0 +1,98 @@
+#pragma once
+// Checkpoints of an incremental analysis: how far the input file was read, and the state of the accumulators at that point
+// Author: Jochen jens Heinrich 2022
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "NC_User.h"
+#include "NC_Analysis.h"
+#include "NC_Trace.h"
+
+using namespace std;
+
+// A checkpoint holds the read position, the dictionaries (the category codes in the accumulators refer to them) and the
+// accumulator states in the order they were given. Reading one back and parsing only what was appended since gives the
+// same accumulators as a pass over the whole file
+class NC_Checkpoint {
+
+public:
+
+  // Written to a temporary file first, so a crash never leaves a broken checkpoint behind
+  static bool write(string file_name, const NC_ReadPosition &position, const NC_Users &users, const vector<NC_Accumulator*> &accumulators);
+  // Restores everything into fresh accumulators, if the checkpoint exists, fits the accumulators, and input_file still starts
+  // with what was read for it. Otherwise false is returned, the accumulators are left untouched and the input has to be read from the start
+  static bool read(string file_name, string input_file, NC_ReadPosition &position, NC_Users &users, const vector<NC_Accumulator*> &accumulators);
+
+private:
+
+  static const uint32_t kVersion = 2;
+
+};
+
+
+bool NC_Checkpoint::write(string file_name, const NC_ReadPosition &position, const NC_Users &users, const vector<NC_Accumulator*> &accumulators) {
+
+  NC_TraceScope trace_scope("writeCheckpoint");
+
+  string temp_name = file_name + ".tmp";
+  FILE *file = fopen(temp_name.c_str(), "wb");
+  if (!file) {
+	printf("...Could not write checkpoint %s\n", file_name.c_str());
+	return false;
+  }
+  uint32_t version = kVersion, n_accumulators = accumulators.size();
+  bool success = fwrite("NCCHECK", 8, 1, file) == 1 && fwrite(&version, sizeof(version), 1, file) == 1
+	&& fwrite(&n_accumulators, sizeof(n_accumulators), 1, file) == 1 && fwrite(&position, sizeof(position), 1, file) == 1;
+  for (const NC_Accumulator *accumulator : accumulators) success = success && accumulator->save(file);
+  success = success && users.writeDictionaries(file);
+  success = fclose(file) == 0 && success;
+  if (!success || rename(temp_name.c_str(), file_name.c_str()) != 0) {
+	printf("...Could not write checkpoint %s\n", file_name.c_str());
+	remove(temp_name.c_str());
+	return false;
+  }
+  printf("Wrote checkpoint %s at line %llu\n", file_name.c_str(), (unsigned long long) position.n_lines);
+
+  return true;
+}
+
+
+bool NC_Checkpoint::read(string file_name, string input_file, NC_ReadPosition &position, NC_Users &users, const vector<NC_Accumulator*> &accumulators) {
+
+  NC_TraceScope trace_scope("readCheckpoint");
+
+  FILE *file = fopen(file_name.c_str(), "rb");
+  if (!file) return false;
+  char magic[8];
+  uint32_t version, n_accumulators;
+  NC_ReadPosition checkpoint_position;
+  bool success = fread(magic, 8, 1, file) == 1 && memcmp(magic, "NCCHECK", 8) == 0 && fread(&version, sizeof(version), 1, file) == 1
+	&& version == kVersion && fread(&n_accumulators, sizeof(n_accumulators), 1, file) == 1 && n_accumulators == accumulators.size()
+	&& fread(&checkpoint_position, sizeof(checkpoint_position), 1, file) == 1;
+  if (success && !NC_Users::extends(input_file, checkpoint_position)) {
+	printf("...Input data file '%s' changed since checkpoint %s was written, starting over\n", input_file.c_str(), file_name.c_str());
+	fclose(file);
+	return false;
+  }
+
+  // The states go into copies first, so nothing changes unless all of them fit
+  vector<unique_ptr<NC_Accumulator>> copies;
+  for (int i_acc = 0; i_acc < accumulators.size() && success; ++i_acc) {
+	copies.emplace_back(accumulators[i_acc]->clone());
+	success = copies.back() && copies.back()->load(file);
+  }
+  success = success && users.readDictionaries(file);
+  fclose(file);
+  if (!success) {
+	printf("...Checkpoint %s does not fit this analysis, starting over\n", file_name.c_str());
+	return false;
+  }
+
+  for (int i_acc = 0; i_acc < accumulators.size(); ++i_acc) accumulators[i_acc]->merge(*copies[i_acc]);
+  position = checkpoint_position;
+  printf("Continuing from checkpoint %s at line %llu\n", file_name.c_str(), (unsigned long long) position.n_lines);
+
+  return true;
+}
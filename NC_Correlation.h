@@ -0,0 +1,794 @@
+#pragma once
+// Exact correlation measures computed directly on the data, without going through binned histograms
+// Author: Jochen jens Heinrich 2022
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+#include "NC_User.h"
+#include "NC_Analysis.h"
+#include "NC_Parallel.h"
+#include "NC_Selection.h"
+#include "NC_Trace.h"
+
+using namespace std;
+
+// First and second moments of a pair of variables, accumulated in a numerically stable way and mergeable,
+// so blocks, batches and threads can each keep their own and combine them at the end
+struct NC_Moments {
+
+  double n = 0.0;
+  double mean_x = 0.0;
+  double mean_y = 0.0;
+  double m2_x = 0.0;
+  double m2_y = 0.0;
+  double c_xy = 0.0;
+
+  void add(double x, double y);
+  template<class TX, class TY> void addBlock(const TX *x, const TY *y, const float *weight, int size);
+  void merge(const NC_Moments &other);
+  double pearson() const;
+
+};
+
+
+// Everything known about the correlation of one covariate with the number of cycles until pregnancy, as plain data
+struct NC_CorrelationResult {
+  string name;
+  string label;
+  string par_name;
+  double n = 0.0;
+  double pearson = 0.0;
+  double spearman = NAN;	// Rank correlations are only available if the values were kept
+  double kendall = NAN;
+  // Effect sizes of categorical covariates, which unlike the correlations do not depend on the order of the categories:
+  // ANOVA F and eta^2 of the cycles until pregnancy, the Kruskal-Wallis H of their ranks and Cramer's V of the pregnancy table.
+  // NAN for numeric covariates
+  double anova_f = NAN;
+  double eta_squared = NAN;
+  double kruskal_wallis = NAN;
+  double cramers_v = NAN;
+  // Permutation test of the correlation (numeric) or eta^2 (categorical), q is adjusted for the false discovery rate over all covariates
+  double p_value = NAN;
+  double q_value = NAN;
+  // Pregnancies per covariate bin and cycle, including under- and overflow bins like a TH2: (x_bins+2) x (n_cycle_bins+2)
+  int x_bins = 0;
+  float x_low = 0.0;
+  float x_high = 0.0;
+  int n_cycle_bins = 0;
+  vector<double> table;
+  vector<string> bin_labels;	// Only for categorical covariates
+  // Average number of cycles until pregnancy per covariate bin
+  vector<double> bin_average;
+  vector<double> bin_average_error;
+
+  double count(int x_bin, int cycle_bin) const { return table[x_bin * (n_cycle_bins+2) + cycle_bin]; }
+  bool categorical() const { return !isnan(eta_squared); }
+};
+
+
+// Rank correlations need all values at once, so they work on complete columns
+class NC_RankCorrelation {
+
+public:
+
+  static double spearman(const vector<float> &x, const vector<float> &y);
+  static double kendall(const vector<float> &x, const vector<float> &y);
+
+private:
+
+  static void averageRanks(const vector<float> &values, vector<double> &ranks);
+  static double countSwaps(vector<float> &values, vector<float> &buffer, size_t begin, size_t end);
+
+};
+
+
+// Function to add a single pair, Welford's update
+void NC_Moments::add(double x, double y) {
+  n += 1.0;
+  double dx = x - mean_x;
+  double dy = y - mean_y;
+  mean_x += dx / n;
+  mean_y += dy / n;
+  m2_x += dx * (x - mean_x);
+  m2_y += dy * (y - mean_y);
+  c_xy += dx * (y - mean_y);
+}
+
+
+// Function to add a block of pairs, entries with weight 0 are skipped. The block is handled in two passes over
+// independent lanes without branches, so the compiler can vectorize the loops, and then merged into the total
+template<class TX, class TY> void NC_Moments::addBlock(const TX *x, const TY *y, const float *weight, int size) {
+
+  const int n_lanes = 8;
+  int n_vec = size / n_lanes * n_lanes;
+
+  // First pass for the block means
+  double sw[n_lanes] = {0.0}, sx[n_lanes] = {0.0}, sy[n_lanes] = {0.0};
+  for (int i = 0; i < n_vec; i += n_lanes) {
+	for (int j = 0; j < n_lanes; ++j) {
+		double w = weight[i+j];
+		sw[j] += w;
+		sx[j] += w * x[i+j];
+		sy[j] += w * y[i+j];
+	}
+  }
+  for (int i = n_vec; i < size; ++i) {
+	sw[0] += weight[i];
+	sx[0] += weight[i] * (double) x[i];
+	sy[0] += weight[i] * (double) y[i];
+  }
+  NC_Moments block;
+  for (int j = 0; j < n_lanes; ++j) {
+	block.n += sw[j];
+	block.mean_x += sx[j];
+	block.mean_y += sy[j];
+  }
+  if (block.n == 0.0) return;
+  block.mean_x /= block.n;
+  block.mean_y /= block.n;
+
+  // Second pass for the centred second moments
+  double sxx[n_lanes] = {0.0}, syy[n_lanes] = {0.0}, sxy[n_lanes] = {0.0};
+  for (int i = 0; i < n_vec; i += n_lanes) {
+	for (int j = 0; j < n_lanes; ++j) {
+		double w = weight[i+j];
+		double dx = x[i+j] - block.mean_x;
+		double dy = y[i+j] - block.mean_y;
+		sxx[j] += w * dx * dx;
+		syy[j] += w * dy * dy;
+		sxy[j] += w * dx * dy;
+	}
+  }
+  for (int i = n_vec; i < size; ++i) {
+	double dx = x[i] - block.mean_x;
+	double dy = y[i] - block.mean_y;
+	sxx[0] += weight[i] * dx * dx;
+	syy[0] += weight[i] * dy * dy;
+	sxy[0] += weight[i] * dx * dy;
+  }
+  for (int j = 0; j < n_lanes; ++j) {
+	block.m2_x += sxx[j];
+	block.m2_y += syy[j];
+	block.c_xy += sxy[j];
+  }
+
+  merge(block);
+
+  return;
+}
+
+
+// Function to combine two sets of moments (Chan et al.)
+void NC_Moments::merge(const NC_Moments &other) {
+  if (other.n == 0.0) return;
+  if (n == 0.0) {
+	*this = other;
+	return;
+  }
+  double total = n + other.n;
+  double dx = other.mean_x - mean_x;
+  double dy = other.mean_y - mean_y;
+  mean_x += dx * other.n / total;
+  mean_y += dy * other.n / total;
+  m2_x += other.m2_x + dx * dx * n * other.n / total;
+  m2_y += other.m2_y + dy * dy * n * other.n / total;
+  c_xy += other.c_xy + dx * dy * n * other.n / total;
+  n = total;
+}
+
+
+double NC_Moments::pearson() const {
+  if (m2_x <= 0.0 || m2_y <= 0.0) return 0.0;
+  return c_xy / sqrt(m2_x * m2_y);
+}
+
+
+// Spearman's rho is the Pearson correlation of the ranks, ties get the average rank
+double NC_RankCorrelation::spearman(const vector<float> &x, const vector<float> &y) {
+  if (x.size() < 2) return 0.0;
+  vector<double> rank_x, rank_y;
+  averageRanks(x, rank_x);
+  averageRanks(y, rank_y);
+
+  NC_Moments moments;
+  const int block_size = 4096;
+  vector<float> weight(block_size, 1.0);
+  for (size_t begin = 0; begin < x.size(); begin += block_size) {
+	int size = min((size_t) block_size, x.size() - begin);
+	moments.addBlock(rank_x.data() + begin, rank_y.data() + begin, weight.data(), size);
+  }
+  return moments.pearson();
+}
+
+
+// Kendall's tau-b in O(n log n) following Knight: sort by x, then count the swaps a merge sort by y needs
+double NC_RankCorrelation::kendall(const vector<float> &x, const vector<float> &y) {
+
+  size_t n = x.size();
+  if (n < 2) return 0.0;
+  vector<size_t> order(n);
+  iota(order.begin(), order.end(), 0);
+  sort(order.begin(), order.end(), [&](size_t a, size_t b) { return x[a] < x[b] || (x[a] == x[b] && y[a] < y[b]); });
+
+  // Pairs tied in x, and tied in both x and y
+  double n_pairs = 0.5 * n * (n-1.0);
+  double ties_x = 0.0, ties_xy = 0.0;
+  vector<float> sorted_y(n);
+  for (size_t i = 0; i < n; ++i) sorted_y[i] = y[order[i]];
+  for (size_t i = 0, j; i < n; i = j) {
+	for (j = i+1; j < n && x[order[j]] == x[order[i]]; ++j) {}
+	ties_x += 0.5 * (j-i) * (j-i-1.0);
+	for (size_t k = i, l; k < j; k = l) {
+		for (l = k+1; l < j && sorted_y[l] == sorted_y[k]; ++l) {}
+		ties_xy += 0.5 * (l-k) * (l-k-1.0);
+	}
+  }
+
+  // Discordant pairs are the swaps needed to sort y
+  vector<float> buffer(n);
+  double swaps = countSwaps(sorted_y, buffer, 0, n);
+
+  // Pairs tied in y
+  double ties_y = 0.0;
+  for (size_t i = 0, j; i < n; i = j) {
+	for (j = i+1; j < n && sorted_y[j] == sorted_y[i]; ++j) {}
+	ties_y += 0.5 * (j-i) * (j-i-1.0);
+  }
+
+  double denominator = sqrt((n_pairs - ties_x) * (n_pairs - ties_y));
+  if (denominator <= 0.0) return 0.0;
+  return (n_pairs - ties_x - ties_y + ties_xy - 2.0 * swaps) / denominator;
+}
+
+
+void NC_RankCorrelation::averageRanks(const vector<float> &values, vector<double> &ranks) {
+  size_t n = values.size();
+  vector<size_t> order(n);
+  iota(order.begin(), order.end(), 0);
+  sort(order.begin(), order.end(), [&](size_t a, size_t b) { return values[a] < values[b]; });
+  ranks.resize(n);
+  for (size_t i = 0, j; i < n; i = j) {
+	for (j = i+1; j < n && values[order[j]] == values[order[i]]; ++j) {}
+	double rank = 0.5 * (i + j - 1) + 1.0;
+	for (size_t k = i; k < j; ++k) ranks[order[k]] = rank;
+  }
+}
+
+
+// Merge sort of values[begin, end) that returns the number of swaps of strictly decreasing pairs
+double NC_RankCorrelation::countSwaps(vector<float> &values, vector<float> &buffer, size_t begin, size_t end) {
+  if (end - begin < 2) return 0.0;
+  size_t middle = begin + (end - begin) / 2;
+  double swaps = countSwaps(values, buffer, begin, middle) + countSwaps(values, buffer, middle, end);
+  size_t left = begin, right = middle, out = begin;
+  while (left < middle && right < end) {
+	if (values[right] < values[left]) {
+		swaps += middle - left;
+		buffer[out++] = values[right++];
+	}
+	else buffer[out++] = values[left++];
+  }
+  while (left < middle) buffer[out++] = values[left++];
+  while (right < end) buffer[out++] = values[right++];
+  copy(buffer.begin() + begin, buffer.begin() + end, values.begin() + begin);
+  return swaps;
+}
+
+
+// Collects everything needed for the correlation of each covariate with the cycles until pregnancy during the pass over
+// the data: exact moments for the Pearson correlation, optionally all values for the rank correlations, and the pregnancy
+// counts per bin for the averages and plots. Only plain data, so copies can run in parallel
+class NC_CorrelationInputs : public NC_Accumulator {
+
+public:
+
+  NC_CorrelationInputs(const vector<NC_Covariate> &covariates, const NC_Users &users, bool rank_correlations = true);
+  ~NC_CorrelationInputs() {}
+  void prepare(const NC_Users &users, int n_threads);
+  void process(const NC_Users &users, int begin, int end);
+  NC_Accumulator *clone() const;
+  void merge(const NC_Accumulator &other);
+  bool save(FILE *file) const;
+  bool load(FILE *file);
+  void remapCodes(NC_Field field, const vector<NC_Code> &codes, int n_codes);
+  NC_CorrelationResult result(int i_covariate) const;
+  vector<NC_CorrelationResult> results(int n_threads = 0) const;
+  // Fills p and q of the results of all covariates from n_permutations shuffles of the cycles among the users of each covariate.
+  // Needs the values kept for the rank correlations, without them p and q stay NAN. Every permutation has its own random
+  // number sequence, so the result only depends on the seed and not on the number of threads
+  void permutationTest(vector<NC_CorrelationResult> &results, int n_permutations, unsigned int seed = 1, int n_threads = 0) const;
+  // Benjamini-Hochberg q-values from the p-values of the results, NAN p-values are left out
+  static void adjustFalseDiscoveryRate(vector<NC_CorrelationResult> &results);
+
+  // Batch interface: one parallel pass over the users for all covariates, then all results at once
+  static vector<NC_CorrelationResult> computeCorrelations(const NC_Users &users, const vector<NC_Covariate> &covariates, int n_threads = 0);
+
+  static const int kNCycleBins = 13;
+
+private:
+
+  // Fills the effect sizes of a categorical covariate from its count and sum tables, only the codes in order take part
+  void effectSizes(int i_covariate, const vector<NC_Code> &order, NC_CorrelationResult &result) const;
+
+  vector<NC_Covariate> m_covariates;
+  // Per covariate the users that enter: pregnant and with a value; made by prepare() and shared with the copies
+  shared_ptr<const vector<NC_Selection>> m_entering;
+  vector<NC_Moments> m_moments;
+  vector<float> m_weight;
+  vector<float> m_cycles;
+
+  bool m_rank_correlations;
+  vector<vector<float>> m_rank_x;
+  vector<vector<float>> m_rank_y;
+
+  // Continuous covariates are counted per bin and cycle, categorical ones per code and cycle
+  const NC_Users &m_users;
+  vector<vector<double>> m_counts;
+  vector<vector<double>> m_code_sums;
+  vector<vector<NC_Code>> m_code_order;
+
+};
+
+
+NC_CorrelationInputs::NC_CorrelationInputs(const vector<NC_Covariate> &covariates, const NC_Users &users, bool rank_correlations) :
+	m_covariates(covariates), m_moments(covariates.size()), m_rank_correlations(rank_correlations),
+	m_rank_x(covariates.size()), m_rank_y(covariates.size()), m_users(users),
+	m_counts(covariates.size()), m_code_sums(covariates.size()), m_code_order(covariates.size()) {
+  for (int i_cov = 0; i_cov < m_covariates.size(); ++i_cov) {
+	if (NC_Users::fieldType(m_covariates[i_cov].field) != kCategoryField)
+		m_counts[i_cov].resize((m_covariates[i_cov].x_bins+2) * (kNCycleBins+2), 0.0);
+  }
+}
+
+
+NC_Accumulator *NC_CorrelationInputs::clone() const {
+  NC_CorrelationInputs *copy = new NC_CorrelationInputs(m_covariates, m_users, m_rank_correlations);
+  copy->m_entering = m_entering;
+  return copy;
+}
+
+
+// The validity bitmap of each covariate intersected with the pregnant users, once for the whole pass
+void NC_CorrelationInputs::prepare(const NC_Users &users, int n_threads) {
+  static const NC_Filter pregnant(string(NC_Users::fieldName(kOutcome)) + "==pregnant");
+  NC_Selection pregnant_users = pregnant.select(users, n_threads);
+  auto entering = make_shared<vector<NC_Selection>>();
+  for (const NC_Covariate &cov : m_covariates) {
+	entering->push_back(NC_Selection::valid(users, cov.field, n_threads));
+	entering->back() &= pregnant_users;
+  }
+  m_entering = entering;
+}
+
+
+void NC_CorrelationInputs::process(const NC_Users &users, int begin, int end) {
+
+  // Used without a pass that prepares it, e.g. block by block from outside NC_Analysis
+  if (!m_entering || (!m_covariates.empty() && (*m_entering)[0].size() != users.number_of_users())) prepare(users, 1);
+
+  const int *n_cycles_trying = users.column<kNCyclesTrying>() + begin;
+  int size = end - begin;
+  m_weight.resize(size);
+  m_cycles.resize(size);
+  for (int i = 0; i < size; ++i) m_cycles[i] = n_cycles_trying[i];
+
+  // Bins follow the same convention as the histogram axes, 0 is underflow and n+1 overflow
+  auto cycle_bin = [](int cycle) { return min(max(cycle, 0), kNCycleBins+1); };
+  auto x_bin = [](const NC_Covariate &cov, double x) {
+	if (x < cov.x_low) return 0;
+	if (!(x < cov.x_high)) return cov.x_bins+1;
+	return 1 + (int) (cov.x_bins * (x - cov.x_low) / (cov.x_high - cov.x_low));
+  };
+
+  for (int i_cov = 0; i_cov < m_covariates.size(); ++i_cov) {
+
+	// Ignore data without parameter information and again only look at women who got pregnant, the selection holds both
+	const NC_Covariate &cov = m_covariates[i_cov];
+	vector<double> &counts = m_counts[i_cov];
+	const NC_Selection &entering = (*m_entering)[i_cov];
+	// The same loop for every numeric storage type of the schema, compiled once per type
+	auto add_numeric = [&](const auto *x) {
+		for (int i = 0; i < size; ++i) m_weight[i] = entering.selected(begin + i);
+		m_moments[i_cov].addBlock(x, m_cycles.data(), m_weight.data(), size);
+		entering.forEach(begin, end, [&](int row) {
+			int i = row - begin;
+			++counts[x_bin(cov, x[i]) * (kNCycleBins+2) + cycle_bin(n_cycles_trying[i])];
+			if (m_rank_correlations) {
+				m_rank_x[i_cov].push_back(x[i]);
+				m_rank_y[i_cov].push_back(m_cycles[i]);
+			}
+		});
+	};
+	if (NC_Users::fieldType(cov.field) == kFloatField) add_numeric(users.floatColumn(cov.field) + begin);
+	else if (NC_Users::fieldType(cov.field) == kIntField) add_numeric(users.intColumn(cov.field) + begin);
+	else {
+		const NC_Code *x = users.codeColumn(cov.field) + begin;
+		vector<double> &sums = m_code_sums[i_cov];
+		// The dictionary can grow between calls when the data is streamed in batches
+		counts.resize(users.dictionary(cov.field)->size() * (kNCycleBins+2), 0.0);
+		sums.resize(users.dictionary(cov.field)->size() * 2, 0.0);
+		entering.forEach(begin, end, [&](int row) {
+			int i = row - begin;
+			double &count = counts[x[i] * (kNCycleBins+2) + cycle_bin(n_cycles_trying[i])];
+			// Remember the order the labels show up in, the bins of the plots follow it
+			if (count == 0.0 && find(m_code_order[i_cov].begin(), m_code_order[i_cov].end(), x[i]) == m_code_order[i_cov].end())
+				m_code_order[i_cov].push_back(x[i]);
+			++count;
+			sums[2*x[i]] += m_cycles[i];
+			sums[2*x[i]+1] += m_cycles[i] * m_cycles[i];
+			if (m_rank_correlations) {
+				m_rank_x[i_cov].push_back(x[i]);
+				m_rank_y[i_cov].push_back(m_cycles[i]);
+			}
+		});
+	}
+  }
+
+  return;
+}
+
+
+// Function to add the state of a copy that processed the users following ours
+void NC_CorrelationInputs::merge(const NC_Accumulator &other) {
+
+  const NC_CorrelationInputs &inputs = dynamic_cast<const NC_CorrelationInputs&>(other);
+
+  for (int i_cov = 0; i_cov < m_covariates.size(); ++i_cov) {
+	m_moments[i_cov].merge(inputs.m_moments[i_cov]);
+	m_rank_x[i_cov].insert(m_rank_x[i_cov].end(), inputs.m_rank_x[i_cov].begin(), inputs.m_rank_x[i_cov].end());
+	m_rank_y[i_cov].insert(m_rank_y[i_cov].end(), inputs.m_rank_y[i_cov].begin(), inputs.m_rank_y[i_cov].end());
+
+	vector<double> &counts = m_counts[i_cov];
+	vector<double> &sums = m_code_sums[i_cov];
+	if (counts.size() < inputs.m_counts[i_cov].size()) counts.resize(inputs.m_counts[i_cov].size(), 0.0);
+	if (sums.size() < inputs.m_code_sums[i_cov].size()) sums.resize(inputs.m_code_sums[i_cov].size(), 0.0);
+	for (int i = 0; i < inputs.m_counts[i_cov].size(); ++i) counts[i] += inputs.m_counts[i_cov][i];
+	for (int i = 0; i < inputs.m_code_sums[i_cov].size(); ++i) sums[i] += inputs.m_code_sums[i_cov][i];
+	for (NC_Code code : inputs.m_code_order[i_cov]) {
+		if (find(m_code_order[i_cov].begin(), m_code_order[i_cov].end(), code) == m_code_order[i_cov].end())
+			m_code_order[i_cov].push_back(code);
+	}
+  }
+
+  return;
+}
+
+
+// Function to write the accumulated state to a partial file; the covariates go along, so it is only loaded into inputs for the same ones
+bool NC_CorrelationInputs::save(FILE *file) const {
+
+  bool success = writeValue(file, (uint32_t) m_covariates.size()) && writeValue(file, m_rank_correlations);
+  for (int i_cov = 0; i_cov < m_covariates.size() && success; ++i_cov) {
+	const NC_Covariate &cov = m_covariates[i_cov];
+	success = writeValue(file, (int32_t) cov.field) && writeValue(file, cov.x_bins) && writeValue(file, cov.x_low) && writeValue(file, cov.x_high)
+		&& writeValue(file, m_moments[i_cov]) && writeVector(file, m_rank_x[i_cov]) && writeVector(file, m_rank_y[i_cov])
+		&& writeVector(file, m_counts[i_cov]) && writeVector(file, m_code_sums[i_cov]) && writeVector(file, m_code_order[i_cov]);
+  }
+
+  return success;
+}
+
+
+bool NC_CorrelationInputs::load(FILE *file) {
+
+  uint32_t n_covariates;
+  bool rank_correlations;
+  if (!readValue(file, n_covariates) || n_covariates != m_covariates.size() || !readValue(file, rank_correlations)
+	|| rank_correlations != m_rank_correlations) return false;
+
+  for (int i_cov = 0; i_cov < m_covariates.size(); ++i_cov) {
+	const NC_Covariate &cov = m_covariates[i_cov];
+	int32_t field;
+	int x_bins;
+	float x_low, x_high;
+	if (!readValue(file, field) || !readValue(file, x_bins) || !readValue(file, x_low) || !readValue(file, x_high)) return false;
+	if (field != cov.field || x_bins != cov.x_bins || x_low != cov.x_low || x_high != cov.x_high) return false;
+	if (!readValue(file, m_moments[i_cov]) || !readVector(file, m_rank_x[i_cov]) || !readVector(file, m_rank_y[i_cov])
+		|| !readVector(file, m_counts[i_cov]) || !readVector(file, m_code_sums[i_cov]) || !readVector(file, m_code_order[i_cov])) return false;
+  }
+
+  return true;
+}
+
+
+void NC_CorrelationInputs::remapCodes(NC_Field field, const vector<NC_Code> &codes, int n_codes) {
+
+  for (int i_cov = 0; i_cov < m_covariates.size(); ++i_cov) {
+	if (m_covariates[i_cov].field != field) continue;
+
+	// Counts and sums move as whole blocks per code
+	vector<double> counts(n_codes * (kNCycleBins+2), 0.0), sums(n_codes * 2, 0.0);
+	for (int code = 0; code * (kNCycleBins+2) < m_counts[i_cov].size(); ++code)
+		copy_n(m_counts[i_cov].begin() + code * (kNCycleBins+2), kNCycleBins+2, counts.begin() + codes[code] * (kNCycleBins+2));
+	for (int code = 0; code * 2 < m_code_sums[i_cov].size(); ++code)
+		copy_n(m_code_sums[i_cov].begin() + code * 2, 2, sums.begin() + codes[code] * 2);
+	m_counts[i_cov] = counts;
+	m_code_sums[i_cov] = sums;
+	for (NC_Code &code : m_code_order[i_cov]) code = codes[code];
+	// For categories the ranked values are the codes themselves
+	for (float &x : m_rank_x[i_cov]) x = codes[(int) x];
+  }
+
+  return;
+}
+
+
+// Function to compute the correlation measures, pregnancy table and bin averages of a covariate
+NC_CorrelationResult NC_CorrelationInputs::result(int i_covariate) const {
+
+  NC_TraceScope trace_scope("correlation");
+  const NC_Covariate &cov = m_covariates[i_covariate];
+  NC_CorrelationResult result;
+  result.name = cov.name;
+  result.label = cov.label;
+  result.par_name = cov.par_name;
+  result.n_cycle_bins = kNCycleBins;
+  NC_Moments moments = m_moments[i_covariate];
+  const vector<float> &rank_x = m_rank_x[i_covariate];
+
+  if (NC_Users::fieldType(cov.field) != kCategoryField) {
+	result.x_bins = cov.x_bins;
+	result.x_low = cov.x_low;
+	result.x_high = cov.x_high;
+	result.table = m_counts[i_covariate];
+	if (m_rank_correlations) {
+		result.spearman = NC_RankCorrelation::spearman(rank_x, m_rank_y[i_covariate]);
+		result.kendall = NC_RankCorrelation::kendall(rank_x, m_rank_y[i_covariate]);
+	}
+  }
+  else {
+	// Categories are placed along x in the order of their labels, so the bins do not depend on the order of the input rows.
+	// Each one contributes a group of constant x; there are as many bins as categories were found
+	const NC_Dictionary *dict = m_users.dictionary(cov.field);
+	vector<NC_Code> order = m_code_order[i_covariate];
+	sort(order.begin(), order.end(), [dict](NC_Code a, NC_Code b) { return dict->label(a) < dict->label(b); });
+	result.x_bins = max((int) order.size(), 1);
+	result.x_low = 0.0;
+	result.x_high = result.x_bins;
+	result.table.assign((result.x_bins+2) * (kNCycleBins+2), 0.0);
+	result.bin_labels.assign(result.x_bins, "");
+	vector<float> position(dict->size(), 0.0);
+	for (int i_pos = 0; i_pos < order.size(); ++i_pos) {
+		NC_Code code = order[i_pos];
+		position[code] = i_pos + 0.5;
+		result.bin_labels[i_pos] = dict->label(code);
+		NC_Moments group;
+		for (int i_cycle = 0; i_cycle < kNCycleBins+2; ++i_cycle) {
+			double count = m_counts[i_covariate][code * (kNCycleBins+2) + i_cycle];
+			result.table[(i_pos+1) * (kNCycleBins+2) + i_cycle] = count;
+			group.n += count;
+		}
+		group.mean_x = position[code];
+		group.mean_y = m_code_sums[i_covariate][2*code] / group.n;
+		group.m2_y = m_code_sums[i_covariate][2*code+1] - group.n * group.mean_y * group.mean_y;
+		moments.merge(group);
+	}
+	if (m_rank_correlations) {
+		vector<float> x(rank_x.size());
+		for (int i = 0; i < rank_x.size(); ++i) x[i] = position[(int) rank_x[i]];
+		result.spearman = NC_RankCorrelation::spearman(x, m_rank_y[i_covariate]);
+		result.kendall = NC_RankCorrelation::kendall(x, m_rank_y[i_covariate]);
+	}
+	effectSizes(i_covariate, order, result);
+  }
+
+  result.n = moments.n;
+  result.pearson = moments.pearson();
+  NC_Trace::count("correlation entries", moments.n);
+
+  // Calculate the mean (and standard deviation) for each x-bin individually, only cycles within the plotted range count
+  result.bin_average.assign(result.x_bins, 0.0);
+  result.bin_average_error.assign(result.x_bins, 0.0);
+  for (int i_bin_x = 1; i_bin_x <= result.x_bins; ++i_bin_x) {
+	double sum_pregnancies = 0.0, sum_cycles = 0.0;
+	for (int i_bin_y = 1; i_bin_y <= kNCycleBins; ++i_bin_y) {
+		sum_pregnancies += result.count(i_bin_x, i_bin_y);
+		sum_cycles += result.count(i_bin_x, i_bin_y) * i_bin_y;
+	}
+	if (sum_pregnancies > 0) {
+		result.bin_average[i_bin_x-1] = sum_cycles / sum_pregnancies;
+		result.bin_average_error[i_bin_x-1] = (sum_cycles / sum_pregnancies) / sqrt(sum_pregnancies);
+	}
+  }
+
+  return result;
+}
+
+
+// The sums hold the exact cycles, so F and eta^2 are exact. The ranks for Kruskal-Wallis come from the table, where everything
+// beyond kNCycleBins shares the overflow bin and counts as tied
+void NC_CorrelationInputs::effectSizes(int i_covariate, const vector<NC_Code> &order, NC_CorrelationResult &result) const {
+
+  const int n_cycle_bins = kNCycleBins+2;
+  const vector<double> &counts = m_counts[i_covariate], &sums = m_code_sums[i_covariate];
+
+  // Margins of the category x cycle table
+  vector<double> n_code(order.size(), 0.0), n_cycle(n_cycle_bins, 0.0);
+  double n = 0.0, sum = 0.0, sum_squares = 0.0;
+  for (int i_code = 0; i_code < order.size(); ++i_code) {
+	const double *row = &counts[order[i_code] * n_cycle_bins];
+	for (int i_cycle = 0; i_cycle < n_cycle_bins; ++i_cycle) {
+		n_code[i_code] += row[i_cycle];
+		n_cycle[i_cycle] += row[i_cycle];
+	}
+	n += n_code[i_code];
+	sum += sums[2*order[i_code]];
+	sum_squares += sums[2*order[i_code]+1];
+  }
+  int n_groups = order.size(), n_columns = count_if(n_cycle.begin(), n_cycle.end(), [](double n_entries) { return n_entries > 0.0; });
+  if (n_groups < 2 || n <= n_groups) {
+	result.anova_f = result.kruskal_wallis = result.cramers_v = NAN;
+	result.eta_squared = 0.0;
+	return;
+  }
+
+  // One-way ANOVA
+  double mean = sum / n, ss_total = sum_squares - n * mean * mean, ss_between = 0.0;
+  for (int i_code = 0; i_code < order.size(); ++i_code) {
+	double group_mean = sums[2*order[i_code]] / n_code[i_code];
+	ss_between += n_code[i_code] * (group_mean - mean) * (group_mean - mean);
+  }
+  double ss_within = max(ss_total - ss_between, 0.0);
+  result.eta_squared = ss_total > 0.0 ? ss_between / ss_total : 0.0;
+  result.anova_f = ss_within > 0.0 ? (ss_between / (n_groups - 1)) / (ss_within / (n - n_groups)) : NAN;
+
+  // Kruskal-Wallis with mid-ranks per cycle bin and the usual correction for ties
+  vector<double> mid_rank(n_cycle_bins);
+  double below = 0.0, ties = 0.0;
+  for (int i_cycle = 0; i_cycle < n_cycle_bins; ++i_cycle) {
+	mid_rank[i_cycle] = below + (n_cycle[i_cycle] + 1.0) / 2.0;
+	below += n_cycle[i_cycle];
+	ties += n_cycle[i_cycle] * n_cycle[i_cycle] * n_cycle[i_cycle] - n_cycle[i_cycle];
+  }
+  double h = 0.0, chi2 = 0.0;
+  for (int i_code = 0; i_code < order.size(); ++i_code) {
+	const double *row = &counts[order[i_code] * n_cycle_bins];
+	double rank_sum = 0.0;
+	for (int i_cycle = 0; i_cycle < n_cycle_bins; ++i_cycle) {
+		rank_sum += row[i_cycle] * mid_rank[i_cycle];
+		// Pearson's chi^2 of the table for Cramer's V
+		if (n_cycle[i_cycle] > 0.0) {
+			double expected = n_code[i_code] * n_cycle[i_cycle] / n;
+			chi2 += (row[i_cycle] - expected) * (row[i_cycle] - expected) / expected;
+		}
+	}
+	h += rank_sum * rank_sum / n_code[i_code];
+  }
+  h = 12.0 / (n * (n + 1.0)) * h - 3.0 * (n + 1.0);
+  double tie_correction = 1.0 - ties / (n * n * n - n);
+  result.kruskal_wallis = tie_correction > 0.0 ? h / tie_correction : NAN;
+  result.cramers_v = n_columns > 1 ? sqrt(chi2 / (n * (min(n_groups, n_columns) - 1))) : NAN;
+
+  return;
+}
+
+
+// Function to compute the results of all covariates, the rank correlations make this worth spreading over the threads
+vector<NC_CorrelationResult> NC_CorrelationInputs::results(int n_threads) const {
+  vector<NC_CorrelationResult> all_results(m_covariates.size());
+  NC_Parallel::forEach(m_covariates.size(), n_threads, [&](int i_cov, int) { all_results[i_cov] = result(i_cov); });
+  return all_results;
+}
+
+
+// The statistic only has to rank the shuffles, so it leaves out everything a permutation does not change: for numeric covariates
+// |sum (x - mean x) * y|, proportional to |pearson|, and for categorical ones sum over categories of (sum y)^2 / n, which orders
+// like eta^2. Both are one pass over the shuffled cycles
+void NC_CorrelationInputs::permutationTest(vector<NC_CorrelationResult> &results, int n_permutations, unsigned int seed, int n_threads) const {
+
+  if (n_permutations < 1 || !m_rank_correlations) return;
+  NC_TraceScope trace_scope("permutationTest");
+  NC_Trace::count("permutations", (long) n_permutations * m_covariates.size());
+
+  // Column statistics that stay the same for all shuffles: centred x, or dense category indices with their sizes
+  vector<vector<float>> centred(m_covariates.size());
+  vector<vector<int>> categories(m_covariates.size());
+  vector<vector<double>> category_sizes(m_covariates.size());
+  for (int i_cov = 0; i_cov < m_covariates.size(); ++i_cov) {
+	const vector<float> &x = m_rank_x[i_cov];
+	if (NC_Users::fieldType(m_covariates[i_cov].field) == kCategoryField) {
+		vector<int> index(m_users.dictionary(m_covariates[i_cov].field)->size() + 1, -1);
+		for (float value : x) {
+			int &category = index[(int) value];
+			if (category < 0) {
+				category = category_sizes[i_cov].size();
+				category_sizes[i_cov].push_back(0.0);
+			}
+			categories[i_cov].push_back(category);
+			++category_sizes[i_cov][category];
+		}
+	}
+	else {
+		double mean = x.empty() ? 0.0 : accumulate(x.begin(), x.end(), 0.0) / x.size();
+		for (float value : x) centred[i_cov].push_back(value - mean);
+	}
+  }
+
+  auto statistic = [&](int i_cov, const vector<float> &y, vector<double> &sums) {
+	int n = y.size();
+	if (categories[i_cov].empty()) {
+		// Independent partial sums, so the products do not wait on each other
+		const float *x = centred[i_cov].data();
+		double partial[4] = {0.0, 0.0, 0.0, 0.0};
+		int i = 0;
+		for (; i + 4 <= n; i += 4) {
+			for (int j = 0; j < 4; ++j) partial[j] += (double) x[i+j] * y[i+j];
+		}
+		for (; i < n; ++i) partial[0] += (double) x[i] * y[i];
+		return fabs(partial[0] + partial[1] + partial[2] + partial[3]);
+	}
+	const int *category = categories[i_cov].data();
+	sums.assign(category_sizes[i_cov].size(), 0.0);
+	for (int i = 0; i < n; ++i) sums[category[i]] += y[i];
+	double between = 0.0;
+	for (int k = 0; k < sums.size(); ++k) between += sums[k] * sums[k] / category_sizes[i_cov][k];
+	return between;
+  };
+
+  // Tasks are blocks of permutations of one covariate
+  const int kPermutationsPerTask = 32;
+  int n_blocks = (n_permutations + kPermutationsPerTask - 1) / kPermutationsPerTask;
+  vector<double> observed(m_covariates.size());
+  vector<long> n_extreme((size_t) m_covariates.size() * n_blocks, 0);
+  for (int i_cov = 0; i_cov < m_covariates.size(); ++i_cov) {
+	vector<double> sums;
+	observed[i_cov] = statistic(i_cov, m_rank_y[i_cov], sums);
+  }
+
+  NC_Parallel::forEach(m_covariates.size() * n_blocks, n_threads, [&](int task, int) {
+	NC_TraceScope task_scope("permutationTask");
+	int i_cov = task / n_blocks, block = task % n_blocks;
+	const vector<float> &cycles = m_rank_y[i_cov];
+	if (cycles.size() < 2) return;
+	vector<float> y;
+	vector<double> sums;
+	// Shuffles that only differ by rounding from the observed order count as at least as extreme
+	double threshold = observed[i_cov] * (1.0 - 1e-9);
+	int end = min(n_permutations, (block+1) * kPermutationsPerTask);
+	for (int permutation = block * kPermutationsPerTask; permutation < end; ++permutation) {
+		seed_seq sequence = {seed, (unsigned int) i_cov, (unsigned int) permutation};
+		mt19937_64 generator(sequence);
+		// Fisher-Yates, with the bounded draw done by a multiplication instead of a division
+		y = cycles;
+		for (uint64_t i = y.size() - 1; i > 0; --i) swap(y[i], y[((generator() >> 32) * (i + 1)) >> 32]);
+		if (statistic(i_cov, y, sums) >= threshold) ++n_extreme[task];
+	}
+  });
+
+  for (int i_cov = 0; i_cov < m_covariates.size() && i_cov < results.size(); ++i_cov) {
+	if (m_rank_y[i_cov].size() < 2) continue;
+	long extreme = accumulate(n_extreme.begin() + (size_t) i_cov * n_blocks, n_extreme.begin() + (size_t) (i_cov+1) * n_blocks, 0L);
+	// The observed order is one of the permutations, so p is never 0
+	results[i_cov].p_value = (extreme + 1.0) / (n_permutations + 1.0);
+  }
+  adjustFalseDiscoveryRate(results);
+
+  return;
+}
+
+
+void NC_CorrelationInputs::adjustFalseDiscoveryRate(vector<NC_CorrelationResult> &results) {
+  vector<int> order;
+  for (int i = 0; i < results.size(); ++i) if (!isnan(results[i].p_value)) order.push_back(i);
+  sort(order.begin(), order.end(), [&](int a, int b) { return results[a].p_value < results[b].p_value; });
+  // q of the i-th smallest p is the smallest p_j * m / j over all j >= i
+  double q = 1.0;
+  for (int rank = order.size(); rank >= 1; --rank) {
+	q = min(q, results[order[rank-1]].p_value * order.size() / rank);
+	results[order[rank-1]].q_value = q;
+  }
+}
+
+
+vector<NC_CorrelationResult> NC_CorrelationInputs::computeCorrelations(const NC_Users &users, const vector<NC_Covariate> &covariates, int n_threads) {
+  NC_CorrelationInputs inputs(covariates, users);
+  NC_Analysis analysis;
+  analysis.add(&inputs);
+  analysis.run(users, n_threads);
+  return inputs.results(n_threads);
+}
@@ -2,7 +2,11 @@
 // Class to take care of the correlation determination and plotting for question 3
 // Author: Jochen jens Heinrich 2022
 
+#include <algorithm>
 #include <iostream>
+#include <memory>
+#include <numeric>
+#include "TROOT.h"
 #include "TH2.h"
 #include "TMath.h"
 #include "TCanvas.h"
@@ -10,6 +14,13 @@
 #include "TColor.h"
 #include "TF1.h"
 #include "TLegend.h"
+#include "TLine.h"
+#include "TLatex.h"
+#include "NC_User.h"
+#include "NC_Analysis.h"
+#include "NC_Correlation.h"
+#include "NC_Plotter.h"
+#include "NC_Trace.h"
 
 using namespace std;
 
@@ -17,64 +28,63 @@ class NC_Correlator {
 
 public:
 
-  NC_Correlator() {}
-  ~NC_Correlator() {}
-  float determineCorrelation(vector<pair<float,float>> parameter, string label, int x_bins, float x_low, float x_high, string par_name);
-  float determineCorrelation(vector<pair<string,float>> parameter, string label, int x_bins, string par_name);
-  void makeCorrelationSummaryGraph(vector<pair<string,float>> correlations);
+  // Like NC_Plotter every correlator owns what it draws, gives the objects names of its own and writes files or pages of a document
+  NC_Correlator(string directory = "", string document = "") : m_directory(directory.empty() ? "" : directory + "/"), m_document(document) {
+	static int n_instances = 0;
+	m_suffix = "_" + to_string(n_instances++);
+  }
+  ~NC_Correlator() { while (!m_objects.empty()) m_objects.pop_back(); }
+  // Computing is done up front with NC_CorrelationInputs::computeCorrelations (or as part of an NC_Analysis), this only draws
+  float plotCorrelation(const NC_CorrelationResult &result);
+  // Bars ordered by the size of the correlation, with the q-value of the permutation test above every bar if there is one
+  void makeCorrelationSummaryGraph(const vector<NC_CorrelationResult> &results, const vector<float> &correlations);
 
 private:
 
   void styleHist(TH2 *hist, string x_label, string y_label, string z_label);
-  float plotCorrelation(TH2 *hist, string label, int x_bins, float x_low, float x_high, string par_name);
-
-};
-
-
-float NC_Correlator::determineCorrelation(vector<pair<float,float>> parameter, string label, int x_bins, float x_low, float x_high, string par_name) {
-
-  // Creating and filling a 2D histogram
-  TH2 *hist = new TH2F("hist","",x_bins,x_low,x_high,13,0.5,13.5);
+  template<class T> T *keep(T *object) { m_objects.emplace_back(object); return object; }
+  string name(string base) const { return base + m_suffix; }
 
-  for (int i = 0; i < parameter.size(); ++i) 
-	hist->Fill(parameter[i].first, parameter[i].second, 1.0);
+  string m_suffix;
+  string m_directory;
+  string m_document;
+  vector<unique_ptr<TObject>> m_objects;
 
-  return plotCorrelation(hist, label, x_bins, x_low, x_high, par_name);
-}
-
-
-float NC_Correlator::determineCorrelation(vector<pair<string,float>> parameter, string label, int x_bins, string par_name) {
+};
 
-  // Creating and filling a 2D histogram
-  TH2 *hist = new TH2F("hist","",x_bins,0.0,x_bins,13,0.5,13.5);
 
-  for (int i = 0; i < parameter.size(); ++i) 
-	hist->Fill(parameter[i].first.c_str(), parameter[i].second, 1.0);
+float NC_Correlator::plotCorrelation(const NC_CorrelationResult &result) {
 
-  return plotCorrelation(hist, label, x_bins, 0.0, x_bins, par_name);
-}
+  NC_TraceScope trace_scope("plotCorrelation");
+  int x_bins = result.x_bins;
+  float x_low = result.x_low, x_high = result.x_high;
+  string par_name = result.par_name + m_suffix;
 
+  // Initialise canvas and graph for plotting, names are made unique per covariate
+  TCanvas *canvas = keep(new TCanvas(("canvas_" + par_name).c_str(),"",0,0,800,600));
 
-float NC_Correlator::plotCorrelation(TH2 *hist, string label, int x_bins, float x_low, float x_high, string par_name) {
-
-  // Initialise canvas and graph for plotting
-  TCanvas *canvas = new TCanvas("canvas","",0,0,800,600);
+  // Rebuild the 2D histogram from the pregnancy table
+  TH2 *hist = keep(new TH2F(("hist_" + par_name).c_str(),"",x_bins,x_low,x_high,result.n_cycle_bins,0.5,result.n_cycle_bins+0.5));
+  hist->SetDirectory(nullptr);
+  for (int i_bin_x = 0; i_bin_x <= x_bins+1; ++i_bin_x) {
+	for (int i_bin_y = 0; i_bin_y <= result.n_cycle_bins+1; ++i_bin_y)
+		hist->SetBinContent(i_bin_x, i_bin_y, result.count(i_bin_x, i_bin_y));
+  }
+  for (int i_bin_x = 0; i_bin_x < result.bin_labels.size(); ++i_bin_x) {
+	if (!result.bin_labels[i_bin_x].empty()) hist->GetXaxis()->SetBinLabel(i_bin_x+1, result.bin_labels[i_bin_x].c_str());
+  }
+  hist->SetEntries(result.n);
 
   // Make plot look a bit nicer
-  styleHist(hist, label, "Number of menstruation cycles", "Pregnancies");
-
-  // Calculate the mean (and standard deviation) for each x-bin individually and put in a hist
-  TH1 *hist_average = new TH1F("hist_average", "", x_bins, x_low, x_high);
-  for (int i_bin_x = 1; i_bin_x <= hist->GetNbinsX(); ++i_bin_x) {
-	int sum_pregnancies = 0;
-	int sum_cycles = 0;
-	for (int i_bin_y = 1; i_bin_y <= hist->GetNbinsY(); ++i_bin_y) {
-		sum_pregnancies += hist->GetBinContent(i_bin_x, i_bin_y);
-		sum_cycles += hist->GetBinContent(i_bin_x, i_bin_y) * hist->GetYaxis()->GetBinCenter(i_bin_y);
-	}
-	if (sum_pregnancies > 0) {
-		hist_average->SetBinContent(i_bin_x, (float) sum_cycles / (float) sum_pregnancies);
-		hist_average->SetBinError(i_bin_x, ((float) sum_cycles / (float) sum_pregnancies) / sqrt((float) sum_pregnancies));
+  styleHist(hist, result.label, "Number of menstruation cycles", "Pregnancies");
+
+  // Put the mean (and standard deviation) for each x-bin in a hist
+  TH1 *hist_average = keep(new TH1F(("hist_average_" + par_name).c_str(), "", x_bins, x_low, x_high));
+  hist_average->SetDirectory(nullptr);
+  for (int i_bin_x = 1; i_bin_x <= x_bins; ++i_bin_x) {
+	if (result.bin_average[i_bin_x-1] > 0) {
+		hist_average->SetBinContent(i_bin_x, result.bin_average[i_bin_x-1]);
+		hist_average->SetBinError(i_bin_x, result.bin_average_error[i_bin_x-1]);
 	}
   }
   hist_average->SetMarkerStyle(20);
@@ -85,41 +95,47 @@ float NC_Correlator::plotCorrelation(TH2 *hist, string label, int x_bins, float
   hist->Draw("colz");
   hist_average->Draw("pesame");
 
-  // Use in-built function to get correlation (loss of precision because based on binned date, but acceptable for here)
-  double correlation_factor = hist->GetCorrelationFactor();
+  // The correlation is computed exactly on the unbinned data, the histogram is only for show.
+  // Categories have no order, so their strength is the correlation ratio sqrt(eta^2) instead
+  double correlation_factor = result.categorical() ? sqrt(result.eta_squared) : result.pearson;
   TLatex latex;
   latex.SetTextSize(0.035);
-  char c_text[35];
-  sprintf(c_text, "Correlation factor: %4.2f", correlation_factor);
+  char c_text[120];
+  if (result.categorical()) sprintf(c_text, "#eta^{2}: %5.3f, F: %4.2f, Kruskal-Wallis H: %4.2f, Cramer's V: %5.3f",
+	result.eta_squared, result.anova_f, result.kruskal_wallis, result.cramers_v);
+  else if (isnan(result.spearman)) sprintf(c_text, "Correlation factor: %4.2f", correlation_factor);
+  else sprintf(c_text, "Correlation factor: %4.2f (Spearman %4.2f, Kendall %4.2f)", correlation_factor, result.spearman, result.kendall);
   latex.DrawLatexNDC(0.11,0.93,c_text);
 
   // Fit hist and stylise fit function
-  TF1 *fit;
-  if (fabs(correlation_factor) > 0.10) fit = new TF1("fit", "[0]+[1]*x", x_low, x_high);
-  else if (fabs(correlation_factor) <= 0.10) fit = new TF1("fit", "[0]", x_low, x_high);
+  string fit_name = "fit_" + par_name;
+  TF1 *fit = keep(new TF1(fit_name.c_str(), fabs(correlation_factor) > 0.10 && !result.categorical() ? "[0]+[1]*x" : "[0]", x_low, x_high));
   fit->SetLineColor(1);
   fit->SetLineWidth(3);
-  hist_average->Fit("fit", "R");
+  {
+	NC_TraceScope fit_scope("rootFit");
+	hist_average->Fit(fit, "R");
+  }
   fit->Draw("same");
 
   // Save plot as pdf
-  char output_name[80];
-  sprintf(output_name, "correlation_%s.pdf", par_name.c_str());
-  canvas->Print(output_name, "pdf");
+  NC_Plotter::print(canvas, m_directory, m_document, "correlation_" + result.par_name);
 
   return correlation_factor;
 }
 
 void NC_Correlator::styleHist(TH2 *hist, string x_label, string y_label, string z_label) {
 
-  // Make a nice colour scheme
-  Int_t palette_nominal[200];
-  Double_t Red[]    = {0.9000, 0.4471};
-  Double_t Green[]  = {0.9000, 0.0118};
-  Double_t Blue[]   = {0.9000, 0.3647};
-  Double_t Length[] = {0.0000, 1.0000};
-  Int_t palette_n = TColor::CreateGradientColorTable(2,Length,Red,Green,Blue,200);
-  for (int i = 0; i < 200; ++i) palette_nominal[i] = palette_n+i;
+  // Make a nice colour scheme, every call would add 200 new colours to ROOT so this is done once per session
+  static bool palette_created = false;
+  if (!palette_created) {
+	Double_t Red[]    = {0.9000, 0.4471};
+	Double_t Green[]  = {0.9000, 0.0118};
+	Double_t Blue[]   = {0.9000, 0.3647};
+	Double_t Length[] = {0.0000, 1.0000};
+	TColor::CreateGradientColorTable(2,Length,Red,Green,Blue,200);
+	palette_created = true;
+  }
 
   hist->GetXaxis()->SetTitle(x_label.c_str());
   hist->GetYaxis()->SetTitle(y_label.c_str());
@@ -134,29 +150,23 @@ void NC_Correlator::styleHist(TH2 *hist, string x_label, string y_label, string
 }
 
 
-void NC_Correlator::makeCorrelationSummaryGraph(vector<pair<string,float>> correlations) {
+void NC_Correlator::makeCorrelationSummaryGraph(const vector<NC_CorrelationResult> &results, const vector<float> &correlations) {
 
+  NC_TraceScope trace_scope("plotSummary");
   // Initialise canvas
-  TCanvas *canvas_summary = new TCanvas("canvas_summary","",0,0,800,600);
+  TCanvas *canvas_summary = keep(new TCanvas(name("canvas_summary").c_str(),"",0,0,800,600));
 
   // Create summary histogram
-  TH1 *hist = new TH1F("hist","",correlations.size(),0,correlations.size());
-
-  // Fill histogram ordered according to correlation size
-  int i_bin = 1;
-  while (correlations.size() > 0) {
-	float largest_corr = -1.0;
-	int next_item = -1;
-	for (int i = 0; i < correlations.size(); ++i) {
-		if (fabs(correlations[i].second) > largest_corr) {
-			largest_corr = fabs(correlations[i].second);
-			next_item = i;
-		}
-	}
-	hist->SetBinContent(i_bin,correlations[next_item].second);
-        hist->GetXaxis()->SetBinLabel(i_bin,correlations[next_item].first.c_str());
-	correlations.erase(correlations.begin() + next_item);
-	++i_bin;
+  TH1 *hist = keep(new TH1F(name("hist_summary").c_str(),"",correlations.size(),0,correlations.size()));
+  hist->SetDirectory(nullptr);
+
+  // Fill histogram ordered according to correlation size, equal ones keep their order
+  vector<int> order(correlations.size());
+  iota(order.begin(), order.end(), 0);
+  stable_sort(order.begin(), order.end(), [&](int a, int b) { return fabs(correlations[a]) > fabs(correlations[b]); });
+  for (int i_bin = 1; i_bin <= order.size(); ++i_bin) {
+	hist->SetBinContent(i_bin, correlations[order[i_bin-1]]);
+	hist->GetXaxis()->SetBinLabel(i_bin, results[order[i_bin-1]].name.c_str());
   }
 
   // Stylise plot
@@ -168,26 +178,39 @@ void NC_Correlator::makeCorrelationSummaryGraph(vector<pair<string,float>> corre
   hist->SetMinimum(-0.20);
   hist->GetYaxis()->SetTitle("Correlation factor");
   hist->GetXaxis()->SetLabelSize(0.05);
+  if (!gROOT->GetColor(1701)) new TColor(1701, 0.4471, 0.0118, 0.3647);
   hist->SetFillColor(1701);
   hist->SetStats(false);
   hist->SetBarWidth(0.8);
   hist->Draw("B");
 
   // Draw lines at 0 and +-10%
-  TLine *line_zero = new TLine(0.0, 0.0, 11.0, 0.0);
+  TLine *line_zero = keep(new TLine(0.0, 0.0, correlations.size(), 0.0));
   line_zero->SetLineWidth(2);
   line_zero->Draw();
-  TLine *line_plus = new TLine(0.0, 0.1, 11.0, 0.1);
+  TLine *line_plus = keep(new TLine(0.0, 0.1, correlations.size(), 0.1));
   line_plus->SetLineWidth(2);
   line_plus->SetLineStyle(2);
   line_plus->Draw();
-  TLine *line_minus = new TLine(0.0, -0.1, 11.0, -0.1);
+  TLine *line_minus = keep(new TLine(0.0, -0.1, correlations.size(), -0.1));
   line_minus->SetLineWidth(2);
   line_minus->SetLineStyle(2);
   line_minus->Draw();
 
+  // Significance of every bar, written just beyond its end
+  TLatex latex;
+  latex.SetTextSize(0.025);
+  for (int i_bin = 1; i_bin <= order.size(); ++i_bin) {
+	const NC_CorrelationResult &result = results[order[i_bin-1]];
+	if (isnan(result.q_value)) continue;
+	char c_text[32];
+	sprintf(c_text, "q=%.3f", result.q_value);
+	float value = correlations[order[i_bin-1]];
+	latex.DrawLatex(i_bin - 0.8, value + (value < 0 ? -0.015 : 0.005), c_text);
+  }
+
   // Print canvas to file
-  canvas_summary->Print("correlation_summary.pdf", "pdf");
+  NC_Plotter::print(canvas_summary, m_directory, m_document, "correlation_summary");
 
   return;
 }
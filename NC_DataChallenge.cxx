@@ -2,160 +2,569 @@
 // Author: Jochen jens Heinrich 2022
 
 #include <iostream>
+#include <sstream>
+#include <memory>
 #include "NC_User.h"
+#include "NC_Analysis.h"
+#include "NC_Correlation.h"
+#include "NC_Survival.h"
+#include "NC_Bootstrap.h"
+#include "NC_Quantile.h"
+#include "NC_GroupBy.h"
+#include "NC_Selection.h"
+#include "NC_Fit.h"
+#include "NC_Checkpoint.h"
+#include "NC_Partial.h"
+#include "NC_Results.h"
+#include "NC_PlotQueue.h"
+#include "NC_Trace.h"
+// Compiled with NC_NO_ROOT everything but the plotting works without ROOT, see NC_Main.cxx
+#ifndef NC_NO_ROOT
 #include "NC_Plotter.h"
 #include "NC_Correlator.h"
+#endif
 
 using namespace std;
 
-void NC_DataChallenge() {
+// The three questions of the challenge, any combination can be given to NC_Analyse
+enum NC_Question {
+  kProbability = 1 << 0,	// Chance of getting pregnant within 13 cycles
+  kDuration = 1 << 1,		// How long it usually takes
+  kFactors = 1 << 2,		// Which factors have an impact
+  kAllQuestions = kProbability | kDuration | kFactors
+};
+
+
+// Draw all plots from the numbers of a finished analysis into directory, the current one if it is empty
+// Only the plots for the questions answered in the results are drawn, as PDFs of their own or as the pages of document
+// The plots of the last call stay open and are deleted by the next call, so repeated calls do not pile up objects
+// To draw in the background while the next analysis runs, give the results to an NC_PlotQueue instead
+void NC_PlotResults([[maybe_unused]] const NC_Results &results, [[maybe_unused]] string directory = "", [[maybe_unused]] string document = "") {
+
+#ifdef NC_NO_ROOT
+  printf("...Built without ROOT, no plots are drawn\n");
+#else
+  static unique_ptr<NC_Plotter> nc_plotter;
+  static unique_ptr<NC_Correlator> nc_correlator;
+  nc_plotter.reset(new NC_Plotter(directory, document));
+  nc_correlator.reset(new NC_Correlator(directory, document));
+  string document_file = (directory.empty() ? "" : directory + "/") + document;
+  if (!document.empty()) NC_Plotter::openDocument(document_file);
+
+  if (results.probability_fit.size() == 2) nc_plotter->PlotProbabilityOverCycles(results);
+  if (results.histogram_fit.size() == 2) nc_plotter->DrawHistogram(results);
+
+  if (!results.correlations.empty()) {
+	// Declare a vector that will hold the correlations, and plot all the correlation histograms while we are at it
+	vector<float> vec_correlations;
+	for (int i_cov = 0; i_cov < results.correlations.size(); ++i_cov)
+		vec_correlations.push_back(nc_correlator->plotCorrelation(results.correlations[i_cov]));
+
+	// Lastly, plot a graph that shows the obtained correlation factors and their significance
+	nc_correlator->makeCorrelationSummaryGraph(results.correlations, vec_correlations);
+  }
 
-  // Initialise data handler
-  NC_Users *nc_user = new NC_Users();
-  nc_user->readData("data.list");
+  if (!document.empty()) NC_Plotter::closeDocument(document_file);
+#endif
+}
 
-  // Initialise Plotter
-  NC_Plotter *nc_plotter = new NC_Plotter();
 
-  // Initialise Correlator
-  NC_Correlator *nc_correlator = new NC_Correlator();
+// Draw all plots from a results file written by an earlier (headless) run
+void NC_PlotResults(string results_file, string directory = "", string document = "") {
+  NC_Results results;
+  if (results.readCSV(results_file)) NC_PlotResults(results, directory, document);
+}
+
 
-  const int n_cycles = 15;
+// To determine the impact of a factor we can look at the correlation between the parameter and the time it takes to get pregnant
+// Every field with a covariate in the schema is one, with its binning from there (see NC_Schema.h)
+vector<NC_Covariate> NC_DefaultCovariates() {
+  vector<NC_Covariate> covariates;
+  for (const NC_FieldInfo &info : kNC_Schema) {
+	if (info.covariate) covariates.push_back({info.covariate, info.label, info.par_name, info.field, info.x_bins, info.x_low, info.x_high});
+  }
+  return covariates;
+}
+
+
+// Fits [0]*(1-exp(-[1]*x)) to the cummulative probability and [0]*exp(-[1]*x) to the pregnancies per cycle of all results,
+// in parallel, and fills the fit parameters, the fitted chance within 13 cycles and the percentiles of the fitted distribution
+void NC_FitResults(NC_Results *results, int n_results, int n_threads = 0) {
+
+  NC_TraceScope trace_scope("fits");
+  // Same points, errors and ranges as the TF1 fits used to have: the graph between 1 and n_cycles,
+  // the histogram with sqrt(N) errors, where empty bins drop out, between 0.5 and n_cycles
+  vector<NC_FitSeries> probability_series(n_results), histogram_series(n_results);
+  for (int i = 0; i < n_results; ++i) {
+	int size = results[i].n_cycles;
+	NC_FitSeries &probability = probability_series[i], &histogram = histogram_series[i];
+	probability.x_low = 1.0;
+	probability.x_high = histogram.x_high = size;
+	histogram.x_low = 0.5;
+	for (int j = 0; j < size; ++j) {
+		probability.x.push_back(j+1);
+		probability.y.push_back(results[i].cumulative_probability[j]);
+		probability.error.push_back(results[i].cumulative_uncertainty[j]);
+		double count = j+1 < results[i].cycle_histogram.size() ? results[i].cycle_histogram[j+1] : 0.0;
+		histogram.x.push_back(j+1);
+		histogram.y.push_back(count);
+		histogram.error.push_back(sqrt(count));
+	}
+  }
+  vector<NC_FitResult> probability_fits = NC_Fitter::fit<NC_SaturationModel>(probability_series, n_threads);
+  vector<NC_FitResult> histogram_fits = NC_Fitter::fit<NC_DecayModel>(histogram_series, n_threads);
+
+  for (int i = 0; i < n_results; ++i) {
+	const NC_FitResult &probability = probability_fits[i], &histogram = histogram_fits[i];
+	NC_Trace::count("fit iterations", probability.n_iterations + histogram.n_iterations);
+	results[i].probability_fit.assign(probability.parameters, probability.parameters+2);
+	results[i].probability_fit_error.assign(probability.errors, probability.errors+2);
+	results[i].probability_at_13 = NC_SaturationModel::value(13.0, probability.parameters);
+	results[i].histogram_fit.assign(histogram.parameters, histogram.parameters+2);
+	results[i].histogram_fit_error.assign(histogram.errors, histogram.errors+2);
+
+	// The percentiles of the exponential straight from the inverse of its CDF
+	results[i].percentile_levels = {0.50, 0.80, 0.95};
+	results[i].percentiles = NC_Quantile::exponential(histogram.parameters[1], 1.0, results[i].n_cycles, results[i].percentile_levels);
+  }
+
+  return;
+}
+
+
+// Turns the filled accumulators into the numbers for the given questions, see NC_Analyse
+NC_Results NC_Summarise(const NC_Survival &survival, const NC_CycleHistogram &cycle_histogram, const NC_Bootstrap &bootstrap,
+		const NC_CorrelationInputs &correlation_inputs, int n_cycles, int n_threads, int n_resamples, float bootstrap_level, int questions,
+		int n_permutations = 0) {
+
+  // Everything that comes out of the analysis ends up here
+  NC_Results results;
+  if (!(questions & kProbability)) n_resamples = 0;
 
 ////////////////////////////////////////////////////////////
 // What is the chance of getting pregnant within 13 cycles?
 ////////////////////////////////////////////////////////////
 
-  // Counter for number of women attempting the get pregnant within the indexed cycle
-  int all_attempts[n_cycles] = {0};
-  // Counter of women who became pregnant within the indexed cycle
-  int pregnancies[n_cycles] = {0};
+  // Kaplan-Meier curve over all cycles in the data, women who did not get pregnant are censored after their last cycle
+  NC_SurvivalCurve survival_curve = survival.curve();
+  results.survival_at_risk.assign(survival_curve.at_risk.begin(), survival_curve.at_risk.end());
+  results.survival_events.assign(survival_curve.events.begin(), survival_curve.events.end());
+  results.survival = survival_curve.survival;
+  for (double variance : survival_curve.variance) results.survival_error.push_back(sqrt(variance));
+
+  // From it the cummulative probability for a pregnancy (with Greenwood uncertainty) in the studied range, and fit it
+  results.n_cycles = n_cycles;
+  survival.getProbability(n_cycles, results.cumulative_probability, results.cumulative_uncertainty);
+
+  // Cross-check of the uncertainty by resampling the users
+  results.n_resamples = n_resamples;
+  results.bootstrap_level = bootstrap_level;
+  bootstrap.getBands(n_resamples, bootstrap_level, results.probability_lower, results.probability_upper, 1, n_threads);
+  if (n_resamples > 0 && n_cycles >= 13)
+	printf("Chance of getting pregnant within 13 cycles is %4.1f%% (%2.0f%% bootstrap interval %4.1f%% - %4.1f%%)\n\n",
+		results.cumulative_probability[12], bootstrap_level*100.0, results.probability_lower[12], results.probability_upper[12]);
 
-  // Loop over all data items
-  for (int i = 0; i < nc_user->number_of_users(); ++i) {
+////////////////////////////////////////////////////////////
+// How long does it usually take to get pregnant?
+////////////////////////////////////////////////////////////
 
-	// Only consider women who are actively trying,i.e. intercourse_frequency > 0
-	// FIXME Assume a lot of women do not log intercourse
-	//if (nc_user->intercourse_frequency(i) == 0) continue;
-	
-	// Increase all_attempts counter for all cycles the woman used NC	
-	for (int i_cycle = 0; i_cycle < nc_user->n_cycles_trying(i); ++i_cycle) 
-		++all_attempts[i_cycle];
-	// Note the cycle the woman got pregnant
-	if (nc_user->outcome(i) == "pregnant") ++pregnancies[nc_user->n_cycles_trying(i)-1];
+  // Take over the cycle numbers of the pregnancies
+  results.cycle_histogram.assign(cycle_histogram.counts().begin(), cycle_histogram.counts().end());
 
+  // Both fits at once, but only the ones asked for are kept
+  NC_FitResults(&results, 1, n_threads);
+  if (questions & kProbability) printf("\nChance of getting pregnant within 13 cycles from fit is %4.3f\n\n", results.probability_at_13);
+  else {
+	results.probability_fit.clear();
+	results.probability_fit_error.clear();
+	results.probability_at_13 = NAN;
+  }
+  if (!(questions & kDuration)) {
+	results.histogram_fit.clear();
+	results.histogram_fit_error.clear();
+	results.percentile_levels.clear();
+	results.percentiles.clear();
   }
 
-  // From the counts calculate the cummulative probability for a pregnancy (with uncertainty)
-  float cummulative_probability[n_cycles], cumm_uncertainty[n_cycles];
-  float cumm_prob = 0.0, cumm_uncert = 0.0;
+  // Because its interesting, let's compare the percentiles of the fit to the pregnancies themselves
+  vector<double> contents(results.cycle_histogram.begin()+1, results.cycle_histogram.begin()+1+n_cycles);
+  results.empirical_percentiles = NC_Quantile::histogram(contents, 0.5, n_cycles+0.5, results.percentile_levels);
+  for (int i_perc = 0; i_perc < results.percentiles.size(); ++i_perc)
+	printf("The %4.2f percentile corresponds to %4.2f cycles (%4.2f in the data)\n", results.percentile_levels[i_perc], results.percentiles[i_perc], results.empirical_percentiles[i_perc]);
 
-  for (int j = 0; j < n_cycles; ++j) {
+////////////////////////////////////////////////////////////
+// What factors impact the time it takes to get pregnant?
+////////////////////////////////////////////////////////////
+
+  // Compute all correlations at once
+  if (!(questions & kFactors)) return results;
+  results.correlations = correlation_inputs.results(n_threads);
+
+  // How likely each of them is to come from noise alone, which needs the values of all users
+  correlation_inputs.permutationTest(results.correlations, n_permutations, 1, n_threads);
+  if (!results.correlations.empty() && !isnan(results.correlations[0].p_value)) results.n_permutations = n_permutations;
+  for (const NC_CorrelationResult &result : results.correlations) {
+	double strength = result.categorical() ? sqrt(result.eta_squared) : result.pearson;
+	if (results.n_permutations > 0) printf("%-24s %s %6.3f   p = %.4f   q = %.4f\n", result.name.c_str(), result.categorical() ? "eta" : "r  ",
+		strength, result.p_value, result.q_value);
+	else printf("%-24s %s %6.3f\n", result.name.c_str(), result.categorical() ? "eta" : "r  ", strength);
+  }
+
+  return results;
+}
 
-	// Calculate cummulative probability for pregnancy
-	float frac = (float) pregnancies[j] / (float) all_attempts[j];
-	cumm_prob = cumm_prob+((1.0-cumm_prob)*frac);
-	cummulative_probability[j] = cumm_prob * 100.0;
 
-	// And also keep track of the associated uncertainty
-	float frac_uncert_sq = frac*(1.0-frac)/((float) all_attempts[j]);
-	cumm_uncert = sqrt( (1.0-cumm_prob)*(1.0-frac)*frac_uncert_sq + (1.0-frac)*(1.0-frac)*cumm_uncert*cumm_uncert);
-	cumm_uncertainty[j] = cumm_uncert * 100.0;
+// Runs the analysis for the given questions (all three by default) and returns the numbers, nothing is drawn
+// With streaming = true the users are read from file_name batch by batch, otherwise they have to be loaded already
+// The cummulative probability gets a bootstrap band from n_resamples resamples, 0 switches the bootstrap off
+// Only the users selected by filter are analysed, see NC_Selection.h
+// Every correlation gets a p-value from n_permutations shuffles of the cycles, as long as the users are loaded and not streamed
+// Loaded users also get a hazard regression on all covariates at once, see NC_Hazard.h
+NC_Results NC_Analyse(NC_Users &users, const vector<NC_Covariate> &covariates, int n_cycles = 15, int n_threads = 0, bool streaming = false, string file_name = "",
+		int n_resamples = 2000, float bootstrap_level = 0.95, int questions = kAllQuestions, const NC_Filter &filter = NC_Filter(),
+		int n_permutations = 1000) {
+
+  // Loaded users are filtered once up front, streamed ones batch by batch below
+  if (!streaming && !filter.empty()) {
+	NC_Users selected;
+	filter.apply(users, selected, n_threads);
+	return NC_Analyse(selected, covariates, n_cycles, n_threads, false, file_name, n_resamples, bootstrap_level, questions, NC_Filter(), n_permutations);
   }
 
-  // Hand over to plotting
-  nc_plotter->PlotProbabilityOverCycles(n_cycles, cummulative_probability, cumm_uncertainty);
+  // Everything needed for the three questions is collected in a single pass over the users
+  NC_Survival survival;
+  NC_CycleHistogram cycle_histogram(n_cycles);
+  NC_Bootstrap bootstrap(n_cycles);
+  // Rank correlations need all values in memory, so they are skipped when streaming
+  NC_CorrelationInputs correlation_inputs(covariates, users, !streaming);
+
+  // The survival curve and the histogram are cheap and the fits need both, the rest is only collected when asked for
+  NC_Analysis analysis;
+  analysis.add(&survival);
+  analysis.add(&cycle_histogram);
+  if ((questions & kProbability) && n_resamples > 0) analysis.add(&bootstrap);
+  if (questions & kFactors) analysis.add(&correlation_inputs);
+  NC_Users selected;
+  auto process_batch = [&](const NC_Users &batch) {
+	if (filter.empty()) analysis.run(batch, n_threads);
+	else {
+		vector<int> rows = filter.select(batch, n_threads).rows();
+		selected.selectRows(batch, rows.data(), rows.size(), n_threads);
+		analysis.run(selected, n_threads);
+	}
+  };
+  if (streaming) users.streamData(file_name, process_batch, 64 << 20, n_threads);
+  else analysis.run(users, n_threads);
+
+  NC_Results results = NC_Summarise(survival, cycle_histogram, bootstrap, correlation_inputs, n_cycles, n_threads, n_resamples, bootstrap_level, questions, n_permutations);
+  if (streaming || !(questions & kFactors)) return results;
+
+  // The effect of every factor with the others held fixed, which the correlations one by one can not tell apart
+  results.hazard = NC_HazardRegression(covariates, n_cycles).fit(users, n_threads);
+  printf("Hazard regression on %ld users, %ld cycles%s\n", results.hazard.n_users, results.hazard.n_user_cycles,
+	results.hazard.converged ? "" : " (not converged)");
+  for (const NC_HazardCoefficient &coefficient : results.hazard.coefficients)
+	printf("%-40s %8.4f +- %6.4f   HR = %6.3f   p = %.4f\n", coefficient.name.c_str(), coefficient.estimate, coefficient.error,
+		coefficient.hazard_ratio, coefficient.p_value);
+
+  return results;
+}
 
-////////////////////////////////////////////////////////////
-// How long does it usually take to get pregnant?
-////////////////////////////////////////////////////////////
 
-  // Create a histogram
-  TH1 *hist_pregnancy_cycle = new TH1F("hist_pregnancy_cycle", "Cycles until pregnancy", n_cycles, 0.5, n_cycles+0.5);
+// Analysis of an input file that only ever grows: the accumulators are restored from checkpoint_file, only the rows appended
+// since the checkpoint was written are read, and the new state is written back, so a refresh costs time in proportion to the new rows.
+// All accumulators are kept whatever the questions, so later runs can ask for any of them. Rank correlations would need every
+// value ever read and are left out, as when streaming
+NC_Results NC_AnalyseIncremental(string file_name, string checkpoint_file, const vector<NC_Covariate> &covariates, int n_cycles = 15,
+		int n_threads = 0, int n_resamples = 2000, float bootstrap_level = 0.95, int questions = kAllQuestions) {
+
+  NC_Users users;
+  NC_Survival survival;
+  NC_CycleHistogram cycle_histogram(n_cycles);
+  NC_Bootstrap bootstrap(n_cycles);
+  NC_CorrelationInputs correlation_inputs(covariates, users, false);
+  vector<NC_Accumulator*> accumulators = {&survival, &cycle_histogram, &bootstrap, &correlation_inputs};
+
+  NC_ReadPosition position;
+  NC_Checkpoint::read(checkpoint_file, file_name, position, users, accumulators);
+  users.readAppended(file_name, position, n_threads);
+
+  NC_Analysis analysis;
+  for (NC_Accumulator *accumulator : accumulators) analysis.add(accumulator);
+  analysis.run(users, n_threads);
+  NC_Checkpoint::write(checkpoint_file, position, users, accumulators);
+
+  return NC_Summarise(survival, cycle_histogram, bootstrap, correlation_inputs, n_cycles, n_threads, n_resamples, bootstrap_level, questions);
+}
+
+
+// Turns the filled accumulators of one group into its numbers, the fits are left to NC_FitResults
+NC_Results NC_SummariseGroup(string label, const NC_Survival &survival, const NC_CycleHistogram &cycle_histogram,
+		const NC_CorrelationInputs &correlation_inputs, int n_cycles) {
+
+  NC_Results results;
+  results.group = label;
+
+  NC_SurvivalCurve survival_curve = survival.curve();
+  results.survival_at_risk.assign(survival_curve.at_risk.begin(), survival_curve.at_risk.end());
+  results.survival_events.assign(survival_curve.events.begin(), survival_curve.events.end());
+  results.survival = survival_curve.survival;
+  for (double variance : survival_curve.variance) results.survival_error.push_back(sqrt(variance));
+  results.n_cycles = n_cycles;
+  survival.getProbability(n_cycles, results.cumulative_probability, results.cumulative_uncertainty);
+
+  const vector<int> &counts = cycle_histogram.counts();
+  results.cycle_histogram.assign(counts.begin(), counts.end());
+  results.percentile_levels = {0.50, 0.80, 0.95};
+  vector<double> contents(results.cycle_histogram.begin()+1, results.cycle_histogram.begin()+1+n_cycles);
+  results.empirical_percentiles = NC_Quantile::histogram(contents, 0.5, n_cycles+0.5, results.percentile_levels);
 
-  // Loop over all data items
-  for (int i = 0; i < nc_user->number_of_users(); ++i) {
-  
-	// Women who did not get pregnant can be ignored for this question
-	if (nc_user->outcome(i) == "not_pregnant") continue;
+  results.correlations = correlation_inputs.results(1);
 
-	// Fill histogram with the cycle numbers of the pregnancy
-	// FIXME Could also do this in days, but only have cycle information for point of pregnancy so no need to pretend to have a more precise number than we do
-	hist_pregnancy_cycle->Fill(nc_user->n_cycles_trying(i));
+  return results;
+}
+
+
+// Stratified analysis: survival curve, pregnancy histogram, fits, percentiles and correlations for every non-empty group
+// of users, all from one pass over the users sorted by group. Bootstrap bands are left to the analysis of all users
+vector<NC_Results> NC_AnalyseGroups(const NC_Users &users, const vector<NC_GroupKey> &keys, const vector<NC_Covariate> &covariates,
+		int n_cycles = 15, int n_threads = 0) {
+
+  NC_GroupBy grouping(users, keys, n_threads);
+  NC_Survival survival;
+  NC_CycleHistogram cycle_histogram(n_cycles);
+  NC_CorrelationInputs correlation_inputs(covariates, grouping.users());
+  vector<vector<unique_ptr<NC_Accumulator>>> accumulators = grouping.run({&survival, &cycle_histogram, &correlation_inputs}, n_threads);
+
+  vector<int> groups;
+  for (int group = 0; group < grouping.numberOfGroups(); ++group) {
+	if (!accumulators[group].empty()) groups.push_back(group);
   }
 
-  // Hand over histogram to plotter
-  nc_plotter->DrawHistogram(n_cycles, hist_pregnancy_cycle);
+  vector<NC_Results> strata(groups.size());
+  NC_Parallel::forEach(groups.size(), n_threads, [&](int i_group, int) {
+	int group = groups[i_group];
+	strata[i_group] = NC_SummariseGroup(grouping.groupLabel(group), dynamic_cast<const NC_Survival&>(*accumulators[group][0]),
+		dynamic_cast<const NC_CycleHistogram&>(*accumulators[group][1]), dynamic_cast<const NC_CorrelationInputs&>(*accumulators[group][2]), n_cycles);
+  });
+
+  NC_FitResults(strata.data(), strata.size(), n_threads);
+
+  printf("Analysed %zu non-empty groups out of %d\n", strata.size(), grouping.numberOfGroups());
+  return strata;
+}
+
+
+// Map step of a distributed analysis: the accumulators of one shard of the users, written to partial_file for NC_MergePartials.
+// Several shards can go into one partial. With group keys every group gets accumulators of its own as well
+bool NC_WritePartial(const vector<string> &file_names, string partial_file, const vector<NC_Covariate> &covariates, int n_cycles = 15,
+		const vector<NC_GroupKey> &keys = vector<NC_GroupKey>(), int n_threads = 0) {
+
+  NC_Partial partial(covariates, n_cycles, keys);
+  for (const string &file_name : file_names) partial.analyse(file_name, n_threads);
+  return partial.write(partial_file);
+}
+
+
+// Reduce step: reads the partials in parallel and merges them pairwise in a tree, neighbours first, so the result is the same
+// as merging them one after the other in the given order. Returns nullptr if any of them cannot be read or they do not fit together
+unique_ptr<NC_Partial> NC_MergePartials(const vector<string> &partial_files, int n_threads = 0) {
+
+  vector<unique_ptr<NC_Partial>> partials(partial_files.size());
+  NC_Parallel::forEach(partial_files.size(), n_threads, [&](int i_file, int) { partials[i_file] = NC_Partial::read(partial_files[i_file]); });
+  for (const unique_ptr<NC_Partial> &partial : partials) if (!partial) return nullptr;
+  if (partials.empty()) return nullptr;
+
+  for (int stride = 1; stride < partials.size(); stride *= 2) {
+	int n_pairs = (partials.size() + 2*stride - 1) / (2*stride);
+	NC_Parallel::forEach(n_pairs, n_threads, [&](int pair, int) {
+		int left = 2 * stride * pair, right = left + stride;
+		if (right >= partials.size()) return;
+		partials[left]->merge(*partials[right]);
+		partials[right].reset();
+	});
+  }
+  printf("Merged %zu partial results\n", partial_files.size());
+
+  return move(partials[0]);
+}
+
+
+// The numbers for all users of a merged partial, the same as NC_Analyse on all shards at once without rank correlations
+NC_Results NC_Summarise(const NC_Partial &partial, int n_threads = 0, int n_resamples = 2000, float bootstrap_level = 0.95,
+		int questions = kAllQuestions) {
+  return NC_Summarise(partial.survival(), partial.cycleHistogram(), partial.bootstrap(), partial.correlationInputs(),
+	partial.numberOfCycles(), n_threads, n_resamples, bootstrap_level, questions);
+}
 
-////////////////////////////////////////////////////////////
-// What factors impact the time it takes to get pregnant?
-////////////////////////////////////////////////////////////
 
-  // To determine the impact of a factor we can look at the correlation between the parameter and the time it takes to get pregnant
-  vector<pair<float,float>> vec_p_bmi, vec_p_age, vec_p_pregnant_before, vec_p_dedication, vec_p_average_cycle_length, vec_p_cycle_length_std, vec_p_intercourse_frequency;
-  vector<pair<string,float>> vec_p_country, vec_p_education, vec_p_sleeping_pattern, vec_p_regular_cycle;
-  for (int i = 0; i < nc_user->number_of_users(); ++i) {
-
-	// Again we ignore the data of women who did not succeed in getting pregnant
-	if (nc_user->outcome(i) == "not_pregnant") continue;
-
-	// Ignore data without parameter information, i.e. if the parameter is set to -1 and fill the vectors
-	if (nc_user->bmi(i) > -1) 
-		vec_p_bmi.push_back(make_pair<float,float>(nc_user->bmi(i),nc_user->n_cycles_trying(i)));
-	if (nc_user->age(i) > -1) 
-		vec_p_age.push_back(make_pair<float,float>(nc_user->age(i),nc_user->n_cycles_trying(i)));
-	if (nc_user->country(i) != "-1") 
-		vec_p_country.push_back(make_pair<string,float>(nc_user->country(i),nc_user->n_cycles_trying(i)));
-	if (nc_user->pregnant_before(i) > -1) 
-		vec_p_pregnant_before.push_back(make_pair<float,float>(nc_user->pregnant_before(i),nc_user->n_cycles_trying(i)));
-	if (nc_user->education(i) != "-1") 
-		vec_p_education.push_back(make_pair<string,float>(nc_user->education(i),nc_user->n_cycles_trying(i)));
-	if (nc_user->sleeping_pattern(i) != "-1") 
-		vec_p_sleeping_pattern.push_back(make_pair<string,float>(nc_user->sleeping_pattern(i),nc_user->n_cycles_trying(i)));
-	if (nc_user->dedication(i) > -1) 
-		vec_p_dedication.push_back(make_pair<float,float>(nc_user->dedication(i),nc_user->n_cycles_trying(i)));
-	if (nc_user->average_cycle_length(i) > -1) 
-		vec_p_average_cycle_length.push_back(make_pair<float,float>(nc_user->average_cycle_length(i),nc_user->n_cycles_trying(i)));
-	if (nc_user->cycle_length_std(i) > -1) 
-		vec_p_cycle_length_std.push_back(make_pair<float,float>(nc_user->cycle_length_std(i),nc_user->n_cycles_trying(i)));
-	if (nc_user->regular_cycle(i) != "-1") 
-		vec_p_regular_cycle.push_back(make_pair<string,float>(nc_user->regular_cycle(i),nc_user->n_cycles_trying(i)));
-	if (nc_user->intercourse_frequency(i) > -1) 
-		vec_p_intercourse_frequency.push_back(make_pair<float,float>(nc_user->intercourse_frequency(i),nc_user->n_cycles_trying(i)));
+// The numbers for every group of a merged partial, as NC_AnalyseGroups would give them
+vector<NC_Results> NC_SummariseGroups(const NC_Partial &partial, int n_threads = 0) {
 
+  vector<NC_Results> strata(partial.numberOfGroups());
+  NC_Parallel::forEach(strata.size(), n_threads, [&](int group, int) {
+	strata[group] = NC_SummariseGroup(partial.groupLabel(group), partial.groupSurvival(group), partial.groupCycleHistogram(group),
+		partial.groupCorrelationInputs(group), partial.numberOfCycles());
+  });
+  NC_FitResults(strata.data(), strata.size(), n_threads);
+
+  return strata;
+}
+
+
+// Group keys are given by the column names of the input file, comma separated; numeric fields need bins:low:high, e.g.
+// country,age:5:20:45. Returns false if any key is invalid
+bool NC_ParseGroupKeys(string group_list, vector<NC_GroupKey> &group_keys) {
+
+  bool valid = true;
+  istringstream keys(group_list);
+  string key_text;
+  while (std::getline(keys, key_text, ',')) {
+	string field_name = key_text.substr(0, key_text.find(':'));
+	int field = 0;
+	while (field < kNFields && field_name != NC_Users::fieldName((NC_Field) field)) ++field;
+	NC_GroupKey group_key = {(NC_Field) field, 0, 0.0, 0.0};
+	bool binned = field < kNFields && NC_Users::fieldType(group_key.field) != kCategoryField;
+	if (binned) sscanf(key_text.c_str() + field_name.size(), ":%d:%f:%f", &group_key.n_bins, &group_key.low, &group_key.high);
+	if (field == kNFields || (binned && (group_key.n_bins < 1 || !(group_key.high > group_key.low)))) {
+		printf("...Invalid group key '%s'\n", key_text.c_str());
+		valid = false;
+	}
+	else group_keys.push_back(group_key);
   }
 
-  // Declare a vector that will hold variable names and correlations
-  vector<pair<string,float>> vec_correlations;
-
-  // Fill vector and plot all the correlation histograms while we are at it
-  vec_correlations.push_back(make_pair<string,float>("BMI",
-	nc_correlator->determineCorrelation(vec_p_bmi, "BMI", 25, 15.0, 40.0, "bmi")));
-  vec_correlations.push_back(make_pair<string,float>("Age",
-	nc_correlator->determineCorrelation(vec_p_age, "Age [years]", 23, 21.5, 44.5, "age")));
-  vec_correlations.push_back(make_pair<string,float>("Country",
-	nc_correlator->determineCorrelation(vec_p_country, "Country", 28, "country")));
-  vec_correlations.push_back(make_pair<string,float>("pregnant_before",
-	nc_correlator->determineCorrelation(vec_p_pregnant_before, "Number of previous pregnancies", 4, -0.5, 3.5, "pregnant_before")));
-  vec_correlations.push_back(make_pair<string,float>("education",
-	nc_correlator->determineCorrelation(vec_p_education, "Education", 5, "education")));
-  vec_correlations.push_back(make_pair<string,float>("sleeping_pattern",
-	nc_correlator->determineCorrelation(vec_p_sleeping_pattern, "Sleeping pattern", 5, "sleeping_pattern")));
-  vec_correlations.push_back(make_pair<string,float>("dedication",
-	nc_correlator->determineCorrelation(vec_p_dedication, "Dedication", 30, 0.0, 1.0, "dedication")));
-  vec_correlations.push_back(make_pair<string,float>("average_cycle_length",
-	nc_correlator->determineCorrelation(vec_p_average_cycle_length, "Average cycle length [days]", 20, 20.0, 40.0, "average_cycle_length")));
-  vec_correlations.push_back(make_pair<string,float>("cycle_length_std",
-	nc_correlator->determineCorrelation(vec_p_cycle_length_std, "Variation of cycle length [days]", 20, 0.0, 9.0, "cycle_length_std")));
-  vec_correlations.push_back(make_pair<string,float>("regular_cycle",
-	nc_correlator->determineCorrelation(vec_p_regular_cycle, "Regular Cycle", 2, "regular_cycle")));
-  vec_correlations.push_back(make_pair<string,float>("intercourse_frequency",
-	nc_correlator->determineCorrelation(vec_p_intercourse_frequency, "Intercourse frequency [per day]", 20, 0.0, 0.8, "intercourse_frequency")));
-
-  // Lastly, plot a graph that shows the obtained correlation factors
-  nc_correlator->makeCorrelationSummaryGraph(vec_correlations);
+  return valid;
+}
+
+
+// With streaming = true the input is processed in batches and never held in memory as a whole, for inputs larger than RAM
+// n_threads = 0 uses all cores
+// If results_file is given all numbers are written to it (.json for JSON, CSV otherwise), make_plots = false skips all drawing
+// With the environment variable NC_TRACE set, the time spent in every stage is summarised at the end (see NC_Trace.h)
+void NC_DataChallenge(string file_name = "data.list", bool streaming = false, int n_threads = 0, string results_file = "", bool make_plots = true) {
+
+  NC_Trace::startFromEnvironment();
+
+  // Initialise data handler
+  NC_Users nc_user;
+  if (!streaming) nc_user.readData(file_name, n_threads);
+
+  NC_Results results = NC_Analyse(nc_user, NC_DefaultCovariates(), 15, n_threads, streaming, file_name);
+
+  if (!results_file.empty()) results.write(results_file);
+  if (make_plots) NC_PlotResults(results);
 
+  NC_Trace::finish();
   cout << "Analysis completed successfully" << endl;
 }
 
 
+// Resident mode: the users are loaded once and every line read from stdin is one request, until 'quit' or end of input
+//   run [cycles=15] [threads=0] [covariates=BMI,Age,...] [resamples=2000] [permutations=1000] [results=file.csv|file.json] [plots=0|1]
+//       [groupby=country,age:5:20:45,...]  numeric fields need bins:low:high, with groups only the results file is written
+//       [filter=outcome==pregnant&&age>=30]  without spaces, see NC_Selection.h
+//       [document=plots.pdf]  all plots as pages of one PDF, plots are drawn in the background and 'done' does not wait for them
+//   wait    blocks until all plots asked for so far are written
+//   reload
+//   trace   prints the time spent per stage so far, if NC_TRACE is set
+//   quit
+void NC_Serve(string file_name = "data.list", int n_threads = 0) {
+
+  NC_Trace::startFromEnvironment();
+  // The plot worker is forked first, while this is the only thread
+  NC_PlotQueue plots([](const NC_Results &results, string directory, string document) { NC_PlotResults(results, directory, document); });
+  NC_Users nc_user;
+  nc_user.readData(file_name, n_threads);
+  const vector<NC_Covariate> all_covariates = NC_DefaultCovariates();
+
+  printf("Ready for requests\n");
+  fflush(stdout);
+  string line;
+  while (std::getline(cin, line)) {
+
+	istringstream request(line);
+	string command;
+	if (!(request >> command)) continue;
+
+	if (command == "quit") break;
+	else if (command == "reload") nc_user.readData(file_name, n_threads);
+	else if (command == "wait") plots.wait();
+	else if (command == "trace") {
+		if (!NC_Trace::enabled()) printf("...Tracing is off, set NC_TRACE to switch it on\n");
+		else NC_Trace::printSummary();
+	}
+	else if (command == "run") {
+
+		// Defaults are the same as for NC_DataChallenge, but without plots
+		int n_cycles = 15, run_threads = n_threads, n_resamples = 2000, n_permutations = 1000;
+		bool make_plots = false, valid = true;
+		string results_file, covariate_list, group_list, filter_expression, document;
+		string option;
+		while (request >> option) {
+			size_t equals = option.find('=');
+			string key = option.substr(0, equals), value = equals == string::npos ? "" : option.substr(equals+1);
+			if (key == "cycles") n_cycles = atoi(value.c_str());
+			else if (key == "threads") run_threads = atoi(value.c_str());
+			else if (key == "covariates") covariate_list = value;
+			else if (key == "resamples") n_resamples = atoi(value.c_str());
+			else if (key == "permutations") n_permutations = atoi(value.c_str());
+			else if (key == "groupby") group_list = value;
+			else if (key == "filter") filter_expression = value;
+			else if (key == "results") results_file = value;
+			else if (key == "plots") make_plots = value != "0";
+			else if (key == "document") document = value;
+			else {
+				printf("...Unknown option '%s'\n", option.c_str());
+				valid = false;
+			}
+		}
+		if (n_cycles < 1) {
+			printf("...Number of cycles has to be positive\n");
+			valid = false;
+		}
+
+		// Pick the requested covariates, all of them if none are given
+		vector<NC_Covariate> covariates = covariate_list.empty() ? all_covariates : vector<NC_Covariate>();
+		istringstream names(covariate_list);
+		string covariate_name;
+		while (std::getline(names, covariate_name, ',')) {
+			int i_cov = 0;
+			while (i_cov < all_covariates.size() && all_covariates[i_cov].name != covariate_name) ++i_cov;
+			if (i_cov < all_covariates.size()) covariates.push_back(all_covariates[i_cov]);
+			else {
+				printf("...Unknown covariate '%s'\n", covariate_name.c_str());
+				valid = false;
+			}
+		}
+
+		vector<NC_GroupKey> group_keys;
+		if (!NC_ParseGroupKeys(group_list, group_keys)) valid = false;
+		NC_Filter filter(filter_expression);
+		if (!filter.valid()) valid = false;
+
+		// The loaded users stay as they are, a filtered request works on a copy of the selected ones
+		NC_Users selected;
+		if (valid && !filter.empty()) filter.apply(nc_user, selected, run_threads);
+		NC_Users &users = filter.empty() ? nc_user : selected;
+
+		if (valid && !group_keys.empty()) {
+			vector<NC_Results> strata = NC_AnalyseGroups(users, group_keys, covariates, n_cycles, run_threads);
+			if (!results_file.empty()) NC_Results::write(results_file, strata);
+		}
+		else if (valid) {
+			NC_Results results = NC_Analyse(users, covariates, n_cycles, run_threads, false, "", n_resamples, 0.95, kAllQuestions, NC_Filter(), n_permutations);
+			if (!results_file.empty()) results.write(results_file);
+			if (make_plots) plots.push(results, "", document);
+		}
+	}
+	else printf("...Unknown command '%s', expected run, wait, reload, trace or quit\n", command.c_str());
+
+	// Every request is answered with a line of its own, so a client knows when to send the next one
+	printf("done\n");
+	fflush(stdout);
+  }
+
+  plots.wait();
+  NC_Trace::finish();
+  return;
+}
@@ -0,0 +1,257 @@
+#pragma once
+// A small least-squares fitter for the two-parameter models of questions 1 and 2, without ROOT and cheap enough to fit every stratum
+// Author: Jochen jens Heinrich 2022
+
+#include <cmath>
+#include <vector>
+#include "NC_Parallel.h"
+
+using namespace std;
+
+// [0]*(1-exp(-[1]*x)), the cummulative pregnancy probability
+struct NC_SaturationModel {
+  static double value(double x, const double *p) { return p[0] * (1.0 - exp(-p[1] * x)); }
+  static void gradient(double x, const double *p, double *g) {
+	double e = exp(-p[1] * x);
+	g[0] = 1.0 - e;
+	g[1] = p[0] * x * e;
+  }
+  // Second derivatives d2/dp0dp0, d2/dp0dp1 and d2/dp1dp1
+  static void hessian(double x, const double *p, double *h) {
+	double e = exp(-p[1] * x);
+	h[0] = 0.0;
+	h[1] = x * e;
+	h[2] = -p[0] * x * x * e;
+  }
+  // The slope falls off like exp(-[1]*x), so the logarithm of the differences between neighbouring points is a straight line
+  static bool linearSlope(const double *x, const double *y, const double *w, int n, double &slope);
+};
+
+
+// [0]*exp(-[1]*x), the pregnancies per cycle
+struct NC_DecayModel {
+  static double value(double x, const double *p) { return p[0] * exp(-p[1] * x); }
+  static void gradient(double x, const double *p, double *g) {
+	double e = exp(-p[1] * x);
+	g[0] = e;
+	g[1] = -p[0] * x * e;
+  }
+  static void hessian(double x, const double *p, double *h) {
+	double e = exp(-p[1] * x);
+	h[0] = 0.0;
+	h[1] = -x * e;
+	h[2] = p[0] * x * x * e;
+  }
+  // log(y) is a straight line with slope -[1]
+  static bool linearSlope(const double *x, const double *y, const double *w, int n, double &slope);
+};
+
+
+struct NC_FitResult {
+  double parameters[2] = {NAN, NAN};
+  double errors[2] = {NAN, NAN};
+  double covariance[2][2] = {{NAN, NAN}, {NAN, NAN}};
+  double chi2 = NAN;
+  int ndf = 0;
+  int n_iterations = 0;
+  bool converged = false;
+};
+
+
+// Points of one series; like a ROOT chi2 fit only points inside [x_low, x_high] with a positive error are used
+struct NC_FitSeries {
+  vector<double> x;
+  vector<double> y;
+  vector<double> error;
+  double x_low;
+  double x_high;
+};
+
+
+// Levenberg-Marquardt on the chi2, with the model fixed at compile time so the inner loop is just the model and its gradient.
+// Parameters and errors are meant to agree with the Minuit fits previously done through TF1 to 1e-4 relative, as both minimise
+// the same chi2 and like HESSE the errors come from the full second derivative of the chi2 at the minimum;
+// NC_CompareFits in NC_Benchmark.cxx checks this on any input file when ROOT is there
+class NC_Fitter {
+
+public:
+
+  template<class Model> static NC_FitResult fit(const NC_FitSeries &series);
+  // Independent series are fitted in parallel
+  template<class Model> static vector<NC_FitResult> fit(const vector<NC_FitSeries> &series, int n_threads = 0);
+  // Weighted straight line fit y = a + b*x, used for the start values; returns false if the points do not fix a line
+  static bool lineFit(const double *x, const double *y, const double *w, int n, double &a, double &b);
+
+private:
+
+  static const int kMaxIterations = 200;
+
+};
+
+
+template<class Model> NC_FitResult NC_Fitter::fit(const NC_FitSeries &series) {
+
+  NC_FitResult result;
+
+  // Select the points
+  vector<double> x, y, w;
+  for (int i = 0; i < series.x.size(); ++i) {
+	if (series.x[i] < series.x_low || series.x[i] > series.x_high || !(series.error[i] > 0.0)) continue;
+	x.push_back(series.x[i]);
+	y.push_back(series.y[i]);
+	w.push_back(1.0 / (series.error[i] * series.error[i]));
+  }
+  int n = x.size();
+  result.ndf = n - 2;
+  if (n < 2) return result;
+
+  // Start values: the slope from the linearised model, then the normalisation in closed form as the model is linear in it
+  double p[2] = {1.0, 0.2};
+  double slope;
+  if (Model::linearSlope(x.data(), y.data(), w.data(), n, slope) && isfinite(slope)) p[1] = slope;
+  double g[2], sum_gy = 0.0, sum_gg = 0.0;
+  p[0] = 1.0;
+  for (int i = 0; i < n; ++i) {
+	Model::gradient(x[i], p, g);
+	sum_gy += w[i] * g[0] * y[i];
+	sum_gg += w[i] * g[0] * g[0];
+  }
+  if (sum_gg > 0.0) p[0] = sum_gy / sum_gg;
+
+  // chi2, gradient and curvature (J^T W J) at p
+  double alpha[2][2], beta[2];
+  auto evaluate = [&](const double *par, bool derivatives) {
+	double chi2 = 0.0;
+	if (derivatives) alpha[0][0] = alpha[0][1] = alpha[1][1] = beta[0] = beta[1] = 0.0;
+	for (int i = 0; i < n; ++i) {
+		double residual = y[i] - Model::value(x[i], par);
+		chi2 += w[i] * residual * residual;
+		if (!derivatives) continue;
+		Model::gradient(x[i], par, g);
+		alpha[0][0] += w[i] * g[0] * g[0];
+		alpha[0][1] += w[i] * g[0] * g[1];
+		alpha[1][1] += w[i] * g[1] * g[1];
+		beta[0] += w[i] * g[0] * residual;
+		beta[1] += w[i] * g[1] * residual;
+	}
+	return chi2;
+  };
+
+  double chi2 = evaluate(p, true), lambda = 1e-3;
+  for (result.n_iterations = 1; result.n_iterations <= kMaxIterations; ++result.n_iterations) {
+
+	// Solve (alpha + lambda*diag(alpha)) delta = beta
+	double a00 = alpha[0][0] * (1.0 + lambda), a11 = alpha[1][1] * (1.0 + lambda), a01 = alpha[0][1];
+	double determinant = a00 * a11 - a01 * a01;
+	if (!(determinant > 0.0)) break;
+	double trial[2] = {p[0] + (a11 * beta[0] - a01 * beta[1]) / determinant, p[1] + (a00 * beta[1] - a01 * beta[0]) / determinant};
+	double trial_chi2 = evaluate(trial, false);
+
+	if (trial_chi2 <= chi2) {
+		bool done = chi2 - trial_chi2 <= 1e-12 * (1.0 + chi2)
+			&& fabs(trial[0] - p[0]) <= 1e-10 * (1.0 + fabs(p[0])) + 1e-6 * sqrt(alpha[1][1] / determinant)
+			&& fabs(trial[1] - p[1]) <= 1e-10 * (1.0 + fabs(p[1])) + 1e-6 * sqrt(alpha[0][0] / determinant);
+		p[0] = trial[0];
+		p[1] = trial[1];
+		chi2 = evaluate(p, true);
+		lambda = max(lambda * 0.1, 1e-12);
+		if (done) {
+			result.converged = true;
+			break;
+		}
+	}
+	else {
+		lambda *= 10.0;
+		// Nowhere left to go, we sit in the minimum up to rounding
+		if (lambda > 1e12) {
+			result.converged = true;
+			break;
+		}
+	}
+  }
+
+  // The covariance is the inverse of half the second derivative of the chi2 at the minimum, as for Minuit with up = 1.
+  // Next to the curvature used for the steps that includes the residuals times the second derivatives of the model
+  double h[3];
+  double curvature[3] = {alpha[0][0], alpha[0][1], alpha[1][1]};
+  for (int i = 0; i < n; ++i) {
+	double residual = y[i] - Model::value(x[i], p);
+	Model::hessian(x[i], p, h);
+	for (int k = 0; k < 3; ++k) curvature[k] -= w[i] * residual * h[k];
+  }
+  if (curvature[0] > 0.0 && curvature[0] * curvature[2] - curvature[1] * curvature[1] > 0.0) {
+	alpha[0][0] = curvature[0];
+	alpha[0][1] = curvature[1];
+	alpha[1][1] = curvature[2];
+  }
+  double determinant = alpha[0][0] * alpha[1][1] - alpha[0][1] * alpha[0][1];
+  result.parameters[0] = p[0];
+  result.parameters[1] = p[1];
+  result.chi2 = chi2;
+  if (determinant > 0.0) {
+	result.covariance[0][0] = alpha[1][1] / determinant;
+	result.covariance[1][1] = alpha[0][0] / determinant;
+	result.covariance[0][1] = result.covariance[1][0] = -alpha[0][1] / determinant;
+	result.errors[0] = sqrt(result.covariance[0][0]);
+	result.errors[1] = sqrt(result.covariance[1][1]);
+  }
+
+  return result;
+}
+
+
+template<class Model> vector<NC_FitResult> NC_Fitter::fit(const vector<NC_FitSeries> &series, int n_threads) {
+  vector<NC_FitResult> results(series.size());
+  NC_Parallel::forEach(series.size(), n_threads, [&](int i_series, int) { results[i_series] = fit<Model>(series[i_series]); });
+  return results;
+}
+
+
+bool NC_Fitter::lineFit(const double *x, const double *y, const double *w, int n, double &a, double &b) {
+  double sw = 0.0, sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+  for (int i = 0; i < n; ++i) {
+	sw += w[i];
+	sx += w[i] * x[i];
+	sy += w[i] * y[i];
+	sxx += w[i] * x[i] * x[i];
+	sxy += w[i] * x[i] * y[i];
+  }
+  double determinant = sw * sxx - sx * sx;
+  if (!(determinant > 0.0)) return false;
+  a = (sxx * sy - sx * sxy) / determinant;
+  b = (sw * sxy - sx * sy) / determinant;
+  return true;
+}
+
+
+bool NC_SaturationModel::linearSlope(const double *x, const double *y, const double *w, int n, double &slope) {
+  // log((y[i+1]-y[i])/(x[i+1]-x[i])) = log([0]*[1]) - [1]*x at the middle of the two points, for rising neighbours only
+  vector<double> xs, ys, ws;
+  for (int i = 0; i+1 < n; ++i) {
+	double dy = y[i+1] - y[i], dx = x[i+1] - x[i];
+	if (!(dy > 0.0 && dx > 0.0)) continue;
+	xs.push_back(0.5 * (x[i] + x[i+1]));
+	ys.push_back(log(dy / dx));
+	ws.push_back(dy * dy * min(w[i], w[i+1]));
+  }
+  double a, b;
+  if (!NC_Fitter::lineFit(xs.data(), ys.data(), ws.data(), xs.size(), a, b)) return false;
+  slope = -b;
+  return slope > 0.0;
+}
+
+
+bool NC_DecayModel::linearSlope(const double *x, const double *y, const double *w, int n, double &slope) {
+  // The error of log(y) is error(y)/y
+  vector<double> xs, ys, ws;
+  for (int i = 0; i < n; ++i) {
+	if (!(y[i] > 0.0)) continue;
+	xs.push_back(x[i]);
+	ys.push_back(log(y[i]));
+	ws.push_back(w[i] * y[i] * y[i]);
+  }
+  double a, b;
+  if (!NC_Fitter::lineFit(xs.data(), ys.data(), ws.data(), xs.size(), a, b)) return false;
+  slope = -b;
+  return true;
+}
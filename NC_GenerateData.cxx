@@ -0,0 +1,136 @@
+// Script to write synthetic input files in the data.list format, for tests and benchmarks of any size
+// Author: Jochen jens Heinrich 2022
+
+#include <iostream>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+#include "NC_User.h"
+#include "NC_Parallel.h"
+
+using namespace std;
+
+// Every chunk of rows is drawn from its own random sequence, so a file only depends on the seed and not on the number of threads.
+// Time to pregnancy follows a beta-geometric model: every woman has her own chance per cycle, which drops with age and
+// unhealthy BMI, and she stops using the app after a random number of cycles, which censors her
+void NC_GenerateData(string file_name = "data_synthetic.list", long n_rows = 100000, unsigned int seed = 1, float missing_fraction = 0.05,
+		bool write_snapshot = false, int n_threads = 0) {
+
+  static const char *countries[] = {"SE", "US", "GB", "DE", "NO", "FI", "DK", "CH", "NL", "FR", "ES", "AU", "CA", "BR"};
+  static const double country_weights[] = {30, 18, 14, 8, 6, 5, 4, 3, 3, 3, 2, 2, 1.5, 0.5};
+  static const double pregnant_before_weights[] = {55, 28, 12, 5};
+  static const char *education[] = {"Elementary", "High_school", "Trade_school", "University", "PhD"};
+  static const double education_weights[] = {4, 25, 14, 50, 7};
+  static const char *sleeping_pattern[] = {"Wake_same_every_day", "Wake_same_every_workday", "Several_times_during_the_night",
+	"Late_and_snoozer", "Shift_worker"};
+  static const double sleeping_pattern_weights[] = {30, 40, 12, 12, 6};
+
+  FILE *file = fopen(file_name.c_str(), "w");
+  if (!file) {
+	printf("...Could not write data file '%s'\n", file_name.c_str());
+	exit (EXIT_FAILURE);
+  }
+  // Header and rows both follow the schema, a field the model below does not draw is written as missing
+  for (const NC_FieldInfo &info : kNC_Schema) fprintf(file, "%s%s", info.name, info.field + 1 < kNFields ? " " : "\n");
+
+  // Rows are formatted in parallel in chunks and written in order, a round of chunks at a time so memory stays bounded
+  const long kRowsPerChunk = 1 << 16;
+  long n_chunks = (n_rows + kRowsPerChunk - 1) / kRowsPerChunk;
+  int n_parallel = NC_Parallel::nThreads(n_threads) * 2;
+  vector<string> buffers(n_parallel);
+  size_t n_bytes = 0;
+
+  for (long first_chunk = 0; first_chunk < n_chunks; first_chunk += n_parallel) {
+	int n_round = min((long) n_parallel, n_chunks - first_chunk);
+	NC_Parallel::forEach(n_round, n_threads, [&](int i_chunk, int) {
+		string &buffer = buffers[i_chunk];
+		buffer.clear();
+		long begin = (first_chunk + i_chunk) * kRowsPerChunk, end = min(n_rows, begin + kRowsPerChunk);
+		long chunk = first_chunk + i_chunk;
+		seed_seq sequence = {seed, (unsigned int) chunk, (unsigned int) (chunk >> 32)};
+		mt19937_64 generator(sequence);
+		uniform_real_distribution<double> uniform(0.0, 1.0);
+
+		for (long i_row = begin; i_row < end; ++i_row) {
+			auto missing = [&](double fraction) { return uniform(generator) < fraction; };
+			auto pick = [&](const double *weights, int n) {
+				double total = 0.0;
+				for (int i = 0; i < n; ++i) total += weights[i];
+				double u = uniform(generator) * total;
+				for (int i = 0; i < n; ++i) {
+					if ((u -= weights[i]) < 0.0) return i;
+				}
+				return n-1;
+			};
+
+			int age = min(50, max(18, (int) lround(normal_distribution<double>(31.5, 4.5)(generator))));
+			double bmi = min(50.0, max(14.0, exp(normal_distribution<double>(log(23.5), 0.15)(generator))));
+			double dedication = min(1.0, exp(normal_distribution<double>(log(0.3), 0.8)(generator)));
+			double intercourse = min(1.0, gamma_distribution<double>(2.0, 0.08)(generator));
+			double average_cycle_length = min(45.0, max(20.0, normal_distribution<double>(29.3, 2.6)(generator)));
+			double cycle_length_std = min(15.0, gamma_distribution<double>(2.5, 1.2)(generator));
+			bool regular = cycle_length_std < 4.5;
+
+			// Chance per cycle from a beta distribution, mean around 0.2
+			double a = gamma_distribution<double>(3.0, 1.0)(generator), b = gamma_distribution<double>(12.0, 1.0)(generator);
+			double chance = a / (a + b);
+			if (age > 35) chance *= exp(-0.08 * (age - 35));
+			if (bmi > 30.0 || bmi < 18.5) chance *= 0.8;
+			chance *= 0.7 + 0.6 * min(intercourse / 0.25, 1.0);
+			// Cycles the woman keeps using the app, a heavy tail of long-term users
+			int follow_up = 1 + (int) geometric_distribution<int>(0.08)(generator);
+			int cycles = 1 + (int) geometric_distribution<int>(min(max(chance, 1e-4), 0.999))(generator);
+			bool pregnant = cycles <= follow_up;
+			if (!pregnant) cycles = follow_up;
+
+			// One text per field of the schema, every field but the index can be missing, the outcome and the cycles only rarely
+			string text[kNFields];
+			for (const NC_FieldInfo &info : kNC_Schema) text[info.field] = info.missing;
+			auto number = [&](NC_Field field, double value, const char *format, double fraction) {
+				char digits[32];
+				if (missing(fraction)) return;
+				snprintf(digits, sizeof(digits), format, value);
+				text[field] = digits;
+			};
+			text[kIndex] = to_string(i_row);
+			if (!missing(missing_fraction)) text[kCountry] = countries[pick(country_weights, 14)];
+			if (!missing(missing_fraction)) text[kPregnantBefore] = kNC_PregnancyLevels[pick(pregnant_before_weights, 4)];
+			if (!missing(missing_fraction)) text[kEducation] = education[pick(education_weights, 5)];
+			if (!missing(missing_fraction)) text[kSleepingPattern] = sleeping_pattern[pick(sleeping_pattern_weights, 5)];
+			number(kBmi, bmi, "%.2f", missing_fraction);
+			number(kAge, age, "%.0f", missing_fraction);
+			number(kNCyclesTrying, cycles, "%.0f", missing_fraction * 0.02);
+			if (!missing(missing_fraction * 0.02)) text[kOutcome] = kNC_OutcomeLevels[pregnant ? kPregnant : kNotPregnant];
+			number(kDedication, dedication, "%.3f", missing_fraction);
+			number(kAverageCycleLength, average_cycle_length, "%.2f", missing_fraction);
+			number(kCycleLengthStd, cycle_length_std, "%.4f", missing_fraction);
+			if (!missing(missing_fraction)) text[kRegularCycle] = regular ? "True" : "False";
+			number(kIntercourseFrequency, intercourse, "%.6f", missing_fraction);
+
+			for (const NC_FieldInfo &info : kNC_Schema) {
+				buffer += text[info.field];
+				buffer += info.field + 1 < kNFields ? ' ' : '\n';
+			}
+		}
+	});
+	for (int i_chunk = 0; i_chunk < n_round; ++i_chunk) {
+		if (fwrite(buffers[i_chunk].data(), 1, buffers[i_chunk].size(), file) != buffers[i_chunk].size()) {
+			printf("...Could not write data file '%s'\n", file_name.c_str());
+			exit (EXIT_FAILURE);
+		}
+		n_bytes += buffers[i_chunk].size();
+	}
+  }
+
+  fclose(file);
+  printf("Wrote %ld rows (%zu bytes) to %s\n", n_rows, n_bytes, file_name.c_str());
+
+  // Reading the file once leaves the binary snapshot next to it
+  if (write_snapshot) {
+	NC_Users users;
+	users.readData(file_name, n_threads);
+  }
+
+  return;
+}
@@ -0,0 +1,209 @@
+#pragma once
+// Splits the users into strata, e.g. by country and age band, and runs the usual accumulators on every stratum
+// Author: Jochen jens Heinrich 2022
+
+#include <iostream>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include "NC_User.h"
+#include "NC_Analysis.h"
+#include "NC_Parallel.h"
+#include "NC_Trace.h"
+
+using namespace std;
+
+// One dimension of a grouping: categorical fields get a group per label plus one for missing values,
+// numeric fields are binned like a histogram axis, with bin 0 for everything below low (including missing) and n_bins+1 above high
+struct NC_GroupKey {
+  NC_Field field;
+  int n_bins;
+  float low;
+  float high;
+};
+
+
+// Every user gets a dense integer group ID, the digits of a mixed-radix number with one digit per key.
+// The users are then sorted by group once, so every group is a contiguous range that any accumulator can process as it is.
+class NC_GroupBy {
+
+public:
+
+  NC_GroupBy(const NC_Users &users, const vector<NC_GroupKey> &keys, int n_threads = 0);
+  ~NC_GroupBy() {}
+  int numberOfGroups() const { return m_offsets.size() - 1; }
+  int groupSize(int group) const { return m_offsets[group+1] - m_offsets[group]; }
+  // e.g. "Country=SE, Age=[30,35)"
+  string groupLabel(int group) const;
+  // The users ordered by group, group g holds the users [m_offsets[g], m_offsets[g+1])
+  const NC_Users &users() const { return m_users; }
+  // Runs clones of the prototypes on every non-empty group in one parallel pass; large groups are split into pieces whose copies
+  // are merged in order. Empty groups get no accumulators
+  vector<vector<unique_ptr<NC_Accumulator>>> run(const vector<NC_Accumulator*> &prototypes, int n_threads = 0) const;
+
+private:
+
+  static const int kPieceSize = 1 << 15;
+  // The offsets and the pass over the groups are dense in the group ID, so its range is kept moderate
+  static const int kMaxGroups = 1 << 20;
+  vector<NC_GroupKey> m_keys;
+  vector<int> m_radices;
+  vector<int> m_strides;
+  vector<int> m_offsets;
+  NC_Users m_users;
+
+};
+
+
+NC_GroupBy::NC_GroupBy(const NC_Users &users, const vector<NC_GroupKey> &keys, int n_threads) : m_keys(keys) {
+
+  NC_TraceScope trace_scope("groupBySort");
+
+  // Strides of the mixed-radix group ID, the last key varies fastest
+  long n_groups = 1;
+  m_radices.resize(m_keys.size());
+  m_strides.resize(m_keys.size());
+  for (int i_key = m_keys.size()-1; i_key >= 0; --i_key) {
+	const NC_GroupKey &key = m_keys[i_key];
+	m_radices[i_key] = NC_Users::fieldType(key.field) == kCategoryField ? users.dictionary(key.field)->size() + 1 : key.n_bins + 2;
+	m_strides[i_key] = n_groups;
+	n_groups *= m_radices[i_key];
+	if (n_groups > kMaxGroups) {
+		printf("...Too many groups, at most %d are supported\n", kMaxGroups);
+		exit (EXIT_FAILURE);
+	}
+  }
+
+  // Group ID of every user, one key at a time so each loop only reads a single column.
+  // Every task takes a contiguous range of users
+  int n_users = users.number_of_users();
+  vector<int> group(n_users, 0);
+  int n_tasks = max(1, min(NC_Parallel::nThreads(n_threads), (n_users + kPieceSize - 1) / kPieceSize));
+  auto task_range = [&](int task, int &begin, int &end) {
+	begin = (long) n_users * task / n_tasks;
+	end = (long) n_users * (task+1) / n_tasks;
+  };
+  // Sort keys: group ID above the row, so sorting them orders by group and keeps the input order within a group
+  vector<uint64_t> sort_keys(n_users);
+  NC_Parallel::forEach(n_tasks, n_threads, [&](int task, int) {
+	int begin, end;
+	task_range(task, begin, end);
+	for (int i_key = 0; i_key < m_keys.size(); ++i_key) {
+		const NC_GroupKey &key = m_keys[i_key];
+		int stride = m_strides[i_key];
+		if (NC_Users::fieldType(key.field) == kCategoryField) {
+			// Missing values (-1) go to the last digit
+			const NC_Code *x = users.codeColumn(key.field);
+			int missing = m_radices[i_key] - 1;
+			for (int i = begin; i < end; ++i) group[i] += (x[i] < 0 ? missing : x[i]) * stride;
+		}
+		else {
+			auto bin = [&key](double x) {
+				if (!(x >= key.low)) return 0;
+				if (!(x < key.high)) return key.n_bins+1;
+				return 1 + min((int) (key.n_bins * (x - key.low) / (key.high - key.low)), key.n_bins-1);
+			};
+			if (NC_Users::fieldType(key.field) == kIntField) {
+				const int *x = users.intColumn(key.field);
+				for (int i = begin; i < end; ++i) group[i] += bin(x[i]) * stride;
+			}
+			else {
+				const float *x = users.floatColumn(key.field);
+				for (int i = begin; i < end; ++i) group[i] += bin(x[i]) * stride;
+			}
+		}
+	}
+	// Only the groups that occur cost anything: each task sorts its own users, memory follows the rows and not the group space
+	for (int i = begin; i < end; ++i) sort_keys[i] = (uint64_t) group[i] << 32 | (uint32_t) i;
+	sort(sort_keys.begin() + begin, sort_keys.begin() + end);
+  });
+
+  // The sorted ranges of the tasks are merged pairwise, a round at a time
+  vector<uint64_t> merged(n_users);
+  for (int width = 1; width < n_tasks; width *= 2) {
+	NC_Parallel::forEach((n_tasks + 2*width - 1) / (2*width), n_threads, [&](int pair, int) {
+		int first, middle, last, unused;
+		task_range(2*width*pair, first, unused);
+		task_range(min(2*width*pair + width, n_tasks) - 1, unused, middle);
+		task_range(min(2*width*(pair+1), n_tasks) - 1, unused, last);
+		merge(sort_keys.begin() + first, sort_keys.begin() + middle, sort_keys.begin() + middle, sort_keys.begin() + last, merged.begin() + first);
+	});
+	sort_keys.swap(merged);
+  }
+
+  // Offsets of the groups from their sizes
+  m_offsets.assign(n_groups+1, 0);
+  for (uint64_t sort_key : sort_keys) ++m_offsets[(sort_key >> 32) + 1];
+  for (int g = 0; g < n_groups; ++g) m_offsets[g+1] += m_offsets[g];
+  vector<int> order(n_users);
+  for (int i = 0; i < n_users; ++i) order[i] = (uint32_t) sort_keys[i];
+
+  m_users.selectRows(users, order.data(), n_users, n_threads);
+}
+
+
+string NC_GroupBy::groupLabel(int group) const {
+
+  string label;
+  char text[64];
+  for (int i_key = 0; i_key < m_keys.size(); ++i_key) {
+	const NC_GroupKey &key = m_keys[i_key];
+	int digit = group / m_strides[i_key] % m_radices[i_key];
+	if (i_key > 0) label += ", ";
+	if (NC_Users::fieldType(key.field) == kCategoryField) {
+		label += string(NC_Users::fieldName(key.field)) + "=" + m_users.dictionary(key.field)->label(digit < m_radices[i_key]-1 ? digit : -1);
+		continue;
+	}
+	double width = (key.high - key.low) / key.n_bins;
+	if (digit == 0) snprintf(text, sizeof(text), "<%g", key.low);
+	else if (digit == key.n_bins+1) snprintf(text, sizeof(text), ">=%g", key.high);
+	else snprintf(text, sizeof(text), "[%g,%g)", key.low + (digit-1)*width, key.low + digit*width);
+	label += string(NC_Users::fieldName(key.field)) + "=" + text;
+  }
+
+  return label;
+}
+
+
+vector<vector<unique_ptr<NC_Accumulator>>> NC_GroupBy::run(const vector<NC_Accumulator*> &prototypes, int n_threads) const {
+
+  NC_TraceScope trace_scope("groupByRun");
+
+  // Pieces of at most kPieceSize users that never cross a group boundary
+  struct Piece { int group; int begin; int end; };
+  vector<Piece> pieces;
+  for (int g = 0; g < numberOfGroups(); ++g) {
+	for (int begin = m_offsets[g]; begin < m_offsets[g+1]; begin += kPieceSize)
+		pieces.push_back({g, begin, min(begin + kPieceSize, m_offsets[g+1])});
+  }
+
+  for (NC_Accumulator *prototype : prototypes) prototype->prepare(m_users, n_threads);
+  vector<vector<unique_ptr<NC_Accumulator>>> piece_accumulators(pieces.size());
+  NC_Parallel::forEach(pieces.size(), n_threads, [&](int i_piece, int) {
+	const Piece &piece = pieces[i_piece];
+	for (NC_Accumulator *prototype : prototypes) {
+		piece_accumulators[i_piece].emplace_back(prototype->clone());
+		if (!piece_accumulators[i_piece].back()) {
+			printf("...Accumulators used with NC_GroupBy have to support clone()\n");
+			exit (EXIT_FAILURE);
+		}
+	}
+	for (int begin = piece.begin; begin < piece.end; begin += NC_Analysis::kBlockSize) {
+		int end = min(begin + NC_Analysis::kBlockSize, piece.end);
+		for (auto &accumulator : piece_accumulators[i_piece]) accumulator->process(m_users, begin, end);
+	}
+  });
+
+  // The first piece of each group takes over the rest, in input order
+  vector<vector<unique_ptr<NC_Accumulator>>> accumulators(numberOfGroups());
+  for (int i_piece = 0; i_piece < pieces.size(); ++i_piece) {
+	vector<unique_ptr<NC_Accumulator>> &group = accumulators[pieces[i_piece].group];
+	if (group.empty()) group = move(piece_accumulators[i_piece]);
+	else {
+		for (int i_acc = 0; i_acc < group.size(); ++i_acc) group[i_acc]->merge(*piece_accumulators[i_piece][i_acc]);
+	}
+  }
+
+  return accumulators;
+}
@@ -0,0 +1,349 @@
+#pragma once
+// Discrete-time hazard regression: the chance to get pregnant in a cycle, given not pregnant before, as a logistic function of all covariates at once
+// Author: Jochen jens Heinrich 2022
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include "NC_User.h"
+#include "NC_Analysis.h"
+#include "NC_Parallel.h"
+#include "NC_Selection.h"
+#include "NC_Trace.h"
+
+using namespace std;
+
+// One fitted parameter. For numeric covariates the estimate is per unit of the covariate, for categories it is relative to the
+// reference category, the most common one. hazard_ratio = exp(estimate)
+struct NC_HazardCoefficient {
+  string name;
+  double estimate = NAN;
+  double error = NAN;
+  double hazard_ratio = NAN;
+  double p_value = NAN;	// Wald test of estimate = 0
+};
+
+
+struct NC_HazardResult {
+  // Log-odds of getting pregnant per cycle for a user at the mean of the numeric covariates and in the reference categories,
+  // up to n_cycles, the last one also holds all later cycles. Cycles where nobody or everybody got pregnant have no finite
+  // log-odds of their own and share theirs with the cycles before, the name tells which cycles are in
+  vector<NC_HazardCoefficient> baseline;
+  vector<NC_HazardCoefficient> coefficients;
+  long n_users = 0;
+  long n_user_cycles = 0;
+  double log_likelihood = NAN;
+  int n_iterations = 0;
+  bool converged = false;
+};
+
+
+// Every user contributes one Bernoulli trial per cycle she tried, with a pregnancy in the last one if her outcome is pregnant;
+// not pregnant users are censored after their last cycle. The model is logit h = alpha[cycle] + beta . x, fitted by Newton-Raphson
+// (IRLS). The user-cycle rows are never stored: the covariates of a user are the same in all her cycles, so each user adds her
+// cycles to the baseline part of the Hessian and a single outer product of x, weighted by the sum over her cycles, to the rest.
+// Users with a missing numeric covariate are left out, missing categories are a category of their own. Like the survival curve
+// the model stops at kNC_MaxCycles: users still trying there are censored at that cycle
+class NC_HazardRegression {
+
+public:
+
+  NC_HazardRegression(const vector<NC_Covariate> &covariates, int n_cycles = 15) : m_covariates(covariates), m_n_cycles(n_cycles) {}
+  ~NC_HazardRegression() {}
+  NC_HazardResult fit(const NC_Users &users, int n_threads = 0) const;
+
+private:
+
+  // One column of the design: a standardised numeric covariate or the indicator of one category
+  struct Term {
+	string name;
+	NC_Field field;
+	NC_Code code;
+	double mean;
+	double scale;
+  };
+  static const int kMaxIterations = 25;
+  static const int kUsersPerTask = 1 << 15;
+
+  vector<Term> makeTerms(const NC_Users &users, const vector<int> &rows) const;
+  // Replaces the symmetric positive definite a by its inverse, through a Cholesky decomposition; false if a is singular
+  static bool invert(vector<double> &a, int n);
+
+  vector<NC_Covariate> m_covariates;
+  int m_n_cycles;
+
+};
+
+
+vector<NC_HazardRegression::Term> NC_HazardRegression::makeTerms(const NC_Users &users, const vector<int> &rows) const {
+
+  vector<Term> terms;
+  for (const NC_Covariate &cov : m_covariates) {
+	NC_FieldType type = NC_Users::fieldType(cov.field);
+	if (type == kCategoryField) {
+		// Counts per code, index 0 is missing
+		const NC_Dictionary *dict = users.dictionary(cov.field);
+		const NC_Code *x = users.codeColumn(cov.field);
+		vector<long> counts(dict->size() + 1, 0);
+		for (int row : rows) ++counts[x[row] + 1];
+		int reference = max_element(counts.begin(), counts.end()) - counts.begin();
+		for (int code = 0; code < counts.size(); ++code) {
+			if (code == reference || counts[code] == 0) continue;
+			string label = code == 0 ? "missing" : dict->label(code - 1);
+			terms.push_back({cov.name + "=" + label, cov.field, (NC_Code) (code - 1), 0.0, 1.0});
+		}
+		continue;
+	}
+	double sum = 0.0, sum_squares = 0.0;
+	for (int row : rows) {
+		double value = type == kFloatField ? users.floatColumn(cov.field)[row] : users.intColumn(cov.field)[row];
+		sum += value;
+		sum_squares += value * value;
+	}
+	double mean = sum / rows.size(), variance = sum_squares / rows.size() - mean * mean;
+	// A covariate without spread cannot be told apart from the baseline
+	if (variance > 1e-12 * max(1.0, mean * mean)) terms.push_back({cov.name, cov.field, 0, mean, sqrt(variance)});
+  }
+
+  return terms;
+}
+
+
+bool NC_HazardRegression::invert(vector<double> &a, int n) {
+
+  // Cholesky decomposition a = L L^T in the lower triangle
+  vector<double> l(n * n, 0.0);
+  for (int i = 0; i < n; ++i) {
+	for (int j = 0; j <= i; ++j) {
+		double sum = a[i*n+j];
+		for (int k = 0; k < j; ++k) sum -= l[i*n+k] * l[j*n+k];
+		if (i == j) {
+			if (!(sum > 0.0)) return false;
+			l[i*n+i] = sqrt(sum);
+		}
+		else l[i*n+j] = sum / l[j*n+j];
+	}
+  }
+  // Inverse of L, then a^-1 = L^-T L^-1
+  vector<double> inverse_l(n * n, 0.0);
+  for (int i = 0; i < n; ++i) {
+	inverse_l[i*n+i] = 1.0 / l[i*n+i];
+	for (int j = 0; j < i; ++j) {
+		double sum = 0.0;
+		for (int k = j; k < i; ++k) sum -= l[i*n+k] * inverse_l[k*n+j];
+		inverse_l[i*n+j] = sum / l[i*n+i];
+	}
+  }
+  for (int i = 0; i < n; ++i) {
+	for (int j = 0; j <= i; ++j) {
+		double sum = 0.0;
+		for (int k = i; k < n; ++k) sum += inverse_l[k*n+i] * inverse_l[k*n+j];
+		a[i*n+j] = a[j*n+i] = sum;
+	}
+  }
+
+  return true;
+}
+
+
+NC_HazardResult NC_HazardRegression::fit(const NC_Users &users, int n_threads) const {
+
+  NC_TraceScope trace_scope("hazardFit");
+  NC_HazardResult result;
+
+  // Users that enter: at least one cycle and all numeric covariates present
+  const int *n_cycles_trying = users.column<kNCyclesTrying>();
+  NC_Selection complete = NC_Filter(string(NC_Users::fieldName(kNCyclesTrying)) + ">=1").select(users, n_threads);
+  for (const NC_Covariate &cov : m_covariates) {
+	if (NC_Users::fieldType(cov.field) != kCategoryField) complete &= NC_Selection::valid(users, cov.field, n_threads);
+  }
+  vector<int> rows = complete.rows();
+  if (rows.empty()) return result;
+
+  vector<Term> terms = makeTerms(users, rows);
+  const NC_Code *outcome = users.column<kOutcome>();
+  result.n_users = rows.size();
+  // Last cycle a user is followed and whether it ended in a pregnancy, both cut at the horizon
+  auto last_cycle_of = [&](int row) { return min(n_cycles_trying[row], kNC_MaxCycles); };
+  auto pregnant_in_last = [&](int row) { return outcome[row] == kPregnant && n_cycles_trying[row] <= kNC_MaxCycles; };
+
+  // Users at risk and pregnancies per cycle, cycles nobody reached get no baseline of their own and all later cycles share the last
+  int max_cycle = 1;
+  for (int row : rows) max_cycle = max(max_cycle, last_cycle_of(row));
+  int last_baseline_cycle = min(m_n_cycles, max_cycle);
+  vector<long> at_risk(last_baseline_cycle + 1, 0), events(last_baseline_cycle + 1, 0);
+  for (int row : rows) {
+	int last_cycle = last_cycle_of(row);
+	for (int cycle = 1; cycle <= min(last_cycle, last_baseline_cycle); ++cycle) ++at_risk[cycle];
+	at_risk[last_baseline_cycle] += max(0, last_cycle - last_baseline_cycle);
+	if (pregnant_in_last(row)) ++events[min(last_cycle, last_baseline_cycle)];
+  }
+  // A new baseline starts once the current one has both pregnancies and users that went on, otherwise the cycle joins it
+  vector<int> baseline_of(last_baseline_cycle + 1, 0), first_cycle(1, 1);
+  long group_at_risk = 0, group_events = 0;
+  for (int cycle = 1; cycle <= last_baseline_cycle; ++cycle) {
+	if (group_events > 0 && group_events < group_at_risk) {
+		first_cycle.push_back(cycle);
+		group_at_risk = group_events = 0;
+	}
+	group_at_risk += at_risk[cycle];
+	group_events += events[cycle];
+	baseline_of[cycle] = first_cycle.size() - 1;
+  }
+  // The last cycles may not have enough left on their own
+  if (first_cycle.size() > 1 && !(group_events > 0 && group_events < group_at_risk)) {
+	for (int cycle = first_cycle.back(); cycle <= last_baseline_cycle; ++cycle) --baseline_of[cycle];
+	first_cycle.pop_back();
+  }
+  int n_baseline = first_cycle.size(), n_terms = terms.size(), n_parameters = n_baseline + n_terms;
+
+  // Start from the same hazard in every cycle, the overall fraction of cycles that ended in a pregnancy
+  long n_events = 0;
+  for (int row : rows) {
+	result.n_user_cycles += last_cycle_of(row);
+	n_events += pregnant_in_last(row);
+  }
+  vector<double> parameters(n_parameters, 0.0);
+  double start = n_events > 0 && n_events < result.n_user_cycles ? log((double) n_events / (result.n_user_cycles - n_events)) : 0.0;
+  fill(parameters.begin(), parameters.begin() + n_baseline, start);
+
+  // Columns of the terms looked up once, the loops below only see pointers; exactly one of them is set per term
+  vector<const float*> float_columns(n_terms);
+  vector<const int*> int_columns(n_terms);
+  vector<const NC_Code*> code_columns(n_terms);
+  for (int i_term = 0; i_term < n_terms; ++i_term) {
+	float_columns[i_term] = users.floatColumn(terms[i_term].field);
+	int_columns[i_term] = users.intColumn(terms[i_term].field);
+	code_columns[i_term] = users.codeColumn(terms[i_term].field);
+  }
+
+  // Per task: log-likelihood, gradient and Hessian, summed in task order so the result does not depend on the number of threads
+  int n_tasks = (rows.size() + kUsersPerTask - 1) / kUsersPerTask;
+  struct Sums { double log_likelihood; vector<double> gradient; vector<double> hessian; };
+  vector<Sums> task_sums(n_tasks);
+  auto evaluate = [&](const vector<double> &par, bool derivatives) {
+	NC_Parallel::forEach(n_tasks, n_threads, [&](int task, int) {
+		NC_TraceScope task_scope("hazardTask");
+		Sums &sums = task_sums[task];
+		sums.log_likelihood = 0.0;
+		sums.gradient.assign(derivatives ? n_parameters : 0, 0.0);
+		sums.hessian.assign(derivatives ? n_parameters * n_parameters : 0, 0.0);
+		vector<double> x(n_terms);
+		int end = min((int) rows.size(), (task+1) * kUsersPerTask);
+		for (int i_row = task * kUsersPerTask; i_row < end; ++i_row) {
+			int row = rows[i_row];
+			// The design row of the user, built here instead of stored
+			double eta = 0.0;
+			for (int i_term = 0; i_term < n_terms; ++i_term) {
+				const Term &term = terms[i_term];
+				if (code_columns[i_term]) x[i_term] = code_columns[i_term][row] == term.code;
+				else if (float_columns[i_term]) x[i_term] = (float_columns[i_term][row] - term.mean) / term.scale;
+				else x[i_term] = (int_columns[i_term][row] - term.mean) / term.scale;
+				eta += x[i_term] * par[n_baseline + i_term];
+			}
+			int last_cycle = last_cycle_of(row);
+			bool pregnant = pregnant_in_last(row);
+			double residual_sum = 0.0, weight_sum = 0.0;
+			// n_trials identical cycles in baseline i_base, the same term each
+			auto add = [&](int i_base, bool event, double n_trials) {
+				double z = par[i_base] + eta;
+				// log(p) = -log(1+exp(-z)) and log(1-p) = -log(1+exp(z)), written so neither overflows
+				sums.log_likelihood -= n_trials * ((z > 0 ? (event ? 0.0 : z) : (event ? -z : 0.0)) + log1p(exp(-fabs(z))));
+				if (!derivatives) return;
+				double p = 1.0 / (1.0 + exp(-z)), w = n_trials * p * (1.0 - p), residual = n_trials * (event - p);
+				sums.gradient[i_base] += residual;
+				sums.hessian[i_base * n_parameters + i_base] += w;
+				double *cross = &sums.hessian[i_base * n_parameters + n_baseline];
+				for (int i_term = 0; i_term < n_terms; ++i_term) cross[i_term] += w * x[i_term];
+				residual_sum += residual;
+				weight_sum += w;
+			};
+			for (int cycle = 1; cycle <= min(last_cycle, last_baseline_cycle); ++cycle)
+				add(baseline_of[cycle], pregnant && cycle == last_cycle, 1.0);
+			// The cycles past the last baseline all share it, so they are added at once
+			if (last_cycle > last_baseline_cycle) {
+				int i_base = baseline_of[last_baseline_cycle];
+				if (last_cycle - last_baseline_cycle > 1) add(i_base, false, last_cycle - last_baseline_cycle - 1);
+				add(i_base, pregnant, 1.0);
+			}
+			if (!derivatives) continue;
+			for (int i_term = 0; i_term < n_terms; ++i_term) {
+				sums.gradient[n_baseline + i_term] += residual_sum * x[i_term];
+				// Upper triangle only, mirrored after the sum
+				double *hessian_row = &sums.hessian[(n_baseline + i_term) * n_parameters + n_baseline];
+				double wx = weight_sum * x[i_term];
+				for (int j_term = i_term; j_term < n_terms; ++j_term) hessian_row[j_term] += wx * x[j_term];
+			}
+		}
+	});
+	Sums total = {0.0, vector<double>(derivatives ? n_parameters : 0, 0.0), vector<double>(derivatives ? n_parameters * n_parameters : 0, 0.0)};
+	for (const Sums &sums : task_sums) {
+		total.log_likelihood += sums.log_likelihood;
+		for (int i = 0; i < total.gradient.size(); ++i) total.gradient[i] += sums.gradient[i];
+		for (int i = 0; i < total.hessian.size(); ++i) total.hessian[i] += sums.hessian[i];
+	}
+	for (int i = 0; i < n_parameters && derivatives; ++i) {
+		for (int j = 0; j < i; ++j) total.hessian[i * n_parameters + j] = total.hessian[j * n_parameters + i];
+	}
+	return total;
+  };
+
+  // Newton-Raphson on the log-likelihood, with the step halved whenever it would go down
+  Sums current = evaluate(parameters, true);
+  vector<double> covariance;
+  for (result.n_iterations = 1; result.n_iterations <= kMaxIterations; ++result.n_iterations) {
+	covariance = current.hessian;
+	if (!invert(covariance, n_parameters)) {
+		printf("...Hazard regression: the covariates are not independent of each other, no fit\n");
+		return result;
+	}
+	vector<double> step(n_parameters, 0.0);
+	for (int i = 0; i < n_parameters; ++i) {
+		for (int j = 0; j < n_parameters; ++j) step[i] += covariance[i * n_parameters + j] * current.gradient[j];
+	}
+	double max_step = 0.0;
+	for (double value : step) max_step = max(max_step, fabs(value));
+
+	vector<double> trial(n_parameters);
+	double scale = 1.0;
+	for (int halving = 0; halving < 20; ++halving, scale /= 2.0) {
+		for (int i = 0; i < n_parameters; ++i) trial[i] = parameters[i] + scale * step[i];
+		if (evaluate(trial, false).log_likelihood >= current.log_likelihood - 1e-9 * fabs(current.log_likelihood)) break;
+	}
+	parameters = trial;
+	current = evaluate(parameters, true);
+	NC_Trace::count("hazard iterations", 1);
+	if (max_step * scale < 1e-8) {
+		result.converged = true;
+		break;
+	}
+  }
+  if (result.n_iterations > kMaxIterations) result.n_iterations = kMaxIterations;
+  covariance = current.hessian;
+  if (!invert(covariance, n_parameters)) return result;
+  result.log_likelihood = current.log_likelihood;
+
+  // Back from standardised covariates to their own units
+  auto coefficient = [&](string name, int i_par, double scale) {
+	NC_HazardCoefficient coefficient;
+	coefficient.name = name;
+	coefficient.estimate = parameters[i_par] / scale;
+	coefficient.error = sqrt(covariance[i_par * n_parameters + i_par]) / scale;
+	coefficient.hazard_ratio = exp(coefficient.estimate);
+	coefficient.p_value = erfc(fabs(coefficient.estimate / coefficient.error) / sqrt(2.0));
+	return coefficient;
+  };
+  // The baseline is not an effect, so it gets no ratio or test
+  for (int i_base = 0; i_base < n_baseline; ++i_base) {
+	int first = first_cycle[i_base], last = i_base + 1 < n_baseline ? first_cycle[i_base+1] - 1 : last_baseline_cycle;
+	string name = "cycle " + to_string(first);
+	if (last > first) name = "cycles " + to_string(first) + "-" + to_string(last);
+	if (i_base + 1 == n_baseline && max_cycle > last_baseline_cycle) name = "cycles " + to_string(first) + "+";
+	result.baseline.push_back(coefficient(name, i_base, 1.0));
+	result.baseline.back().hazard_ratio = result.baseline.back().p_value = NAN;
+  }
+  for (int i_term = 0; i_term < n_terms; ++i_term) result.coefficients.push_back(coefficient(terms[i_term].name, n_baseline + i_term, terms[i_term].scale));
+
+  return result;
+}
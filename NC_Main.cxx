@@ -0,0 +1,233 @@
+// Compiled entry point for scheduled runs, the same analysis as the NC_DataChallenge macro with everything set on the command line
+// Author: Jochen jens Heinrich 2022
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <sys/stat.h>
+#include "NC_DataChallenge.cxx"
+
+using namespace std;
+
+void NC_PrintUsage(const char *program) {
+  printf("Usage: %s [options] [input files]\n"
+	"  -i, --input FILE        input file, can be given several times (default data.list)\n"
+	"  -c, --cycles N          number of cycles studied (default 15)\n"
+	"  -t, --threads N         number of threads, 0 for one per core (default 0)\n"
+	"  -o, --output DIR        directory for the results and plots (default .)\n"
+	"  -a, --analyses LIST     comma separated, any of probability,duration,factors (default all)\n"
+	"  -v, --covariates LIST   comma separated covariates for the factors (default all)\n"
+	"  -b, --resamples N       bootstrap resamples, 0 switches the bootstrap off (default 2000)\n"
+	"  -P, --permutations N    shuffles for the p-values of the factors, 0 switches them off (default 1000, not when streaming)\n"
+	"  -r, --results NAME      results file in the output directory, .json for JSON (default results.csv, 'none' for no file)\n"
+	"  -s, --streaming         process the input in batches instead of loading it\n"
+	"  -k, --incremental       keep a checkpoint in the output directory and only read what was appended to the input since\n"
+	"  -f, --filter EXPR       only analyse the users selected, e.g. 'outcome==pregnant && age>=30 && country!=missing'\n"
+	"  -g, --groupby LIST      also analyse groups of users, e.g. country,age:5:20:45, written to groups.csv in the output directory\n"
+	"  -p, --partial FILE      only collect the partial results of all inputs into FILE, to be merged later with --merge\n"
+	"  -m, --merge             the inputs are partial results files, the merged results are analysed and written to merged.ncpart too\n"
+	"  -n, --no-plots          do not draw any plots\n"
+	"  -d, --document NAME     all plots as the pages of one PDF in the output directory, instead of a PDF each\n"
+	"  -w, --plot-workers N    processes drawing the plots while the next input is analysed, 0 draws them in turn (default 1)\n"
+	"  -h, --help              show this message\n"
+	"With several input files every file is analysed on its own, into a subdirectory of the output directory named after it,\n"
+	"except with --partial and --merge, where all inputs make up one analysis. Partial results leave out the rank correlations\n",
+	program);
+}
+
+
+// Creates the directory and all its parents, returns false if that fails
+bool NC_MakeDirectory(string directory) {
+  for (size_t slash = directory.find('/', 1); ; slash = directory.find('/', slash+1)) {
+	string path = directory.substr(0, slash);
+	struct stat path_stat;
+	if (!path.empty() && stat(path.c_str(), &path_stat) != 0 && mkdir(path.c_str(), 0755) != 0) return false;
+	if (slash == string::npos) break;
+  }
+  return true;
+}
+
+
+int main(int argc, char **argv) {
+
+  vector<string> input_files;
+  int n_cycles = 15, n_threads = 0, n_resamples = 2000, n_permutations = 1000, n_plot_workers = 1, questions = kAllQuestions;
+  string output_directory = ".", results_name = "results.csv", covariate_list, group_list, partial_file, filter_expression, document;
+  bool streaming = false, incremental = false, make_plots = true, merge = false;
+
+  static const struct option options[] = {
+	{"input", required_argument, nullptr, 'i'},
+	{"cycles", required_argument, nullptr, 'c'},
+	{"threads", required_argument, nullptr, 't'},
+	{"output", required_argument, nullptr, 'o'},
+	{"analyses", required_argument, nullptr, 'a'},
+	{"covariates", required_argument, nullptr, 'v'},
+	{"resamples", required_argument, nullptr, 'b'},
+	{"permutations", required_argument, nullptr, 'P'},
+	{"results", required_argument, nullptr, 'r'},
+	{"streaming", no_argument, nullptr, 's'},
+	{"incremental", no_argument, nullptr, 'k'},
+	{"filter", required_argument, nullptr, 'f'},
+	{"groupby", required_argument, nullptr, 'g'},
+	{"partial", required_argument, nullptr, 'p'},
+	{"merge", no_argument, nullptr, 'm'},
+	{"no-plots", no_argument, nullptr, 'n'},
+	{"document", required_argument, nullptr, 'd'},
+	{"plot-workers", required_argument, nullptr, 'w'},
+	{"help", no_argument, nullptr, 'h'},
+	{nullptr, 0, nullptr, 0}
+  };
+  int option;
+  while ((option = getopt_long(argc, argv, "i:c:t:o:a:v:b:P:r:skf:g:p:mnd:w:h", options, nullptr)) != -1) {
+	switch (option) {
+		case 'i': input_files.push_back(optarg); break;
+		case 'c': n_cycles = atoi(optarg); break;
+		case 't': n_threads = atoi(optarg); break;
+		case 'o': output_directory = optarg; break;
+		case 'v': covariate_list = optarg; break;
+		case 'b': n_resamples = atoi(optarg); break;
+		case 'P': n_permutations = atoi(optarg); break;
+		case 'r': results_name = optarg; break;
+		case 's': streaming = true; break;
+		case 'k': incremental = true; break;
+		case 'f': filter_expression = optarg; break;
+		case 'g': group_list = optarg; break;
+		case 'p': partial_file = optarg; break;
+		case 'm': merge = true; break;
+		case 'n': make_plots = false; break;
+		case 'd': document = optarg; break;
+		case 'w': n_plot_workers = atoi(optarg); break;
+		case 'a': {
+			questions = 0;
+			istringstream names(optarg);
+			string name;
+			while (std::getline(names, name, ',')) {
+				if (name == "probability") questions |= kProbability;
+				else if (name == "duration") questions |= kDuration;
+				else if (name == "factors") questions |= kFactors;
+				else {
+					printf("...Unknown analysis '%s', expected probability, duration or factors\n", name.c_str());
+					return EXIT_FAILURE;
+				}
+			}
+			break;
+		}
+		case 'h':
+			NC_PrintUsage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			NC_PrintUsage(argv[0]);
+			return EXIT_FAILURE;
+	}
+  }
+  for (int i_arg = optind; i_arg < argc; ++i_arg) input_files.push_back(argv[i_arg]);
+  if (input_files.empty()) input_files.push_back("data.list");
+  if (n_cycles < 1 || n_threads < 0 || n_resamples < 0 || n_permutations < 0 || n_plot_workers < 0) {
+	printf("...Cycles have to be positive, threads, resamples, permutations and plot workers must not be negative\n");
+	return EXIT_FAILURE;
+  }
+
+  // Pick the requested covariates, all of them if none are given
+  const vector<NC_Covariate> all_covariates = NC_DefaultCovariates();
+  vector<NC_Covariate> covariates = covariate_list.empty() ? all_covariates : vector<NC_Covariate>();
+  istringstream names(covariate_list);
+  string covariate_name;
+  while (std::getline(names, covariate_name, ',')) {
+	int i_cov = 0;
+	while (i_cov < all_covariates.size() && all_covariates[i_cov].name != covariate_name) ++i_cov;
+	if (i_cov == all_covariates.size()) {
+		printf("...Unknown covariate '%s'\n", covariate_name.c_str());
+		return EXIT_FAILURE;
+	}
+	covariates.push_back(all_covariates[i_cov]);
+  }
+  vector<NC_GroupKey> group_keys;
+  if (!NC_ParseGroupKeys(group_list, group_keys)) return EXIT_FAILURE;
+  if (!group_keys.empty() && (streaming || incremental)) {
+	printf("...Groups need all users in memory and cannot be combined with --streaming or --incremental\n");
+	return EXIT_FAILURE;
+  }
+  NC_Filter filter(filter_expression);
+  if (!filter.valid()) return EXIT_FAILURE;
+  if (!filter.empty() && (incremental || merge || !partial_file.empty())) {
+	printf("...A filter only works on plain and streaming runs, checkpoints and partials hold all users\n");
+	return EXIT_FAILURE;
+  }
+  if (!partial_file.empty() && merge) {
+	printf("...Either --partial or --merge, not both\n");
+	return EXIT_FAILURE;
+  }
+
+  NC_Trace::startFromEnvironment();
+  // The plots of one input are drawn while the next one is analysed, by workers forked here before any other thread runs
+  NC_PlotQueue plots([](const NC_Results &results, string directory, string document) { NC_PlotResults(results, directory, document); },
+	make_plots ? n_plot_workers : 0);
+
+  // Map step, nothing is analysed yet
+  if (!partial_file.empty()) {
+	bool success = NC_WritePartial(input_files, partial_file, covariates, n_cycles, group_keys, n_threads);
+	NC_Trace::finish();
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  // Reduce step, the configuration comes with the partials
+  if (merge) {
+	unique_ptr<NC_Partial> partial = NC_MergePartials(input_files, n_threads);
+	if (!partial) return EXIT_FAILURE;
+	if (!NC_MakeDirectory(output_directory)) {
+		printf("...Could not create output directory '%s'\n", output_directory.c_str());
+		return EXIT_FAILURE;
+	}
+	partial->write(output_directory + "/merged.ncpart");
+	NC_Results results = NC_Summarise(*partial, n_threads, n_resamples, 0.95, questions);
+	if (results_name != "none") results.write(output_directory + "/" + results_name);
+	if (partial->numberOfGroups() > 0) NC_Results::write(output_directory + "/groups.csv", NC_SummariseGroups(*partial, n_threads));
+	if (make_plots) plots.push(results, output_directory, document);
+	bool plots_written = plots.wait() == 0;
+	NC_Trace::finish();
+	if (!plots_written) return EXIT_FAILURE;
+	cout << "Analysis completed successfully" << endl;
+	return EXIT_SUCCESS;
+  }
+
+  for (const string &input_file : input_files) {
+
+	// Every input of several gets a directory of its own, named after the file without its path and extension
+	string directory = output_directory;
+	if (input_files.size() > 1) {
+		string stem = input_file.substr(input_file.find_last_of('/') + 1);
+		directory += "/" + stem.substr(0, stem.find_last_of('.'));
+	}
+	if (!NC_MakeDirectory(directory)) {
+		printf("...Could not create output directory '%s'\n", directory.c_str());
+		return EXIT_FAILURE;
+	}
+
+	NC_Results results;
+	if (incremental) {
+		results = NC_AnalyseIncremental(input_file, directory + "/checkpoint.ncstate", covariates, n_cycles, n_threads, n_resamples, 0.95, questions);
+	}
+	else {
+		NC_Users nc_user, selected;
+		if (!streaming) nc_user.readData(input_file, n_threads);
+		// Loaded users are filtered here once for both the analysis and the groups
+		if (!streaming && !filter.empty()) filter.apply(nc_user, selected, n_threads);
+		NC_Users &users = streaming || filter.empty() ? nc_user : selected;
+		results = NC_Analyse(users, covariates, n_cycles, n_threads, streaming, input_file, n_resamples, 0.95, questions, streaming ? filter : NC_Filter(), n_permutations);
+		if (!group_keys.empty())
+			NC_Results::write(directory + "/groups.csv", NC_AnalyseGroups(users, group_keys, covariates, n_cycles, n_threads));
+	}
+
+	if (results_name != "none") results.write(directory + "/" + results_name);
+	if (make_plots) plots.push(results, directory, document);
+  }
+
+  bool plots_written = plots.wait() == 0;
+  NC_Trace::finish();
+  if (!plots_written) return EXIT_FAILURE;
+  cout << "Analysis completed successfully" << endl;
+
+  return EXIT_SUCCESS;
+}
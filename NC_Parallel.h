@@ -0,0 +1,51 @@
+#pragma once
+// A small helper to spread independent pieces of work over all available cores
+// Author: Jochen jens Heinrich 2022
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+class NC_Parallel {
+
+public:
+
+  // Number of threads to use, 0 means one per core
+  static int nThreads(int requested = 0);
+  // Calls func(task, thread) for every task in [0, n_tasks), tasks are handed out to the threads as they become free
+  template<class F> static void forEach(int n_tasks, int n_threads, F func);
+
+};
+
+
+int NC_Parallel::nThreads(int requested) {
+  if (requested > 0) return requested;
+  int n_cores = thread::hardware_concurrency();
+  return n_cores > 0 ? n_cores : 1;
+}
+
+
+template<class F> void NC_Parallel::forEach(int n_tasks, int n_threads, F func) {
+
+  n_threads = min(nThreads(n_threads), n_tasks);
+
+  // Nothing to gain from threads here, so keep it simple
+  if (n_threads <= 1) {
+	for (int task = 0; task < n_tasks; ++task) func(task, 0);
+	return;
+  }
+
+  atomic<int> next_task(0);
+  vector<thread> workers;
+  for (int i_thread = 0; i_thread < n_threads; ++i_thread) {
+	workers.emplace_back([&, i_thread]() {
+		for (int task = next_task++; task < n_tasks; task = next_task++) func(task, i_thread);
+	});
+  }
+  for (int i_thread = 0; i_thread < n_threads; ++i_thread) workers[i_thread].join();
+
+  return;
+}
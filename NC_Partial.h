@@ -0,0 +1,287 @@
+#pragma once
+// Partial results of one shard of the data, which merge with those of any other shards into the results for all of them
+// Author: Jochen jens Heinrich 2022
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "NC_User.h"
+#include "NC_Analysis.h"
+#include "NC_Correlation.h"
+#include "NC_Survival.h"
+#include "NC_Bootstrap.h"
+#include "NC_GroupBy.h"
+#include "NC_Trace.h"
+
+using namespace std;
+
+// The accumulators for all users of a shard and, with group keys, for every group in it, together with the dictionaries
+// their category codes refer to. Merging translates the codes of the other partial into ours by label and matches groups
+// by label, so it does not matter how the shards were cut. It is associative: labels and groups that are new to a partial
+// are appended in the order of the other one, so a tree of merges gives the same as merging one shard after the other.
+// Rank correlations would need every value and are left out, so a partial stays small whatever the size of the shard
+class NC_Partial {
+
+public:
+
+  NC_Partial(const vector<NC_Covariate> &covariates, int n_cycles = 15, const vector<NC_GroupKey> &keys = vector<NC_GroupKey>());
+  ~NC_Partial() {}
+  NC_Partial(const NC_Partial&) = delete;
+  NC_Partial &operator=(const NC_Partial&) = delete;
+  // Map step: adds all users of an input file, can be called for several files
+  void analyse(string file_name, int n_threads = 0);
+  // Reduce step
+  void merge(const NC_Partial &other);
+  bool write(string file_name) const;
+  // The configuration is stored in the file as well, returns nullptr if the file cannot be read
+  static unique_ptr<NC_Partial> read(string file_name);
+
+  const vector<NC_Covariate> &covariates() const { return m_covariates; }
+  int numberOfCycles() const { return m_n_cycles; }
+  const vector<NC_GroupKey> &keys() const { return m_keys; }
+  const NC_Survival &survival() const { return dynamic_cast<const NC_Survival&>(*m_accumulators[0]); }
+  const NC_CycleHistogram &cycleHistogram() const { return dynamic_cast<const NC_CycleHistogram&>(*m_accumulators[1]); }
+  const NC_Bootstrap &bootstrap() const { return dynamic_cast<const NC_Bootstrap&>(*m_accumulators[2]); }
+  const NC_CorrelationInputs &correlationInputs() const { return dynamic_cast<const NC_CorrelationInputs&>(*m_accumulators[3]); }
+  // Non-empty groups, in the order they were first seen
+  int numberOfGroups() const { return m_group_labels.size(); }
+  const string &groupLabel(int group) const { return m_group_labels[group]; }
+  const NC_Survival &groupSurvival(int group) const { return dynamic_cast<const NC_Survival&>(*m_groups[group][0]); }
+  const NC_CycleHistogram &groupCycleHistogram(int group) const { return dynamic_cast<const NC_CycleHistogram&>(*m_groups[group][1]); }
+  const NC_CorrelationInputs &groupCorrelationInputs(int group) const { return dynamic_cast<const NC_CorrelationInputs&>(*m_groups[group][2]); }
+
+private:
+
+  static const uint32_t kVersion = 2;
+  // The first 8 bytes of every partial file, padded with zeros
+  static constexpr char kMagic[8] = "NCPART\0";
+  // Empty accumulators for all users (survival, cycle histogram, bootstrap, correlations) or for a group (the same without bootstrap)
+  vector<unique_ptr<NC_Accumulator>> makeAccumulators(bool group) const;
+  static vector<NC_Accumulator*> pointers(const vector<unique_ptr<NC_Accumulator>> &accumulators);
+  // Adds a state built with the dictionaries of other to ours
+  void mergeAccumulators(vector<unique_ptr<NC_Accumulator>> &ours, const vector<unique_ptr<NC_Accumulator>> &theirs,
+	const vector<pair<NC_Field,vector<NC_Code>>> &code_maps) const;
+
+  vector<NC_Covariate> m_covariates;
+  int m_n_cycles;
+  vector<NC_GroupKey> m_keys;
+  NC_Users m_users;	// Only the dictionaries are kept
+  vector<unique_ptr<NC_Accumulator>> m_accumulators;
+  vector<string> m_group_labels;
+  vector<vector<unique_ptr<NC_Accumulator>>> m_groups;
+
+};
+
+
+NC_Partial::NC_Partial(const vector<NC_Covariate> &covariates, int n_cycles, const vector<NC_GroupKey> &keys) :
+	m_covariates(covariates), m_n_cycles(n_cycles), m_keys(keys) {
+  m_accumulators = makeAccumulators(false);
+}
+
+
+vector<unique_ptr<NC_Accumulator>> NC_Partial::makeAccumulators(bool group) const {
+  vector<unique_ptr<NC_Accumulator>> accumulators;
+  accumulators.emplace_back(new NC_Survival());
+  accumulators.emplace_back(new NC_CycleHistogram(m_n_cycles));
+  if (!group) accumulators.emplace_back(new NC_Bootstrap(m_n_cycles));
+  accumulators.emplace_back(new NC_CorrelationInputs(m_covariates, m_users, false));
+  return accumulators;
+}
+
+
+vector<NC_Accumulator*> NC_Partial::pointers(const vector<unique_ptr<NC_Accumulator>> &accumulators) {
+  vector<NC_Accumulator*> pointers;
+  for (const unique_ptr<NC_Accumulator> &accumulator : accumulators) pointers.push_back(accumulator.get());
+  return pointers;
+}
+
+
+void NC_Partial::analyse(string file_name, int n_threads) {
+
+  NC_TraceScope trace_scope("partialAnalyse");
+
+  // Every file gets a partial of its own, as reading it starts new dictionaries, which is then merged into this one
+  NC_Partial shard(m_covariates, m_n_cycles, m_keys);
+  shard.m_users.readData(file_name, n_threads);
+
+  NC_Analysis analysis;
+  for (NC_Accumulator *accumulator : pointers(shard.m_accumulators)) analysis.add(accumulator);
+  analysis.run(shard.m_users, n_threads);
+
+  if (!m_keys.empty()) {
+	NC_GroupBy grouping(shard.m_users, m_keys, n_threads);
+	// The prototypes refer to the dictionaries of the shard, which are the same as those of the grouped users
+	vector<unique_ptr<NC_Accumulator>> prototypes = shard.makeAccumulators(true);
+	vector<vector<unique_ptr<NC_Accumulator>>> groups = grouping.run(pointers(prototypes), n_threads);
+	for (int group = 0; group < groups.size(); ++group) {
+		if (groups[group].empty()) continue;
+		shard.m_group_labels.push_back(grouping.groupLabel(group));
+		shard.m_groups.push_back(move(groups[group]));
+	}
+  }
+  shard.m_users.clearRows();
+
+  merge(shard);
+}
+
+
+void NC_Partial::mergeAccumulators(vector<unique_ptr<NC_Accumulator>> &ours, const vector<unique_ptr<NC_Accumulator>> &theirs,
+	const vector<pair<NC_Field,vector<NC_Code>>> &code_maps) const {
+  for (int i_acc = 0; i_acc < ours.size(); ++i_acc) {
+	// A copy of theirs that can be translated, the clone of ours already refers to our dictionaries
+	unique_ptr<NC_Accumulator> copy(ours[i_acc]->clone());
+	copy->merge(*theirs[i_acc]);
+	for (const pair<NC_Field,vector<NC_Code>> &code_map : code_maps)
+		copy->remapCodes(code_map.first, code_map.second, m_users.dictionary(code_map.first)->size());
+	ours[i_acc]->merge(*copy);
+  }
+}
+
+
+void NC_Partial::merge(const NC_Partial &other) {
+
+  NC_TraceScope trace_scope("partialMerge");
+
+  // Both sides have to describe the same analysis
+  bool same_keys = m_keys.size() == other.m_keys.size();
+  for (int i_key = 0; i_key < m_keys.size() && same_keys; ++i_key) {
+	const NC_GroupKey &key = m_keys[i_key], &other_key = other.m_keys[i_key];
+	same_keys = key.field == other_key.field && key.n_bins == other_key.n_bins && key.low == other_key.low && key.high == other_key.high;
+  }
+  bool same_covariates = m_covariates.size() == other.m_covariates.size();
+  for (int i_cov = 0; i_cov < m_covariates.size() && same_covariates; ++i_cov) {
+	const NC_Covariate &cov = m_covariates[i_cov], &other_cov = other.m_covariates[i_cov];
+	same_covariates = cov.field == other_cov.field && cov.x_bins == other_cov.x_bins && cov.x_low == other_cov.x_low && cov.x_high == other_cov.x_high;
+  }
+  if (m_n_cycles != other.m_n_cycles || !same_keys || !same_covariates) {
+	printf("...Partial results of different analyses cannot be merged\n");
+	exit (EXIT_FAILURE);
+  }
+
+  // Their labels join our dictionaries first, so the codes can be translated
+  vector<pair<NC_Field,vector<NC_Code>>> code_maps;
+  for (int field = 0; field < kNFields; ++field) {
+	if (NC_Users::fieldType((NC_Field) field) != kCategoryField) continue;
+	code_maps.push_back(make_pair((NC_Field) field, m_users.mergeDictionary((NC_Field) field, *other.m_users.dictionary((NC_Field) field))));
+  }
+
+  mergeAccumulators(m_accumulators, other.m_accumulators, code_maps);
+  for (int other_group = 0; other_group < other.m_groups.size(); ++other_group) {
+	int group = find(m_group_labels.begin(), m_group_labels.end(), other.m_group_labels[other_group]) - m_group_labels.begin();
+	if (group == m_group_labels.size()) {
+		m_group_labels.push_back(other.m_group_labels[other_group]);
+		m_groups.push_back(makeAccumulators(true));
+	}
+	mergeAccumulators(m_groups[group], other.m_groups[other_group], code_maps);
+  }
+
+  return;
+}
+
+
+// Layout: header, configuration, accumulators of all users, dictionaries, then label and accumulators of every group
+bool NC_Partial::write(string file_name) const {
+
+  NC_TraceScope trace_scope("partialWrite");
+
+  string temp_name = file_name + ".tmp";
+  FILE *file = fopen(temp_name.c_str(), "wb");
+  if (!file) {
+	printf("...Could not write partial results %s\n", file_name.c_str());
+	return false;
+  }
+  auto write_string = [file](const string &text) {
+	uint32_t length = text.size();
+	return fwrite(&length, sizeof(length), 1, file) == 1 && fwrite(text.data(), 1, length, file) == length;
+  };
+
+  uint32_t version = kVersion, n_covariates = m_covariates.size(), n_keys = m_keys.size(), n_groups = m_groups.size();
+  bool success = fwrite(kMagic, 8, 1, file) == 1 && fwrite(&version, sizeof(version), 1, file) == 1
+	&& fwrite(&m_n_cycles, sizeof(m_n_cycles), 1, file) == 1 && fwrite(&n_covariates, sizeof(n_covariates), 1, file) == 1;
+  for (const NC_Covariate &cov : m_covariates) {
+	int32_t field = cov.field;
+	success = success && write_string(cov.name) && write_string(cov.label) && write_string(cov.par_name) && fwrite(&field, sizeof(field), 1, file) == 1
+		&& fwrite(&cov.x_bins, sizeof(cov.x_bins), 1, file) == 1 && fwrite(&cov.x_low, sizeof(cov.x_low), 1, file) == 1
+		&& fwrite(&cov.x_high, sizeof(cov.x_high), 1, file) == 1;
+  }
+  success = success && fwrite(&n_keys, sizeof(n_keys), 1, file) == 1 && fwrite(m_keys.data(), sizeof(NC_GroupKey), n_keys, file) == n_keys;
+  for (const unique_ptr<NC_Accumulator> &accumulator : m_accumulators) success = success && accumulator->save(file);
+  success = success && m_users.writeDictionaries(file) && fwrite(&n_groups, sizeof(n_groups), 1, file) == 1;
+  for (int group = 0; group < m_groups.size() && success; ++group) {
+	success = write_string(m_group_labels[group]);
+	for (const unique_ptr<NC_Accumulator> &accumulator : m_groups[group]) success = success && accumulator->save(file);
+  }
+
+  success = fclose(file) == 0 && success;
+  if (!success || rename(temp_name.c_str(), file_name.c_str()) != 0) {
+	printf("...Could not write partial results %s\n", file_name.c_str());
+	remove(temp_name.c_str());
+	return false;
+  }
+  printf("Wrote partial results %s\n", file_name.c_str());
+
+  return true;
+}
+
+
+unique_ptr<NC_Partial> NC_Partial::read(string file_name) {
+
+  NC_TraceScope trace_scope("partialRead");
+
+  FILE *file = fopen(file_name.c_str(), "rb");
+  if (!file) {
+	printf("...Could not open partial results %s\n", file_name.c_str());
+	return nullptr;
+  }
+  auto read_string = [file](string &text) {
+	uint32_t length;
+	if (fread(&length, sizeof(length), 1, file) != 1 || length >= (1 << 16)) return false;
+	text.resize(length);
+	return fread(&text[0], 1, length, file) == length;
+  };
+
+  char magic[8];
+  uint32_t version, n_covariates, n_keys, n_groups;
+  int n_cycles;
+  vector<NC_Covariate> covariates;
+  vector<NC_GroupKey> keys;
+  bool success = fread(magic, 8, 1, file) == 1 && memcmp(magic, kMagic, 8) == 0 && fread(&version, sizeof(version), 1, file) == 1
+	&& version == kVersion && fread(&n_cycles, sizeof(n_cycles), 1, file) == 1 && n_cycles > 0
+	&& fread(&n_covariates, sizeof(n_covariates), 1, file) == 1 && n_covariates <= kNFields * 16;
+  for (uint32_t i_cov = 0; i_cov < n_covariates && success; ++i_cov) {
+	NC_Covariate cov;
+	int32_t field;
+	success = read_string(cov.name) && read_string(cov.label) && read_string(cov.par_name) && fread(&field, sizeof(field), 1, file) == 1
+		&& field >= 0 && field < kNFields && fread(&cov.x_bins, sizeof(cov.x_bins), 1, file) == 1
+		&& fread(&cov.x_low, sizeof(cov.x_low), 1, file) == 1 && fread(&cov.x_high, sizeof(cov.x_high), 1, file) == 1;
+	cov.field = (NC_Field) field;
+	covariates.push_back(cov);
+  }
+  success = success && fread(&n_keys, sizeof(n_keys), 1, file) == 1 && n_keys <= kNFields;
+  if (success) {
+	keys.resize(n_keys);
+	success = fread(keys.data(), sizeof(NC_GroupKey), n_keys, file) == n_keys;
+  }
+
+  unique_ptr<NC_Partial> partial;
+  if (success) {
+	partial.reset(new NC_Partial(covariates, n_cycles, keys));
+	for (unique_ptr<NC_Accumulator> &accumulator : partial->m_accumulators) success = success && accumulator->load(file);
+	success = success && partial->m_users.readDictionaries(file) && fread(&n_groups, sizeof(n_groups), 1, file) == 1;
+	for (uint32_t group = 0; group < n_groups && success; ++group) {
+		string label;
+		success = read_string(label);
+		partial->m_group_labels.push_back(label);
+		partial->m_groups.push_back(partial->makeAccumulators(true));
+		for (unique_ptr<NC_Accumulator> &accumulator : partial->m_groups.back()) success = success && accumulator->load(file);
+	}
+  }
+  fclose(file);
+
+  if (!success) {
+	printf("...Could not read partial results %s\n", file_name.c_str());
+	return nullptr;
+  }
+  return partial;
+}
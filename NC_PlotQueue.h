@@ -0,0 +1,306 @@
+#pragma once
+// Draws the plots of finished analyses in the background, so the next analysis does not wait for the PDFs to be written
+// Author: Jochen jens Heinrich 2022
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "NC_Results.h"
+#include "NC_Trace.h"
+
+using namespace std;
+
+// One job as handed to a worker: the results are written to a temporary file when the job is queued
+struct NC_PlotJob {
+  string results_file;
+  string directory;
+  string document;	// all plots as pages of one PDF in directory, empty for a file per plot
+};
+
+
+// ROOT keeps the current pad, the colours and its list of objects in globals, so two threads of one process cannot draw at once.
+// The plots are drawn by worker processes instead, all forked when the queue is made: no other thread runs at that point, so the
+// workers are plain copies of the process and never inherit a lock some thread was holding. Each job goes to a free worker as
+// a line on its socket and the worker answers with one byte once the plots are written; jobs writing the same files wait for
+// each other. With n_workers = 0 every job is drawn right away by the calling thread, as before
+class NC_PlotQueue {
+
+public:
+
+  // render(results, directory, document) draws all plots of one job, e.g. NC_PlotResults
+  typedef function<void(const NC_Results&, string, string)> Renderer;
+
+  // Forks the workers, so it has to be made before any other thread is started
+  NC_PlotQueue(Renderer render, int n_workers = 1);
+  // Waits for all jobs and stops the workers
+  ~NC_PlotQueue();
+  void push(const NC_Results &results, string directory = "", string document = "");
+  // Blocks until every job queued so far is written, returns the number of jobs whose worker failed
+  int wait();
+
+private:
+
+  struct Worker {
+	pid_t pid;		// -1 once the worker is gone
+	int socket;
+	bool busy;
+	NC_PlotJob job;
+  };
+
+  // Runs in the worker process: draws the jobs read from socket until the queue closes it, never returns
+  static void serve(Renderer render, int socket);
+  void dispatch();
+  void wake();
+  void failed(const NC_PlotJob &job, const char *message);
+  static string target(const NC_PlotJob &job) { return job.directory + "/" + job.document; }
+
+  Renderer m_render;
+  vector<Worker> m_workers;
+  int m_wake[2] = {-1, -1};	// a byte written here wakes the dispatcher
+  mutex m_lock;
+  condition_variable m_changed;
+  deque<NC_PlotJob> m_pending;
+  int m_n_failed = 0;
+  bool m_stop = false;
+  thread m_dispatcher;
+
+};
+
+
+NC_PlotQueue::NC_PlotQueue(Renderer render, int n_workers) : m_render(render) {
+
+  if (n_workers <= 0) return;
+  if (pipe(m_wake) != 0) {
+	printf("...Could not start the plot workers, plots are drawn in turn\n");
+	return;
+  }
+
+  // Output so far comes first, the workers start with empty buffers
+  fflush(stdout);
+  for (int i_worker = 0; i_worker < n_workers; ++i_worker) {
+	int sockets[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) break;
+	pid_t pid = fork();
+	if (pid == 0) {
+		// The worker keeps its own end of the socket and nothing else of the queue, so every worker sees its socket close
+		close(sockets[0]);
+		close(m_wake[0]);
+		close(m_wake[1]);
+		for (const Worker &worker : m_workers) close(worker.socket);
+		serve(m_render, sockets[1]);
+	}
+	close(sockets[1]);
+	if (pid < 0) {
+		close(sockets[0]);
+		break;
+	}
+	m_workers.push_back({pid, sockets[0], false, NC_PlotJob()});
+  }
+
+  if (m_workers.size() < n_workers) printf("...Could only start %zu of %d plot workers\n", m_workers.size(), n_workers);
+  if (m_workers.empty()) {
+	close(m_wake[0]);
+	close(m_wake[1]);
+	return;
+  }
+  m_dispatcher = thread(&NC_PlotQueue::dispatch, this);
+}
+
+
+NC_PlotQueue::~NC_PlotQueue() {
+
+  wait();
+  if (!m_dispatcher.joinable()) return;
+  {
+	lock_guard<mutex> guard(m_lock);
+	m_stop = true;
+  }
+  wake();
+  m_dispatcher.join();
+
+  // The workers stop at the end of their socket
+  for (Worker &worker : m_workers) {
+	if (worker.pid < 0) continue;
+	close(worker.socket);
+	waitpid(worker.pid, nullptr, 0);
+  }
+  close(m_wake[0]);
+  close(m_wake[1]);
+}
+
+
+void NC_PlotQueue::serve(Renderer render, int socket) {
+
+  // The trace belongs to the parent, whatever the worker records would never be written
+  NC_Trace::detach();
+  FILE *jobs = fdopen(socket, "r");
+  char *line = nullptr;
+  size_t capacity = 0;
+  while (jobs && getline(&line, &capacity, jobs) > 0) {
+
+	// results file, directory and document, separated by tabs
+	string fields[3];
+	int i_field = 0;
+	for (char *c = line; *c && *c != '\n'; ++c) {
+		if (*c == '\t' && i_field < 2) ++i_field;
+		else fields[i_field] += *c;
+	}
+	NC_Results results;
+	char success = i_field == 2 && results.readCSV(fields[0], false);
+	if (success) render(results, fields[1], fields[2]);
+	fflush(stdout);
+	if (write(socket, &success, 1) != 1) break;
+  }
+
+  _exit(EXIT_SUCCESS);
+}
+
+
+void NC_PlotQueue::push(const NC_Results &results, string directory, string document) {
+
+  NC_Trace::count("plot jobs", 1);
+  if (m_workers.empty()) {
+	m_render(results, directory, document);
+	return;
+  }
+
+  // The results are written here, so the caller can go on changing its copy
+  const char *temp_directory = getenv("TMPDIR");
+  string results_file = string(temp_directory && *temp_directory ? temp_directory : "/tmp") + "/nc_plots_XXXXXX";
+  int file = mkstemp(&results_file[0]);
+  if (file >= 0) close(file);
+  if (file < 0 || !results.writeCSV(results_file, false)) {
+	if (file >= 0) unlink(results_file.c_str());
+	printf("...Could not pass the results to a plot worker, the plots are drawn right away\n");
+	m_render(results, directory, document);
+	return;
+  }
+  {
+	lock_guard<mutex> guard(m_lock);
+	m_pending.push_back({results_file, directory, document});
+  }
+  wake();
+
+  return;
+}
+
+
+int NC_PlotQueue::wait() {
+
+  NC_TraceScope trace_scope("plotWait");
+  unique_lock<mutex> lock(m_lock);
+  m_changed.wait(lock, [this]() {
+	bool idle = m_pending.empty();
+	for (const Worker &worker : m_workers) idle = idle && !worker.busy;
+	return idle;
+  });
+  int n_failed = m_n_failed;
+  m_n_failed = 0;
+
+  return n_failed;
+}
+
+
+void NC_PlotQueue::wake() {
+  char byte = 0;
+  if (write(m_wake[1], &byte, 1) != 1) printf("...Could not wake the plot dispatcher\n");
+}
+
+
+// Called with the lock held
+void NC_PlotQueue::failed(const NC_PlotJob &job, const char *message) {
+  printf("...%s for '%s', its plots may be incomplete\n", message, target(job).c_str());
+  ++m_n_failed;
+}
+
+
+void NC_PlotQueue::dispatch() {
+
+  vector<pollfd> fds;
+  vector<Worker*> polled;
+  while (true) {
+
+	{
+		lock_guard<mutex> guard(m_lock);
+		if (m_stop) break;
+
+		// Hand the oldest job whose files nobody is writing to each free worker
+		int n_alive = 0;
+		for (Worker &worker : m_workers) {
+			if (worker.pid < 0) continue;
+			++n_alive;
+			if (worker.busy) continue;
+			auto job = m_pending.begin();
+			for (; job != m_pending.end(); ++job) {
+				bool busy = false;
+				for (const Worker &other : m_workers) busy = busy || (other.busy && target(other.job) == target(*job));
+				if (!busy) break;
+			}
+			if (job == m_pending.end()) continue;
+			worker.job = *job;
+			m_pending.erase(job);
+			string line = worker.job.results_file + "\t" + worker.job.directory + "\t" + worker.job.document + "\n";
+			// A worker that is gone shows up as the end of its socket below, the job is counted as failed then
+			worker.busy = true;
+			send(worker.socket, line.data(), line.size(), MSG_NOSIGNAL);
+		}
+		// Without workers nothing is drawn any more
+		if (n_alive == 0) {
+			for (const NC_PlotJob &job : m_pending) {
+				failed(job, "No plot worker left");
+				unlink(job.results_file.c_str());
+			}
+			m_pending.clear();
+		}
+		m_changed.notify_all();
+
+		fds.assign(1, {m_wake[0], POLLIN, 0});
+		polled.clear();
+		for (Worker &worker : m_workers) {
+			if (worker.pid < 0) continue;
+			fds.push_back({worker.socket, POLLIN, 0});
+			polled.push_back(&worker);
+		}
+	}
+
+	// Sleeps until a job is pushed, the queue stops or a worker answers or ends
+	if (poll(fds.data(), fds.size(), -1) < 0) continue;
+	if (fds[0].revents) {
+		char bytes[64];
+		if (read(m_wake[0], bytes, sizeof(bytes)) < 0) printf("...Could not read the wake-ups of the plot dispatcher\n");
+	}
+	for (int i_fd = 1; i_fd < fds.size(); ++i_fd) {
+		if (!fds[i_fd].revents) continue;
+		Worker &worker = *polled[i_fd-1];
+		char success = 0;
+		bool answered = read(worker.socket, &success, 1) == 1;
+		lock_guard<mutex> guard(m_lock);
+		if (answered) {
+			if (!success) failed(worker.job, "Plot worker could not read the results");
+		}
+		else {
+			// The worker died, e.g. in ROOT; the ones left carry on
+			if (worker.busy) failed(worker.job, "Plot worker failed");
+			else printf("...A plot worker stopped\n");
+			close(worker.socket);
+			waitpid(worker.pid, nullptr, 0);
+			worker.pid = -1;
+		}
+		if (worker.busy) unlink(worker.job.results_file.c_str());
+		worker.busy = false;
+	}
+  }
+
+  return;
+}
@@ -3,6 +3,8 @@
 // Author: Jochen jens Heinrich 2022
 
 #include <iostream>
+#include <memory>
+#include "TROOT.h"
 #include "TGraphErrors.h"
 #include "TMath.h"
 #include "TCanvas.h"
@@ -13,6 +15,9 @@
 #include "TH1.h"
 #include "TLine.h"
 #include "TLatex.h"
+#include "NC_Results.h"
+#include "NC_Quantile.h"
+#include "NC_Trace.h"
 
 using namespace std;
 
@@ -20,33 +25,73 @@ class NC_Plotter {
 
 public:
 
-  NC_Plotter() {}
-  ~NC_Plotter() {}
-  void PlotProbabilityOverCycles(const int size, float probability[], float probability_uncertainty[]);
+  // Every plotter names its objects with its own suffix, so several can exist in the same ROOT session
+  // The PDFs go to directory, the current one if it is empty. With a document every plot is a page of it instead of a file of its own,
+  // the document has to be opened and closed around the plots, see openDocument
+  NC_Plotter(string directory = "", string document = "") : m_directory(directory.empty() ? "" : directory + "/"), m_document(document) {
+	static int n_instances = 0;
+	m_suffix = "_" + to_string(n_instances++);
+  }
+  // All canvases, histograms and functions stay alive as long as the plotter and are deleted with it
+  ~NC_Plotter() { while (!m_objects.empty()) m_objects.pop_back(); }
+  // Drawing only uses the numbers in the results, the fits are done beforehand with NC_Fitter
+  void PlotProbabilityOverCycles(const NC_Results &results);
   template<class T> void stylePlot(T *graph, string x_label, string y_label);
-  void DrawHistogram(const int size, TH1 *hist);
+  void DrawHistogram(const NC_Results &results);
   std::vector<float> getPercentiles(TF1 *func, const int size, std::vector<float> perc_values);
+  // A multi-page PDF needs a print before the first and after the last page
+  static void openDocument(string file_name);
+  static void closeDocument(string file_name);
+  // Prints the canvas to its own file stem.pdf, or as the page stem of the document
+  static void print(TCanvas *canvas, string directory, string document, string stem);
 
 private:
 
   void stylePlot(TGraphErrors *graph, string x_label, string y_label);
+  TGraphErrors *makeProbabilityGraph(const NC_Results &results);
+  TH1 *makeCycleHistogram(const NC_Results &results);
+  template<class T> T *keep(T *object) { m_objects.emplace_back(object); return object; }
+  string name(string base) const { return base + m_suffix; }
+
+  string m_suffix;
+  string m_directory;
+  string m_document;
+  vector<unique_ptr<TObject>> m_objects;
+
 };
 
 
-void NC_Plotter::PlotProbabilityOverCycles(const int size, float probability[], float probability_uncertainty[]) {
+void NC_Plotter::openDocument(string file_name) {
+  TCanvas canvas("canvas_document", "", 0, 0, 800, 600);
+  canvas.Print((file_name + "[").c_str());
+}
+
 
-  float cycle[size];
-  float cycle_uncertainty[size];
+void NC_Plotter::closeDocument(string file_name) {
+  TCanvas canvas("canvas_document", "", 0, 0, 800, 600);
+  canvas.Print((file_name + "]").c_str());
+}
 
-  // Need to quickly fill cycle information
-  for (int i = 0; i < size; ++i) {
-	cycle[i] = i+1;
-	cycle_uncertainty[i] = 0.0;
-  }
+
+void NC_Plotter::print(TCanvas *canvas, string directory, string document, string stem) {
+
+  NC_TraceScope print_scope("canvasPrint");
+  if (document.empty()) canvas->Print((directory + stem + ".pdf").c_str(), "pdf");
+  else canvas->Print((directory + document).c_str(), ("Title:" + stem).c_str());
+  NC_Trace::count("plots written", 1);
+
+  return;
+}
+
+
+void NC_Plotter::PlotProbabilityOverCycles(const NC_Results &results) {
+
+  NC_TraceScope trace_scope("plotProbability");
+  int size = results.n_cycles;
 
   // Initialise canvas and graph for plotting
-  TCanvas *canvas_overallProbability = new TCanvas("canvas_overallProbability","",0,0,800,600);
-  TGraphErrors *g_overallProbability = new TGraphErrors(size, cycle, probability, cycle_uncertainty, probability_uncertainty);
+  TCanvas *canvas_overallProbability = keep(new TCanvas(name("canvas_overallProbability").c_str(),"",0,0,800,600));
+  TGraphErrors *g_overallProbability = keep(makeProbabilityGraph(results));
 
   // Make plot look a bit nicer
   stylePlot<TGraphErrors>(g_overallProbability, "Number of menstruation cycles", "Pregnancy probability [%]");
@@ -55,18 +100,16 @@ void NC_Plotter::PlotProbabilityOverCycles(const int size, float probability[],
   g_overallProbability->Draw("a3");
   g_overallProbability->Draw("lxsame");
 
-  // Fit graph and stylise fit function
-  TF1 *fit = new TF1("fit", "[0]*(1-exp(-1.0*[1]*x))", 1.0, size);
-  fit->SetParameter(0, 74);
-  fit->SetParameter(1, 0.2);
+  // Draw the fit result and stylise fit function
+  TF1 *fit = keep(new TF1(name("fit").c_str(), "[0]*(1-exp(-1.0*[1]*x))", 1.0, size));
+  fit->SetParameter(0, results.probability_fit[0]);
+  fit->SetParameter(1, results.probability_fit[1]);
   fit->SetLineColor(1);
   fit->SetLineStyle(3);
-  g_overallProbability->Fit("fit", "R");
   fit->Draw("same");
 
-  printf("\nChance of getting pregnant within 13 cycles from fit is %4.3f\n\n", fit->Eval(13));
   // Add a legend to the canvas
-  TLegend *legend = new TLegend(0.58,0.25,0.91,0.15);
+  TLegend *legend = keep(new TLegend(0.58,0.25,0.91,0.15));
   legend->SetTextSize(0.035);
   legend->SetBorderSize(0);
   legend->AddEntry(g_overallProbability, "Cummulative probability","fl");
@@ -74,7 +117,7 @@ void NC_Plotter::PlotProbabilityOverCycles(const int size, float probability[],
   legend->Draw();
 
   // Save plot as pdf
-  canvas_overallProbability->Print("cummulativeProbability.pdf", "pdf");
+  print(canvas_overallProbability, m_directory, m_document, "cummulativeProbability");
 
   return;
 }
@@ -83,7 +126,8 @@ void NC_Plotter::PlotProbabilityOverCycles(const int size, float probability[],
 // Function to define the style of plots
 template<class T> void NC_Plotter::stylePlot(T *graph, string x_label, string y_label) {
 
-  TColor *nc_colour = new TColor(1701, 0.4471, 0.0118, 0.3647);
+  // The colour belongs to ROOT and only needs to be defined once per session
+  if (!gROOT->GetColor(1701)) new TColor(1701, 0.4471, 0.0118, 0.3647);
 
   graph->GetXaxis()->SetTitle(x_label.c_str());
   graph->GetYaxis()->SetTitle(y_label.c_str());
@@ -98,43 +142,43 @@ template<class T> void NC_Plotter::stylePlot(T *graph, string x_label, string y_
 }
 
 
-void NC_Plotter::DrawHistogram(const int size, TH1 *hist) {
+void NC_Plotter::DrawHistogram(const NC_Results &results) {
+
+  NC_TraceScope trace_scope("plotHistogram");
+  int size = results.n_cycles;
 
   // Create canvas and stylise histogram
-  TCanvas *canvas_hist = new TCanvas("canvas_hist","",0,0,800,600);
+  TCanvas *canvas_hist = keep(new TCanvas(name("canvas_hist").c_str(),"",0,0,800,600));
+  TH1 *hist = keep(makeCycleHistogram(results));
   hist->Draw("hist");
   hist->SetStats(false);
   stylePlot<TH1>(hist, "Number of menstruation cycles", "Number of pregnancies");
 
-  // Fit histogram
-  TF1 *fit_hist = new TF1("fit_hist", "[0]*exp(-1.0*[1]*x)", 0.5, size);
+  // Draw the fit result
+  TF1 *fit_hist = keep(new TF1(name("fit_hist").c_str(), "[0]*exp(-1.0*[1]*x)", 0.5, size));
+  fit_hist->SetParameter(0, results.histogram_fit[0]);
+  fit_hist->SetParameter(1, results.histogram_fit[1]);
   fit_hist->SetLineColor(1);
   fit_hist->SetLineWidth(2);
   fit_hist->SetLineStyle(2);
-  hist->Fit("fit_hist", "R");
   fit_hist->Draw("same");
 
   // Because its interesting, let's get the percentile lines into the plot
-  std::vector<float> perc_to_plot = {0.50, 0.80, 0.95};
-  std::vector<float> percentiles = getPercentiles(fit_hist, size, perc_to_plot);
-  std::vector<TLine*> lines;
   TLatex latex;
   latex.SetTextSize(0.032);
   latex.SetTextColor(kAzure);
   char c_text[35];
-  for (int i_perc = 0; i_perc < perc_to_plot.size(); ++i_perc) {
-	TLine *line = new TLine(percentiles[i_perc], 0.0, percentiles[i_perc], 250.0);
-	printf("The %4.2f percentile corresponds to %4.2f cycles\n", perc_to_plot[i_perc], percentiles[i_perc]);
+  for (int i_perc = 0; i_perc < results.percentiles.size(); ++i_perc) {
+	TLine *line = keep(new TLine(results.percentiles[i_perc], 0.0, results.percentiles[i_perc], 250.0));
 	line->SetLineColor(kAzure);
 	line->SetLineWidth(2);
-	lines.push_back(line);
-	lines[i_perc]->Draw();
-	sprintf(c_text, "#color[860]{%3.1f%%}", perc_to_plot[i_perc]*100.0);
-	latex.DrawLatex(percentiles[i_perc]+0.2,240.0,c_text);
+	line->Draw();
+	sprintf(c_text, "#color[860]{%3.1f%%}", results.percentile_levels[i_perc]*100.0);
+	latex.DrawLatex(results.percentiles[i_perc]+0.2,240.0,c_text);
   }
 
   // Add a legend to the canvas
-  TLegend *legend_hist = new TLegend(0.61,0.95,0.91,0.85);
+  TLegend *legend_hist = keep(new TLegend(0.61,0.95,0.91,0.85));
   legend_hist->SetTextSize(0.035);
   legend_hist->SetBorderSize(0);
   legend_hist->AddEntry(hist, "Pregnancies","fl");
@@ -142,27 +186,39 @@ void NC_Plotter::DrawHistogram(const int size, TH1 *hist) {
   legend_hist->Draw();
 
   // Save plot as pdf
-  canvas_hist->Print("pregnanciesInCycle.pdf", "pdf");
+  print(canvas_hist, m_directory, m_document, "pregnanciesInCycle");
 
   return;
 }
 
 
-// Function to determine the x-axis value of the supplied percentiles
-std::vector<float> NC_Plotter::getPercentiles(TF1 *func, const int size, std::vector<float> perc_values) {
-  std::vector<float> percentiles;
-  float integral = func->Integral(1.0, size);
-
-  // This is a bit ugly, but it works; finding percentile values by integrating in increments
-  float step_integral;
-  for (float time = 0; time < size; time+=0.05) {
-	step_integral = func->Integral(1.0, time);
-	if (step_integral / integral > perc_values[0]) {
-		percentiles.push_back(time);
-		perc_values.erase(perc_values.begin());
-	}
-	if (perc_values.size() == 0) break;
-  }
+TGraphErrors *NC_Plotter::makeProbabilityGraph(const NC_Results &results) {
+
+  int size = results.n_cycles;
+  std::vector<float> cycle(size), cycle_uncertainty(size, 0.0);
+
+  // Need to quickly fill cycle information
+  for (int i = 0; i < size; ++i) cycle[i] = i+1;
+
+  return new TGraphErrors(size, cycle.data(), results.cumulative_probability.data(), cycle_uncertainty.data(), results.cumulative_uncertainty.data());
+}
 
-  return percentiles;
+
+TH1 *NC_Plotter::makeCycleHistogram(const NC_Results &results) {
+
+  int size = results.n_cycles;
+  TH1 *hist = new TH1F(name("hist_pregnancy_cycle").c_str(), "Cycles until pregnancy", size, 0.5, size+0.5);
+  // The caller owns the histogram, not the current ROOT directory
+  hist->SetDirectory(nullptr);
+  for (int i_bin = 0; i_bin < results.cycle_histogram.size(); ++i_bin)
+	hist->SetBinContent(i_bin, results.cycle_histogram[i_bin]);
+  hist->SetEntries(hist->Integral());
+
+  return hist;
+}
+
+
+// Function to determine the x-axis value of the supplied percentiles (in any order) for any function between 1 and size
+std::vector<float> NC_Plotter::getPercentiles(TF1 *func, const int size, std::vector<float> perc_values) {
+  return NC_Quantile::function([func](double x) { return func->Eval(x); }, 1.0, size, perc_values, 1e-4);
 }
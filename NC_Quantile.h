@@ -0,0 +1,117 @@
+#pragma once
+// Quantiles of distributions for any batch of levels, the levels do not have to be sorted
+// Author: Jochen jens Heinrich 2022
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace std;
+
+class NC_Quantile {
+
+public:
+
+  // Density proportional to exp(-slope*x) on [x_low, x_high], the CDF is inverted in closed form
+  static vector<float> exponential(double slope, double x_low, double x_high, const vector<float> &levels);
+  // Any non-negative density func(x) on [x_low, x_high]: integrated once cumulatively on n_steps intervals,
+  // then every level is bracketed by a binary search and solved to the tolerance in x
+  template<class F> static vector<float> function(F func, double x_low, double x_high, const vector<float> &levels, double tolerance = 1e-6, int n_steps = 256);
+  // Empirical quantiles of equal-width bins between x_low and x_high, the entries are taken as spread evenly over each bin
+  static vector<float> histogram(const vector<double> &contents, double x_low, double x_high, const vector<float> &levels);
+
+private:
+
+  // Five point Gauss-Legendre integral over [a, b]
+  template<class F> static double integral(F func, double a, double b);
+
+};
+
+
+vector<float> NC_Quantile::exponential(double slope, double x_low, double x_high, const vector<float> &levels) {
+
+  vector<float> quantiles(levels.size(), NAN);
+  double range = x_high - x_low;
+
+  for (int i = 0; i < levels.size(); ++i) {
+	double level = levels[i];
+	if (!(level >= 0.0 && level <= 1.0)) continue;
+	// F(x) = (1 - exp(-slope*(x-x_low))) / (1 - exp(-slope*range)), a vanishing slope is the uniform distribution
+	if (fabs(slope * range) < 1e-9) quantiles[i] = x_low + level * range;
+	else quantiles[i] = x_low - log1p(level * expm1(-slope * range)) / slope;
+  }
+
+  return quantiles;
+}
+
+
+template<class F> vector<float> NC_Quantile::function(F func, double x_low, double x_high, const vector<float> &levels, double tolerance, int n_steps) {
+
+  vector<float> quantiles(levels.size(), NAN);
+
+  // Cumulative integral at the step edges
+  double step = (x_high - x_low) / n_steps;
+  vector<double> cumulative(n_steps+1, 0.0);
+  for (int i_step = 0; i_step < n_steps; ++i_step)
+	cumulative[i_step+1] = cumulative[i_step] + integral(func, x_low + i_step*step, x_low + (i_step+1)*step);
+  double total = cumulative[n_steps];
+  if (!(total > 0.0)) return quantiles;
+
+  for (int i = 0; i < levels.size(); ++i) {
+	double level = levels[i];
+	if (!(level >= 0.0 && level <= 1.0)) continue;
+	double target = level * total;
+
+	// The step that contains the quantile
+	int i_step = upper_bound(cumulative.begin(), cumulative.end(), target) - cumulative.begin() - 1;
+	i_step = max(0, min(i_step, n_steps-1));
+	double a = x_low + i_step*step, b = a + step;
+	double rest = target - cumulative[i_step];
+
+	// Bisection, with the integral from the step edge, so every evaluation only integrates over a fraction of one step
+	while (b - a > tolerance) {
+		double middle = 0.5 * (a + b);
+		if (integral(func, x_low + i_step*step, middle) < rest) a = middle;
+		else b = middle;
+	}
+	quantiles[i] = 0.5 * (a + b);
+  }
+
+  return quantiles;
+}
+
+
+vector<float> NC_Quantile::histogram(const vector<double> &contents, double x_low, double x_high, const vector<float> &levels) {
+
+  vector<float> quantiles(levels.size(), NAN);
+  int n_bins = contents.size();
+  if (n_bins == 0) return quantiles;
+  double width = (x_high - x_low) / n_bins;
+
+  vector<double> cumulative(n_bins+1, 0.0);
+  for (int i_bin = 0; i_bin < n_bins; ++i_bin) cumulative[i_bin+1] = cumulative[i_bin] + contents[i_bin];
+  double total = cumulative[n_bins];
+  if (!(total > 0.0)) return quantiles;
+
+  for (int i = 0; i < levels.size(); ++i) {
+	double level = levels[i];
+	if (!(level >= 0.0 && level <= 1.0)) continue;
+	double target = level * total;
+	// First bin in which the cumulative sum reaches the target, empty bins are skipped
+	int i_bin = lower_bound(cumulative.begin()+1, cumulative.end(), target) - cumulative.begin() - 1;
+	i_bin = max(0, min(i_bin, n_bins-1));
+	double fraction = contents[i_bin] > 0.0 ? (target - cumulative[i_bin]) / contents[i_bin] : 0.0;
+	quantiles[i] = x_low + (i_bin + fraction) * width;
+  }
+
+  return quantiles;
+}
+
+
+template<class F> double NC_Quantile::integral(F func, double a, double b) {
+  static const double kNodes[5] = {0.0, -0.5384693101056831, 0.5384693101056831, -0.9061798459386640, 0.9061798459386640};
+  static const double kWeights[5] = {0.5688888888888889, 0.4786286704993665, 0.4786286704993665, 0.2369268850561891, 0.2369268850561891};
+  double centre = 0.5 * (a + b), half = 0.5 * (b - a), sum = 0.0;
+  for (int i = 0; i < 5; ++i) sum += kWeights[i] * func(centre + half * kNodes[i]);
+  return sum * half;
+}
@@ -0,0 +1,467 @@
+#pragma once
+// Plain container for all numbers the analysis produces, with machine-readable output so plots and dashboards can be
+// produced later from a saved file instead of during the analysis
+// Author: Jochen jens Heinrich 2022
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "NC_Correlation.h"
+#include "NC_Hazard.h"
+
+using namespace std;
+
+class NC_Results {
+
+public:
+
+  NC_Results() {}
+  ~NC_Results() {}
+
+  // Description of the stratum the numbers belong to, empty for all users
+  string group;
+
+  // Question 1: cummulative pregnancy probability in percent and the fit [0]*(1-exp(-[1]*x))
+  // The Kaplan-Meier curve behind it covers all cycles in the data, index 0 is cycle 1
+  vector<double> survival_at_risk;
+  vector<double> survival_events;
+  vector<double> survival;
+  vector<double> survival_error;
+  int n_cycles = 0;
+  vector<float> cumulative_probability;
+  vector<float> cumulative_uncertainty;
+  vector<double> probability_fit;
+  vector<double> probability_fit_error;
+  double probability_at_13 = 0.0;
+  // Bootstrap percentile band of the cummulative probability in percent, covering the fraction bootstrap_level of the resamples
+  int n_resamples = 0;
+  float bootstrap_level = 0.0;
+  vector<float> probability_lower;
+  vector<float> probability_upper;
+
+  // Question 2: pregnancies per cycle including under- and overflow, the fit [0]*exp(-[1]*x) and its percentiles
+  vector<double> cycle_histogram;
+  vector<double> histogram_fit;
+  vector<double> histogram_fit_error;
+  vector<float> percentile_levels;
+  vector<float> percentiles;
+  vector<float> empirical_percentiles;
+
+  // Question 3: everything about the correlation of each covariate with the cycles until pregnancy
+  vector<NC_CorrelationResult> correlations;
+  // Shuffles behind the p-values of the correlations, 0 if there was no permutation test
+  int n_permutations = 0;
+  // All covariates at once in a discrete-time hazard model, empty if it was not fitted
+  NC_HazardResult hazard;
+
+  // The format follows the file extension: .json or anything else for CSV
+  bool write(string file_name) const;
+  // verbose = false leaves out the line about the file on success, e.g. for files only passed between processes
+  bool writeCSV(string file_name, bool verbose = true) const;
+  bool writeJSON(string file_name) const;
+  bool readCSV(string file_name, bool verbose = true);
+  // Results of several strata in one file, CSV rows get the group as an extra first column
+  static bool write(string file_name, const vector<NC_Results> &strata);
+
+private:
+
+  void writeCSVRows(FILE *file, string prefix) const;
+  void writeJSONObject(FILE *file) const;
+  static bool isJSON(const string &file_name) { return file_name.size() >= 5 && file_name.compare(file_name.size()-5, 5, ".json") == 0; }
+  static string quote(const string &text);
+  static vector<string> splitCSV(const string &line);
+
+};
+
+
+bool NC_Results::write(string file_name) const {
+  if (isJSON(file_name)) return writeJSON(file_name);
+  return writeCSV(file_name);
+}
+
+
+bool NC_Results::write(string file_name, const vector<NC_Results> &strata) {
+
+  FILE *file = fopen(file_name.c_str(), "w");
+  if (!file) {
+	printf("...Could not write results file '%s'\n", file_name.c_str());
+	return false;
+  }
+
+  if (isJSON(file_name)) {
+	fprintf(file, "[");
+	for (int i_group = 0; i_group < strata.size(); ++i_group) {
+		fprintf(file, i_group ? ",\n" : "\n");
+		strata[i_group].writeJSONObject(file);
+	}
+	fprintf(file, "\n]\n");
+  }
+  else {
+	fprintf(file, "group,quantity,covariate,index,value,error\n");
+	for (const NC_Results &results : strata) results.writeCSVRows(file, quote(results.group) + ",");
+  }
+
+  fclose(file);
+  printf("Wrote results of %zu groups to %s\n", strata.size(), file_name.c_str());
+  return true;
+}
+
+
+// One value per line: quantity,covariate,index,value,error
+bool NC_Results::writeCSV(string file_name, bool verbose) const {
+
+  FILE *file = fopen(file_name.c_str(), "w");
+  if (!file) {
+	printf("...Could not write results file '%s'\n", file_name.c_str());
+	return false;
+  }
+
+  fprintf(file, "quantity,covariate,index,value,error\n");
+  writeCSVRows(file, "");
+
+  fclose(file);
+  if (verbose) printf("Wrote results to %s\n", file_name.c_str());
+  return true;
+}
+
+
+// Every row starts with the prefix
+void NC_Results::writeCSVRows(FILE *file, string prefix) const {
+
+  const char *p = prefix.c_str();
+  if (!group.empty() && prefix.empty()) fprintf(file, "group,,0,%s,\n", quote(group).c_str());
+  for (int i = 0; i < survival.size(); ++i) {
+	fprintf(file, "%ssurvival_counts,,%d,%.17g,%.17g\n", p, i, survival_at_risk[i], survival_events[i]);
+	fprintf(file, "%ssurvival,,%d,%.9g,%.9g\n", p, i, survival[i], survival_error[i]);
+  }
+  fprintf(file, "%sn_cycles,,0,%d,\n", p, n_cycles);
+  for (int i = 0; i < cumulative_probability.size(); ++i)
+	fprintf(file, "%scumulative_probability,,%d,%.9g,%.9g\n", p, i, cumulative_probability[i], cumulative_uncertainty[i]);
+  for (int i = 0; i < probability_fit.size(); ++i)
+	fprintf(file, "%sprobability_fit,,%d,%.9g,%.9g\n", p, i, probability_fit[i], probability_fit_error[i]);
+  fprintf(file, "%sprobability_at_13,,0,%.9g,\n", p, probability_at_13);
+  fprintf(file, "%sn_resamples,,0,%d,\n", p, n_resamples);
+  fprintf(file, "%sbootstrap_level,,0,%.9g,\n", p, bootstrap_level);
+  for (int i = 0; i < probability_lower.size(); ++i)
+	fprintf(file, "%sprobability_band,,%d,%.9g,%.9g\n", p, i, probability_lower[i], probability_upper[i]);
+  for (int i = 0; i < cycle_histogram.size(); ++i)
+	fprintf(file, "%scycle_histogram,,%d,%.9g,\n", p, i, cycle_histogram[i]);
+  for (int i = 0; i < histogram_fit.size(); ++i)
+	fprintf(file, "%shistogram_fit,,%d,%.9g,%.9g\n", p, i, histogram_fit[i], histogram_fit_error[i]);
+  for (int i = 0; i < percentiles.size(); ++i) {
+	fprintf(file, "%spercentile_level,,%d,%.9g,\n", p, i, percentile_levels[i]);
+	fprintf(file, "%spercentile,,%d,%.9g,\n", p, i, percentiles[i]);
+  }
+  for (int i = 0; i < empirical_percentiles.size(); ++i)
+	fprintf(file, "%sempirical_percentile,,%d,%.9g,\n", p, i, empirical_percentiles[i]);
+  fprintf(file, "%sn_permutations,,0,%d,\n", p, n_permutations);
+  if (hazard.n_users > 0) {
+	fprintf(file, "%shazard_users,,0,%ld,%ld\n", p, hazard.n_users, hazard.n_user_cycles);
+	fprintf(file, "%shazard_fit,,%d,%.17g,%d\n", p, hazard.n_iterations, hazard.log_likelihood, hazard.converged);
+	for (int i = 0; i < hazard.baseline.size(); ++i)
+		fprintf(file, "%shazard_baseline,%s,%d,%.17g,%.17g\n", p, quote(hazard.baseline[i].name).c_str(), i, hazard.baseline[i].estimate,
+			hazard.baseline[i].error);
+	for (const NC_HazardCoefficient &coefficient : hazard.coefficients) {
+		string name = quote(coefficient.name);
+		fprintf(file, "%shazard_coefficient,%s,0,%.17g,%.17g\n", p, name.c_str(), coefficient.estimate, coefficient.error);
+		fprintf(file, "%shazard_ratio,%s,0,%.17g,\n", p, name.c_str(), coefficient.hazard_ratio);
+		fprintf(file, "%shazard_p_value,%s,0,%.17g,\n", p, name.c_str(), coefficient.p_value);
+	}
+  }
+
+  for (const NC_CorrelationResult &result : correlations) {
+	string name = quote(result.name);
+	fprintf(file, "%slabel,%s,0,%s,\n", p, name.c_str(), quote(result.label).c_str());
+	fprintf(file, "%spar_name,%s,0,%s,\n", p, name.c_str(), quote(result.par_name).c_str());
+	fprintf(file, "%sn,%s,0,%.17g,\n", p, name.c_str(), result.n);
+	fprintf(file, "%spearson,%s,0,%.17g,\n", p, name.c_str(), result.pearson);
+	fprintf(file, "%sspearman,%s,0,%.17g,\n", p, name.c_str(), result.spearman);
+	fprintf(file, "%skendall,%s,0,%.17g,\n", p, name.c_str(), result.kendall);
+	fprintf(file, "%sp_value,%s,0,%.17g,\n", p, name.c_str(), result.p_value);
+	fprintf(file, "%sq_value,%s,0,%.17g,\n", p, name.c_str(), result.q_value);
+	if (result.categorical()) {
+		fprintf(file, "%sanova_f,%s,0,%.17g,\n", p, name.c_str(), result.anova_f);
+		fprintf(file, "%seta_squared,%s,0,%.17g,\n", p, name.c_str(), result.eta_squared);
+		fprintf(file, "%skruskal_wallis,%s,0,%.17g,\n", p, name.c_str(), result.kruskal_wallis);
+		fprintf(file, "%scramers_v,%s,0,%.17g,\n", p, name.c_str(), result.cramers_v);
+	}
+	fprintf(file, "%sx_bins,%s,0,%d,\n", p, name.c_str(), result.x_bins);
+	fprintf(file, "%sx_low,%s,0,%.9g,\n", p, name.c_str(), result.x_low);
+	fprintf(file, "%sx_high,%s,0,%.9g,\n", p, name.c_str(), result.x_high);
+	fprintf(file, "%sn_cycle_bins,%s,0,%d,\n", p, name.c_str(), result.n_cycle_bins);
+	for (int i = 0; i < result.bin_labels.size(); ++i) {
+		if (!result.bin_labels[i].empty()) fprintf(file, "%sbin_label,%s,%d,%s,\n", p, name.c_str(), i, quote(result.bin_labels[i]).c_str());
+	}
+	for (int i = 0; i < result.bin_average.size(); ++i)
+		fprintf(file, "%sbin_average,%s,%d,%.9g,%.9g\n", p, name.c_str(), i, result.bin_average[i], result.bin_average_error[i]);
+	// The table is mostly empty, so only filled cells are written
+	for (int i = 0; i < result.table.size(); ++i) {
+		if (result.table[i] != 0.0) fprintf(file, "%stable,%s,%d,%.17g,\n", p, name.c_str(), i, result.table[i]);
+	}
+  }
+
+  return;
+}
+
+
+bool NC_Results::writeJSON(string file_name) const {
+
+  FILE *file = fopen(file_name.c_str(), "w");
+  if (!file) {
+	printf("...Could not write results file '%s'\n", file_name.c_str());
+	return false;
+  }
+
+  writeJSONObject(file);
+  fprintf(file, "\n");
+
+  fclose(file);
+  printf("Wrote results to %s\n", file_name.c_str());
+  return true;
+}
+
+
+void NC_Results::writeJSONObject(FILE *file) const {
+
+  // JSON has no NaN, so missing numbers become null
+  auto number = [](double value) {
+	if (!isfinite(value)) return string("null");
+	char text[32];
+	snprintf(text, sizeof(text), "%.9g", value);
+	return string(text);
+  };
+  auto array = [&](const auto &values) {
+	string text = "[";
+	for (int i = 0; i < values.size(); ++i) text += (i ? ", " : "") + number(values[i]);
+	return text + "]";
+  };
+  auto text = [](const string &value) {
+	string escaped = "\"";
+	for (char c : value) {
+		if (c == '"' || c == '\\') escaped += '\\';
+		escaped += c;
+	}
+	return escaped + "\"";
+  };
+
+  fprintf(file, "{\n");
+  if (!group.empty()) fprintf(file, "  \"group\": %s,\n", text(group).c_str());
+  fprintf(file, "  \"survival_at_risk\": %s,\n", array(survival_at_risk).c_str());
+  fprintf(file, "  \"survival_events\": %s,\n", array(survival_events).c_str());
+  fprintf(file, "  \"survival\": %s,\n", array(survival).c_str());
+  fprintf(file, "  \"survival_error\": %s,\n", array(survival_error).c_str());
+  fprintf(file, "  \"n_cycles\": %d,\n", n_cycles);
+  fprintf(file, "  \"cumulative_probability\": %s,\n", array(cumulative_probability).c_str());
+  fprintf(file, "  \"cumulative_uncertainty\": %s,\n", array(cumulative_uncertainty).c_str());
+  fprintf(file, "  \"probability_fit\": %s,\n", array(probability_fit).c_str());
+  fprintf(file, "  \"probability_fit_error\": %s,\n", array(probability_fit_error).c_str());
+  fprintf(file, "  \"probability_at_13\": %s,\n", number(probability_at_13).c_str());
+  fprintf(file, "  \"n_resamples\": %d,\n", n_resamples);
+  fprintf(file, "  \"bootstrap_level\": %s,\n", number(bootstrap_level).c_str());
+  fprintf(file, "  \"probability_lower\": %s,\n", array(probability_lower).c_str());
+  fprintf(file, "  \"probability_upper\": %s,\n", array(probability_upper).c_str());
+  fprintf(file, "  \"cycle_histogram\": %s,\n", array(cycle_histogram).c_str());
+  fprintf(file, "  \"histogram_fit\": %s,\n", array(histogram_fit).c_str());
+  fprintf(file, "  \"histogram_fit_error\": %s,\n", array(histogram_fit_error).c_str());
+  fprintf(file, "  \"percentile_levels\": %s,\n", array(percentile_levels).c_str());
+  fprintf(file, "  \"percentiles\": %s,\n", array(percentiles).c_str());
+  fprintf(file, "  \"empirical_percentiles\": %s,\n", array(empirical_percentiles).c_str());
+  fprintf(file, "  \"n_permutations\": %d,\n", n_permutations);
+  fprintf(file, "  \"hazard\": {\"n_users\": %ld, \"n_user_cycles\": %ld, \"log_likelihood\": %s, \"n_iterations\": %d, \"converged\": %s,\n",
+	hazard.n_users, hazard.n_user_cycles, number(hazard.log_likelihood).c_str(), hazard.n_iterations, hazard.converged ? "true" : "false");
+  fprintf(file, "    \"baseline\": [");
+  for (int i = 0; i < hazard.baseline.size(); ++i) {
+	const NC_HazardCoefficient &coefficient = hazard.baseline[i];
+	fprintf(file, "%s\n      {\"name\": %s, \"estimate\": %s, \"error\": %s}", i ? "," : "", text(coefficient.name).c_str(),
+		number(coefficient.estimate).c_str(), number(coefficient.error).c_str());
+  }
+  fprintf(file, "],\n    \"coefficients\": [");
+  for (int i = 0; i < hazard.coefficients.size(); ++i) {
+	const NC_HazardCoefficient &coefficient = hazard.coefficients[i];
+	fprintf(file, "%s\n      {\"name\": %s, \"estimate\": %s, \"error\": %s, \"hazard_ratio\": %s, \"p_value\": %s}", i ? "," : "",
+		text(coefficient.name).c_str(), number(coefficient.estimate).c_str(), number(coefficient.error).c_str(),
+		number(coefficient.hazard_ratio).c_str(), number(coefficient.p_value).c_str());
+  }
+  fprintf(file, "]},\n");
+  fprintf(file, "  \"correlations\": [");
+  for (int i_cov = 0; i_cov < correlations.size(); ++i_cov) {
+	const NC_CorrelationResult &result = correlations[i_cov];
+	string labels = "[";
+	for (int i = 0; i < result.bin_labels.size(); ++i) labels += (i ? ", " : "") + text(result.bin_labels[i]);
+	labels += "]";
+	fprintf(file, "%s\n    {\"name\": %s, \"label\": %s, \"par_name\": %s, \"n\": %s, \"pearson\": %s, \"spearman\": %s, \"kendall\": %s,\n",
+		i_cov ? "," : "", text(result.name).c_str(), text(result.label).c_str(), text(result.par_name).c_str(), number(result.n).c_str(),
+		number(result.pearson).c_str(), number(result.spearman).c_str(), number(result.kendall).c_str());
+	fprintf(file, "     \"p_value\": %s, \"q_value\": %s,\n", number(result.p_value).c_str(), number(result.q_value).c_str());
+	if (result.categorical()) fprintf(file, "     \"anova_f\": %s, \"eta_squared\": %s, \"kruskal_wallis\": %s, \"cramers_v\": %s,\n",
+		number(result.anova_f).c_str(), number(result.eta_squared).c_str(), number(result.kruskal_wallis).c_str(), number(result.cramers_v).c_str());
+	fprintf(file, "     \"x_bins\": %d, \"x_low\": %s, \"x_high\": %s, \"n_cycle_bins\": %d, \"bin_labels\": %s,\n",
+		result.x_bins, number(result.x_low).c_str(), number(result.x_high).c_str(), result.n_cycle_bins, labels.c_str());
+	fprintf(file, "     \"bin_average\": %s,\n     \"bin_average_error\": %s,\n     \"table\": %s}",
+		array(result.bin_average).c_str(), array(result.bin_average_error).c_str(), array(result.table).c_str());
+  }
+  fprintf(file, "\n  ]\n}");
+
+  return;
+}
+
+
+// Function to read back results written by writeCSV
+bool NC_Results::readCSV(string file_name, bool verbose) {
+
+  ifstream file(file_name.c_str());
+  if (!file.is_open()) {
+	printf("...Could not open results file '%s'\n", file_name.c_str());
+	return false;
+  }
+  *this = NC_Results();
+
+  // Vectors grow as needed, so the order of the lines does not matter
+  auto set = [](auto &values, int index, double value) {
+	if (values.size() <= index) values.resize(index+1);
+	values[index] = value;
+  };
+
+  string line;
+  std::getline(file, line);
+  while (std::getline(file, line)) {
+	vector<string> fields = splitCSV(line);
+	if (fields.size() < 5) continue;
+	const string &quantity = fields[0];
+	int index = atoi(fields[2].c_str());
+	double value = atof(fields[3].c_str()), error = atof(fields[4].c_str());
+
+	if (quantity == "group") group = fields[3];
+	else if (quantity == "survival_counts") {
+		set(survival_at_risk, index, value);
+		set(survival_events, index, error);
+	}
+	else if (quantity == "survival") {
+		set(survival, index, value);
+		set(survival_error, index, error);
+	}
+	else if (quantity == "n_cycles") n_cycles = value;
+	else if (quantity == "cumulative_probability") {
+		set(cumulative_probability, index, value);
+		set(cumulative_uncertainty, index, error);
+	}
+	else if (quantity == "probability_fit") {
+		set(probability_fit, index, value);
+		set(probability_fit_error, index, error);
+	}
+	else if (quantity == "probability_at_13") probability_at_13 = value;
+	else if (quantity == "n_resamples") n_resamples = value;
+	else if (quantity == "bootstrap_level") bootstrap_level = value;
+	else if (quantity == "probability_band") {
+		set(probability_lower, index, value);
+		set(probability_upper, index, error);
+	}
+	else if (quantity == "cycle_histogram") set(cycle_histogram, index, value);
+	else if (quantity == "histogram_fit") {
+		set(histogram_fit, index, value);
+		set(histogram_fit_error, index, error);
+	}
+	else if (quantity == "percentile_level") set(percentile_levels, index, value);
+	else if (quantity == "percentile") set(percentiles, index, value);
+	else if (quantity == "empirical_percentile") set(empirical_percentiles, index, value);
+	else if (quantity == "n_permutations") n_permutations = value;
+	else if (quantity == "hazard_users") {
+		hazard.n_users = value;
+		hazard.n_user_cycles = error;
+	}
+	else if (quantity == "hazard_fit") {
+		hazard.n_iterations = index;
+		hazard.log_likelihood = value;
+		hazard.converged = error != 0.0;
+	}
+	else if (quantity == "hazard_baseline") {
+		if (hazard.baseline.size() <= index) hazard.baseline.resize(index+1);
+		hazard.baseline[index].name = fields[1];
+		hazard.baseline[index].estimate = value;
+		hazard.baseline[index].error = error;
+	}
+	else if (quantity.compare(0, 7, "hazard_") == 0) {
+		if (hazard.coefficients.empty() || hazard.coefficients.back().name != fields[1]) {
+			hazard.coefficients.push_back(NC_HazardCoefficient());
+			hazard.coefficients.back().name = fields[1];
+		}
+		NC_HazardCoefficient &coefficient = hazard.coefficients.back();
+		if (quantity == "hazard_coefficient") {
+			coefficient.estimate = value;
+			coefficient.error = error;
+		}
+		else if (quantity == "hazard_ratio") coefficient.hazard_ratio = value;
+		else if (quantity == "hazard_p_value") coefficient.p_value = value;
+	}
+	else {
+		// Everything else belongs to a covariate
+		if (correlations.empty() || correlations.back().name != fields[1]) {
+			correlations.push_back(NC_CorrelationResult());
+			correlations.back().name = fields[1];
+		}
+		NC_CorrelationResult &result = correlations.back();
+		if (quantity == "label") result.label = fields[3];
+		else if (quantity == "par_name") result.par_name = fields[3];
+		else if (quantity == "n") result.n = value;
+		else if (quantity == "pearson") result.pearson = value;
+		else if (quantity == "spearman") result.spearman = value;
+		else if (quantity == "kendall") result.kendall = value;
+		else if (quantity == "p_value") result.p_value = value;
+		else if (quantity == "q_value") result.q_value = value;
+		else if (quantity == "anova_f") result.anova_f = value;
+		else if (quantity == "eta_squared") result.eta_squared = value;
+		else if (quantity == "kruskal_wallis") result.kruskal_wallis = value;
+		else if (quantity == "cramers_v") result.cramers_v = value;
+		else if (quantity == "x_bins") result.x_bins = value;
+		else if (quantity == "x_low") result.x_low = value;
+		else if (quantity == "x_high") result.x_high = value;
+		else if (quantity == "n_cycle_bins") {
+			result.n_cycle_bins = value;
+			result.table.assign((result.x_bins+2) * (result.n_cycle_bins+2), 0.0);
+		}
+		else if (quantity == "bin_label") {
+			if (result.bin_labels.size() <= index) result.bin_labels.resize(index+1);
+			result.bin_labels[index] = fields[3];
+		}
+		else if (quantity == "bin_average") {
+			set(result.bin_average, index, value);
+			set(result.bin_average_error, index, error);
+		}
+		else if (quantity == "table") set(result.table, index, value);
+	}
+  }
+
+  if (verbose) printf("Read results from %s\n", file_name.c_str());
+  return true;
+}
+
+
+string NC_Results::quote(const string &text) {
+  if (text.find_first_of(",\"\n") == string::npos) return text;
+  string quoted = "\"";
+  for (char c : text) {
+	if (c == '"') quoted += '"';
+	quoted += c;
+  }
+  return quoted + "\"";
+}
+
+
+vector<string> NC_Results::splitCSV(const string &line) {
+  vector<string> fields(1);
+  bool in_quotes = false;
+  for (int i = 0; i < line.size(); ++i) {
+	char c = line[i];
+	if (in_quotes) {
+		if (c == '"' && i+1 < line.size() && line[i+1] == '"') fields.back() += line[++i];
+		else if (c == '"') in_quotes = false;
+		else fields.back() += c;
+	}
+	else if (c == '"') in_quotes = true;
+	else if (c == ',') fields.push_back("");
+	else fields.back() += c;
+  }
+  return fields;
+}
@@ -0,0 +1,106 @@
+#pragma once
+// The layout of the input file in one place: every field with its column, type, missing value and default binning.
+// Parser, column storage, accessors, default covariates and the rows of NC_GenerateData follow from it at compile time.
+// A new column takes two lines: its name in NC_Field, which gives the typed accessors their constant, and its entry in
+// kNC_Schema; the static_asserts below catch one without the other. The generator writes it as missing until it draws values
+// Author: Jochen jens Heinrich 2022
+
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+using namespace std;
+
+// Categorical entries are stored as small integer codes, -1 marks a missing value just like in the input file
+typedef int16_t NC_Code;
+
+// All fields of the input file, in the order they appear in each row
+enum NC_Field { kIndex, kBmi, kAge, kCountry, kPregnantBefore, kEducation, kSleepingPattern, kNCyclesTrying, kOutcome,
+	kDedication, kAverageCycleLength, kCycleLengthStd, kRegularCycle, kIntercourseFrequency, kNFields };
+enum NC_FieldType { kIntField, kFloatField, kCategoryField };
+
+// The outcome levels are fixed in the schema, so these codes are too
+enum NC_Outcome { kNotPregnant = 0, kPregnant = 1 };
+
+
+struct NC_FieldInfo {
+  NC_Field field;
+  const char *name;			// Column name in the header of the input file, also used by filters and group keys
+  NC_FieldType type;
+  const char *missing;		// Token of a missing value, every type stores it as -1
+  // Labels with fixed values 0, 1, ... and nullptr at the end: categories start their dictionary with them,
+  // int fields are written as these labels in the input and anything else is missing
+  const char *const *levels;
+  // Default covariate for the factors, none if covariate is null: name in the summary, axis label, part of the file names
+  // and binning, categorical ones get a bin per label found in the data so their binning is left empty
+  const char *covariate;
+  const char *label;
+  const char *par_name;
+  int x_bins;
+  float x_low;
+  float x_high;
+};
+
+constexpr const char *kNC_PregnancyLevels[] = {"No,never", "Yes,once", "Yes,twice", "Yes,3TimesOrMore", nullptr};
+constexpr const char *kNC_OutcomeLevels[] = {"not_pregnant", "pregnant", nullptr};
+
+constexpr NC_FieldInfo kNC_Schema[] = {
+  {kIndex, "index", kIntField, "-1", nullptr, nullptr, nullptr, nullptr, 0, 0.0, 0.0},
+  {kBmi, "bmi", kFloatField, "-1", nullptr, "BMI", "BMI", "bmi", 25, 15.0, 40.0},
+  {kAge, "age", kIntField, "-1", nullptr, "Age", "Age [years]", "age", 23, 21.5, 44.5},
+  {kCountry, "country", kCategoryField, "-1", nullptr, "Country", "Country", "country", 0, 0.0, 0.0},
+  {kPregnantBefore, "been_pregnant_before", kIntField, "-1", kNC_PregnancyLevels, "pregnant_before", "Number of previous pregnancies", "pregnant_before", 4, -0.5, 3.5},
+  {kEducation, "education", kCategoryField, "-1", nullptr, "education", "Education", "education", 0, 0.0, 0.0},
+  {kSleepingPattern, "sleeping_pattern", kCategoryField, "-1", nullptr, "sleeping_pattern", "Sleeping pattern", "sleeping_pattern", 0, 0.0, 0.0},
+  {kNCyclesTrying, "n_cycles_trying", kIntField, "-1", nullptr, nullptr, nullptr, nullptr, 0, 0.0, 0.0},
+  {kOutcome, "outcome", kCategoryField, "-1", kNC_OutcomeLevels, nullptr, nullptr, nullptr, 0, 0.0, 0.0},
+  {kDedication, "dedication", kFloatField, "-1", nullptr, "dedication", "Dedication", "dedication", 30, 0.0, 1.0},
+  {kAverageCycleLength, "average_cycle_length", kFloatField, "-1", nullptr, "average_cycle_length", "Average cycle length [days]", "average_cycle_length", 20, 20.0, 40.0},
+  {kCycleLengthStd, "cycle_length_std", kFloatField, "-1", nullptr, "cycle_length_std", "Variation of cycle length [days]", "cycle_length_std", 20, 0.0, 9.0},
+  {kRegularCycle, "regular_cycle", kCategoryField, "-1", nullptr, "regular_cycle", "Regular Cycle", "regular_cycle", 0, 0.0, 0.0},
+  {kIntercourseFrequency, "intercourse_frequency", kFloatField, "-1", nullptr, "intercourse_frequency", "Intercourse frequency [per day]", "intercourse_frequency", 20, 0.0, 0.8}
+};
+
+
+// The schema has to list every field once, in the order of NC_Field
+constexpr bool NC_SchemaInOrder() {
+  for (int i = 0; i < kNFields; ++i) {
+	if (kNC_Schema[i].field != i) return false;
+  }
+  return true;
+}
+static_assert(sizeof(kNC_Schema) / sizeof(kNC_Schema[0]) == kNFields, "kNC_Schema needs one entry per NC_Field");
+static_assert(NC_SchemaInOrder(), "kNC_Schema has to follow the order of NC_Field");
+
+
+// The C++ type a field is stored as
+template<NC_FieldType type> struct NC_FieldStorage;
+template<> struct NC_FieldStorage<kIntField> { typedef int type; };
+template<> struct NC_FieldStorage<kFloatField> { typedef float type; };
+template<> struct NC_FieldStorage<kCategoryField> { typedef NC_Code type; };
+template<NC_Field field> using NC_FieldValue = typename NC_FieldStorage<kNC_Schema[field].type>::type;
+
+// A field as a type of its own, so the schema entry is a constant wherever it is passed to
+template<NC_Field field> using NC_FieldConstant = integral_constant<NC_Field, field>;
+
+
+template<class F, size_t... I> void NC_ForEachField(F &func, index_sequence<I...>) {
+  (func(NC_FieldConstant<(NC_Field) I>()), ...);
+}
+
+// Calls func(NC_FieldConstant<field>()) for every field in the order of the columns, unrolled at compile time
+template<class F> void NC_ForEachField(F func) {
+  NC_ForEachField(func, make_index_sequence<kNFields>());
+}
+
+// Calls func(NC_FieldConstant<field>()) for a field only known at run time, the body is compiled once per field
+template<class F> void NC_VisitField(NC_Field field, F func) {
+  NC_ForEachField([&](auto constant) { if (constant == field) func(constant); });
+}
+
+
+// Compile-time comparison of two texts, for schema entries
+constexpr bool NC_SameText(const char *a, const char *b) {
+  while (*a && *a == *b) ++a, ++b;
+  return *a == *b;
+}
@@ -0,0 +1,369 @@
+#pragma once
+// Row selections as bitmaps and a small filter language on the columns, e.g. outcome==pregnant && age>=30 && country!=missing
+// Author: Jochen jens Heinrich 2022
+
+#include <iostream>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "NC_User.h"
+#include "NC_Parallel.h"
+#include "NC_Trace.h"
+
+using namespace std;
+
+// One bit per user, set if the user is selected
+class NC_Selection {
+
+public:
+
+  NC_Selection(int n_rows = 0, bool selected = false);
+  ~NC_Selection() {}
+  int size() const { return m_n_rows; }
+  bool selected(int n) const { return m_words[n >> 6] >> (n & 63) & 1; }
+  int count() const;
+  // The selected rows in ascending order, e.g. for NC_Users::selectRows
+  vector<int> rows() const;
+  // Calls func(row) for the selected rows in [begin, end) in ascending order, a word at a time
+  template<class F> void forEach(int begin, int end, F func) const;
+  NC_Selection &operator&=(const NC_Selection &other);
+  uint64_t *words() { return m_words.data(); }
+  const uint64_t *words() const { return m_words.data(); }
+
+  // Validity bitmap of a column, a copy of the one NC_Users keeps (see NC_Users::validBits)
+  static NC_Selection valid(const NC_Users &users, NC_Field field, int n_threads = 0);
+
+private:
+
+  // Bits past the last row are always zero
+  void clearPadding();
+
+  int m_n_rows;
+  vector<uint64_t> m_words;
+
+};
+
+
+// A parsed filter expression. Comparisons are field op value with the column names of the input file, combined with &&, || and !
+// and grouped with parentheses. Categorical fields take == and != with a label, numeric fields all of == != < <= > >= with a number.
+// The value missing stands for the -1 sentinel; every other comparison only selects valid values, so age<30 leaves out users
+// without an age. Labels are looked up when the filter is applied, so one filter works with the dictionaries of any input
+class NC_Filter {
+
+public:
+
+  // An empty expression selects all users, a broken one prints where it fails and is not valid()
+  NC_Filter(string expression = "");
+  ~NC_Filter() {}
+  bool valid() const { return m_valid; }
+  bool empty() const { return m_root < 0; }
+  const string &expression() const { return m_expression; }
+  // Evaluates the expression column by column on blocks of users, in parallel
+  NC_Selection select(const NC_Users &users, int n_threads = 0) const;
+  // Fills target with the selected users of source, in their order
+  void apply(const NC_Users &source, NC_Users &target, int n_threads = 0) const;
+
+private:
+
+  enum Operator { kEqual, kNotEqual, kLess, kLessEqual, kGreater, kGreaterEqual };
+  enum NodeType { kAnd, kOr, kNot, kCompare };
+  struct Node {
+	NodeType type;
+	int left;
+	int right;
+	NC_Field field;
+	Operator op;
+	bool missing;
+	double value;
+	string label;
+  };
+  // Rows per block, a multiple of 64 so blocks never share a word
+  static const int kBlockRows = 1 << 14;
+
+  // Recursive descent, every function returns the index of the node it parsed or -1 on a syntax error
+  int parseOr(size_t &pos);
+  int parseAnd(size_t &pos);
+  int parseNot(size_t &pos);
+  int parseComparison(size_t &pos);
+  void skipSpace(size_t &pos) const;
+  bool accept(size_t &pos, const char *token);
+  int fail(size_t pos, const char *message);
+  // Evaluates node on the rows [begin, begin+n_rows) into words
+  void evaluate(int node, const NC_Users &users, int begin, int n_rows, uint64_t *words) const;
+  template<class T, class C> static void compareBlock(const T *x, int n_rows, C compare, uint64_t *words);
+
+  string m_expression;
+  vector<Node> m_nodes;
+  int m_root = -1;
+  bool m_valid = true;
+
+};
+
+
+NC_Selection::NC_Selection(int n_rows, bool selected) : m_n_rows(n_rows), m_words((n_rows + 63) / 64, selected ? ~0ull : 0ull) {
+  clearPadding();
+}
+
+
+void NC_Selection::clearPadding() {
+  if (m_n_rows % 64) m_words.back() &= (1ull << (m_n_rows % 64)) - 1;
+}
+
+
+int NC_Selection::count() const {
+  long n_selected = 0;
+  for (uint64_t word : m_words) n_selected += __builtin_popcountll(word);
+  return n_selected;
+}
+
+
+vector<int> NC_Selection::rows() const {
+  vector<int> rows;
+  rows.reserve(count());
+  for (int i_word = 0; i_word < m_words.size(); ++i_word) {
+	for (uint64_t word = m_words[i_word]; word; word &= word - 1) rows.push_back(64 * i_word + __builtin_ctzll(word));
+  }
+  return rows;
+}
+
+
+NC_Selection &NC_Selection::operator&=(const NC_Selection &other) {
+  for (int i_word = 0; i_word < m_words.size(); ++i_word) m_words[i_word] &= other.m_words[i_word];
+  return *this;
+}
+
+
+template<class F> void NC_Selection::forEach(int begin, int end, F func) const {
+  for (int i_word = begin / 64; 64 * i_word < end; ++i_word) {
+	uint64_t word = m_words[i_word];
+	// Bits outside [begin, end) are masked off in the first and last word
+	if (64 * i_word < begin) word &= ~0ull << (begin % 64);
+	if (64 * i_word + 64 > end) word &= (1ull << (end % 64)) - 1;
+	for (; word; word &= word - 1) func(64 * i_word + __builtin_ctzll(word));
+  }
+}
+
+
+NC_Selection NC_Selection::valid(const NC_Users &users, NC_Field field, int n_threads) {
+  NC_Selection selection(users.number_of_users());
+  const uint64_t *words = users.validBits(field, n_threads);
+  copy(words, words + selection.m_words.size(), selection.m_words.begin());
+  return selection;
+}
+
+
+NC_Filter::NC_Filter(string expression) : m_expression(expression) {
+  size_t pos = 0;
+  skipSpace(pos);
+  if (pos == m_expression.size()) return;
+  m_root = parseOr(pos);
+  if (m_root >= 0 && pos != m_expression.size()) fail(pos, "expected && or ||");
+  if (!m_valid) m_root = -1;
+}
+
+
+void NC_Filter::skipSpace(size_t &pos) const {
+  while (pos < m_expression.size() && isspace((unsigned char) m_expression[pos])) ++pos;
+}
+
+
+bool NC_Filter::accept(size_t &pos, const char *token) {
+  skipSpace(pos);
+  if (m_expression.compare(pos, strlen(token), token) != 0) return false;
+  pos += strlen(token);
+  return true;
+}
+
+
+int NC_Filter::fail(size_t pos, const char *message) {
+  if (m_valid) printf("...Invalid filter '%s' at position %zu: %s\n", m_expression.c_str(), pos, message);
+  m_valid = false;
+  m_nodes.clear();
+  return -1;
+}
+
+
+int NC_Filter::parseOr(size_t &pos) {
+  int left = parseAnd(pos);
+  while (left >= 0 && accept(pos, "||")) {
+	int right = parseAnd(pos);
+	if (right < 0) return -1;
+	m_nodes.push_back({kOr, left, right, kIndex, kEqual, false, 0.0, ""});
+	left = m_nodes.size() - 1;
+  }
+  return left;
+}
+
+
+int NC_Filter::parseAnd(size_t &pos) {
+  int left = parseNot(pos);
+  while (left >= 0 && accept(pos, "&&")) {
+	int right = parseNot(pos);
+	if (right < 0) return -1;
+	m_nodes.push_back({kAnd, left, right, kIndex, kEqual, false, 0.0, ""});
+	left = m_nodes.size() - 1;
+  }
+  return left;
+}
+
+
+int NC_Filter::parseNot(size_t &pos) {
+  // != is a comparison, so a ! here is always a negation
+  if (accept(pos, "!")) {
+	int operand = parseNot(pos);
+	if (operand < 0) return -1;
+	m_nodes.push_back({kNot, operand, -1, kIndex, kEqual, false, 0.0, ""});
+	return m_nodes.size() - 1;
+  }
+  if (accept(pos, "(")) {
+	int inner = parseOr(pos);
+	if (inner < 0) return -1;
+	if (!accept(pos, ")")) return fail(pos, "expected )");
+	return inner;
+  }
+  return parseComparison(pos);
+}
+
+
+int NC_Filter::parseComparison(size_t &pos) {
+
+  // Names and values end at the next space, bracket, operator or logical connective
+  auto word = [&]() {
+	skipSpace(pos);
+	size_t begin = pos;
+	while (pos < m_expression.size() && !isspace((unsigned char) m_expression[pos]) && !strchr("()!=<>&|", m_expression[pos])) ++pos;
+	return m_expression.substr(begin, pos - begin);
+  };
+
+  size_t name_pos = pos;
+  string name = word();
+  int field = 0;
+  while (field < kNFields && name != NC_Users::fieldName((NC_Field) field)) ++field;
+  if (name.empty()) return fail(name_pos, "expected a column name");
+  if (field == kNFields) return fail(name_pos, "unknown column");
+
+  Node node = {kCompare, -1, -1, (NC_Field) field, kEqual, false, 0.0, ""};
+  static const char *operators[] = {"==", "!=", "<=", ">=", "<", ">"};
+  static const Operator codes[] = {kEqual, kNotEqual, kLessEqual, kGreaterEqual, kLess, kGreater};
+  int i_op = 0;
+  while (i_op < 6 && !accept(pos, operators[i_op])) ++i_op;
+  if (i_op == 6) return fail(pos, "expected one of == != < <= > >=");
+  node.op = codes[i_op];
+
+  size_t value_pos = pos;
+  string value = word();
+  if (value.empty()) return fail(value_pos, "expected a value");
+  node.missing = value == "missing" || value == "-1";
+  if (NC_Users::fieldType(node.field) == kCategoryField || node.missing) {
+	if (node.op != kEqual && node.op != kNotEqual) return fail(value_pos, "labels and missing only take == and !=");
+	node.label = value;
+  }
+  else {
+	char *end;
+	node.value = strtod(value.c_str(), &end);
+	if (*end != '\0') return fail(value_pos, "expected a number");
+  }
+
+  m_nodes.push_back(node);
+  return m_nodes.size() - 1;
+}
+
+
+// Branch-free comparison of 64 values at a time, the compiler turns the inner loop into vector compares
+template<class T, class C> void NC_Filter::compareBlock(const T *x, int n_rows, C compare, uint64_t *words) {
+  for (int i_word = 0; 64 * i_word < n_rows; ++i_word) {
+	const T *values = x + 64 * i_word;
+	int n_values = min(64, n_rows - 64 * i_word);
+	uint64_t word = 0;
+	for (int i = 0; i < n_values; ++i) word |= (uint64_t) compare(values[i]) << i;
+	words[i_word] = word;
+  }
+}
+
+
+void NC_Filter::evaluate(int i_node, const NC_Users &users, int begin, int n_rows, uint64_t *words) const {
+
+  const Node &node = m_nodes[i_node];
+  int n_words = (n_rows + 63) / 64;
+
+  if (node.type == kAnd || node.type == kOr) {
+	vector<uint64_t> right(n_words);
+	evaluate(node.left, users, begin, n_rows, words);
+	evaluate(node.right, users, begin, n_rows, right.data());
+	if (node.type == kAnd) for (int i_word = 0; i_word < n_words; ++i_word) words[i_word] &= right[i_word];
+	else for (int i_word = 0; i_word < n_words; ++i_word) words[i_word] |= right[i_word];
+	return;
+  }
+  if (node.type == kNot) {
+	evaluate(node.left, users, begin, n_rows, words);
+	for (int i_word = 0; i_word < n_words; ++i_word) words[i_word] = ~words[i_word];
+	if (n_rows % 64) words[n_words-1] &= (1ull << (n_rows % 64)) - 1;
+	return;
+  }
+
+  bool equal = node.op == kEqual;
+  NC_FieldType type = NC_Users::fieldType(node.field);
+  if (type == kCategoryField) {
+	const NC_Code *x = users.codeColumn(node.field) + begin;
+	// A label this input has never seen matches no user, but -2 never matches a code either
+	NC_Code code = node.missing ? -1 : users.dictionary(node.field)->find(node.label);
+	if (code < 0 && !node.missing) code = -2;
+	if (equal) compareBlock(x, n_rows, [code](NC_Code value) { return value == code; }, words);
+	else compareBlock(x, n_rows, [code](NC_Code value) { return value != code && value >= 0; }, words);
+	return;
+  }
+
+  // Numeric columns, missing values are -1 or below
+  auto compare_numbers = [&](const auto *x) {
+	typedef typename remove_const<typename remove_pointer<decltype(x)>::type>::type T;
+	double value = node.value;
+	if (node.missing) {
+		if (equal) compareBlock(x, n_rows, [](T v) { return !(v > -1); }, words);
+		else compareBlock(x, n_rows, [](T v) { return v > -1; }, words);
+		return;
+	}
+	switch (node.op) {
+		case kEqual: compareBlock(x, n_rows, [value](T v) { return v > -1 && v == value; }, words); break;
+		case kNotEqual: compareBlock(x, n_rows, [value](T v) { return v > -1 && v != value; }, words); break;
+		case kLess: compareBlock(x, n_rows, [value](T v) { return v > -1 && v < value; }, words); break;
+		case kLessEqual: compareBlock(x, n_rows, [value](T v) { return v > -1 && v <= value; }, words); break;
+		case kGreater: compareBlock(x, n_rows, [value](T v) { return v > -1 && v > value; }, words); break;
+		case kGreaterEqual: compareBlock(x, n_rows, [value](T v) { return v > -1 && v >= value; }, words); break;
+	}
+  };
+  if (type == kFloatField) compare_numbers(users.floatColumn(node.field) + begin);
+  else compare_numbers(users.intColumn(node.field) + begin);
+
+  return;
+}
+
+
+NC_Selection NC_Filter::select(const NC_Users &users, int n_threads) const {
+
+  NC_TraceScope trace_scope("filterSelect");
+
+  int n_users = users.number_of_users();
+  if (m_root < 0) return NC_Selection(n_users, m_valid);
+
+  // Each block only touches the columns in the expression and its own part of the bitmap
+  NC_Selection selection(n_users);
+  int block_rows = kBlockRows;
+  NC_Parallel::forEach((n_users + block_rows - 1) / block_rows, n_threads, [&](int block, int) {
+	int begin = block * block_rows;
+	evaluate(m_root, users, begin, min(block_rows, n_users - begin), selection.words() + begin / 64);
+  });
+  NC_Trace::count("rows filtered", n_users);
+
+  return selection;
+}
+
+
+void NC_Filter::apply(const NC_Users &source, NC_Users &target, int n_threads) const {
+  vector<int> rows = select(source, n_threads).rows();
+  target.selectRows(source, rows.data(), rows.size(), n_threads);
+  printf("Filter '%s' selected %zu of %d users\n", m_expression.c_str(), rows.size(), source.number_of_users());
+}
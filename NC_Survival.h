@@ -0,0 +1,146 @@
+#pragma once
+// Kaplan-Meier estimate of the probability to be pregnant after a number of cycles, women who did not get pregnant are censored
+// Author: Jochen jens Heinrich 2022
+
+#include <cmath>
+#include <vector>
+#include "NC_User.h"
+#include "NC_Analysis.h"
+
+using namespace std;
+
+// Survival curve per cycle, index 0 is cycle 1
+struct NC_SurvivalCurve {
+  vector<long> at_risk;		// Women still trying at the start of the cycle
+  vector<long> events;		// Pregnancies in the cycle
+  vector<double> survival;	// Probability to still be trying after the cycle
+  vector<double> variance;	// Greenwood variance of the survival
+};
+
+
+// One pass fills the histograms of the cycle each woman stopped trying and of the pregnancies, the range grows with the data
+// up to kNC_MaxCycles
+class NC_Survival : public NC_Accumulator {
+
+public:
+
+  NC_Survival() {}
+  ~NC_Survival() {}
+  void process(const NC_Users &users, int begin, int end);
+  NC_Accumulator *clone() const { return new NC_Survival(); }
+  void merge(const NC_Accumulator &other);
+  bool save(FILE *file) const { return writeVector(file, m_exits) && writeVector(file, m_events); }
+  bool load(FILE *file);
+  // Largest number of cycles seen in the data
+  int maxCycle() const { return (int) m_exits.size() - 1; }
+  // At-risk counts come from suffix sums of the exits, so this is O(cycles)
+  NC_SurvivalCurve curve() const;
+  // Cummulative pregnancy probability 1 - S and its uncertainty in percent for cycles 1 to n_cycles, beyond the data the curve stays flat
+  void getProbability(int n_cycles, vector<float> &probability, vector<float> &uncertainty) const;
+
+private:
+
+  // Indexed by cycle, index 0 stays empty
+  vector<long> m_exits;
+  vector<long> m_events;
+
+};
+
+
+void NC_Survival::process(const NC_Users &users, int begin, int end) {
+
+  const int *n_cycles_trying = users.column<kNCyclesTrying>();
+  const NC_Code *outcome = users.column<kOutcome>();
+
+  for (int i = begin; i < end; ++i) {
+
+	// Only consider women who are actively trying,i.e. intercourse_frequency > 0
+	// FIXME Assume a lot of women do not log intercourse
+	//if (users.value<kIntercourseFrequency>(i) == 0) continue;
+
+	int cycle = n_cycles_trying[i];
+	if (cycle < 1) continue;
+	// Women still trying at the horizon are censored there, whether they got pregnant later or not
+	bool beyond = cycle > kNC_MaxCycles;
+	if (beyond) cycle = kNC_MaxCycles;
+	if (cycle >= m_exits.size()) {
+		m_exits.resize(cycle+1, 0);
+		m_events.resize(cycle+1, 0);
+	}
+	++m_exits[cycle];
+	// Everybody else is censored after her last cycle
+	if (outcome[i] == kPregnant && !beyond) ++m_events[cycle];
+  }
+
+  return;
+}
+
+
+// A state from a file is trusted no further than the horizon
+bool NC_Survival::load(FILE *file) {
+  return readVector(file, m_exits) && readVector(file, m_events) && m_exits.size() == m_events.size() && m_exits.size() <= kNC_MaxCycles + 1;
+}
+
+
+void NC_Survival::merge(const NC_Accumulator &other) {
+  const NC_Survival &survival = dynamic_cast<const NC_Survival&>(other);
+  if (survival.m_exits.size() > m_exits.size()) {
+	m_exits.resize(survival.m_exits.size(), 0);
+	m_events.resize(survival.m_events.size(), 0);
+  }
+  for (int cycle = 0; cycle < survival.m_exits.size(); ++cycle) {
+	m_exits[cycle] += survival.m_exits[cycle];
+	m_events[cycle] += survival.m_events[cycle];
+  }
+}
+
+
+NC_SurvivalCurve NC_Survival::curve() const {
+
+  int n_cycles = max(maxCycle(), 0);
+  NC_SurvivalCurve curve;
+  curve.at_risk.resize(n_cycles);
+  curve.events.resize(n_cycles);
+  curve.survival.resize(n_cycles);
+  curve.variance.resize(n_cycles);
+
+  // Everybody who stopped in this cycle or later is at risk
+  long at_risk = 0;
+  for (int cycle = n_cycles; cycle >= 1; --cycle) {
+	at_risk += m_exits[cycle];
+	curve.at_risk[cycle-1] = at_risk;
+	curve.events[cycle-1] = m_events[cycle];
+  }
+
+  double survival = 1.0, greenwood_sum = 0.0;
+  for (int j = 0; j < n_cycles; ++j) {
+	long n = curve.at_risk[j], d = curve.events[j];
+	if (n > 0) survival *= 1.0 - (double) d / n;
+	// The Greenwood term is undefined once everybody at risk got pregnant, the survival is zero from there on anyway
+	if (n > d) greenwood_sum += (double) d / ((double) n * (n - d));
+	curve.survival[j] = survival;
+	curve.variance[j] = survival * survival * greenwood_sum;
+  }
+
+  return curve;
+}
+
+
+void NC_Survival::getProbability(int n_cycles, vector<float> &probability, vector<float> &uncertainty) const {
+
+  NC_SurvivalCurve survival = curve();
+  probability.resize(n_cycles);
+  uncertainty.resize(n_cycles);
+
+  double last_survival = 1.0, last_variance = 0.0;
+  for (int j = 0; j < n_cycles; ++j) {
+	if (j < survival.survival.size()) {
+		last_survival = survival.survival[j];
+		last_variance = survival.variance[j];
+	}
+	probability[j] = (1.0 - last_survival) * 100.0;
+	uncertainty[j] = sqrt(last_variance) * 100.0;
+  }
+
+  return;
+}
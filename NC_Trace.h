@@ -0,0 +1,222 @@
+#pragma once
+// Instrumentation of the hot paths: scoped timers and counters, a summary table at the end and an optional Chrome trace
+// Author: Jochen jens Heinrich 2022
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Switched off a probe costs a single relaxed atomic load, so all probes stay compiled in.
+// Probes sit around stages, chunks and tasks, never around single rows, so the recording itself can take a lock.
+// Span times are summed per stage name; for stages that run on several threads at once the sum is thread time, not wall time
+class NC_Trace {
+
+public:
+
+  // kSummary keeps totals per stage and counter, kSpans keeps in addition every span and counter update for writeChromeTrace
+  enum Level { kOff = 0, kSummary = 1, kSpans = 2 };
+
+  // Drops everything recorded so far and starts recording at the given level
+  static void start(Level level);
+  // Level from the environment variable NC_TRACE: unset or 0 is off, 'summary' or 1 the summary only,
+  // any other value is the name of the Chrome trace file written by finish()
+  static void startFromEnvironment();
+  // Prints the summary table, writes the trace file if one was requested, and stops recording
+  static void finish();
+  static bool enabled() { return level().load(memory_order_relaxed) != kOff; }
+  // Stops recording without the lock or any output, for a forked child whose copy of the lock may be held by a thread that is gone
+  static void detach() { level().store(kOff, memory_order_relaxed); }
+
+  // Adds value to a counter, e.g. rows parsed or fit iterations
+  static void count(const char *name, long value) { if (enabled()) addCount(name, value); }
+  static void printSummary();
+  // Chrome trace event format, opens in chrome://tracing and ui.perfetto.dev with one track per thread
+  static bool writeChromeTrace(string file_name);
+
+private:
+
+  friend class NC_TraceScope;
+  typedef chrono::steady_clock Clock;
+
+  struct Stage { long calls = 0; double seconds = 0.0; double max_seconds = 0.0; };
+  struct Event { const char *name; int thread; long begin_us; long duration_us; long value; bool counter; };
+  struct State {
+	mutex lock;
+	Clock::time_point origin;
+	map<string,Stage> stages;
+	vector<string> stage_order;
+	map<string,long> counters;
+	vector<string> counter_order;
+	vector<Event> events;
+	string trace_file;
+  };
+
+  static atomic<int> &level() { static atomic<int> value(kOff); return value; }
+  static State &state() { static State value; return value; }
+  // Small thread numbers, one trace track each
+  static int threadNumber();
+  static void addSpan(const char *name, Clock::time_point begin, Clock::time_point end);
+  static void addCount(const char *name, long value);
+
+};
+
+
+// Times its own lifetime as a span of the stage name, which has to be a string literal
+class NC_TraceScope {
+
+public:
+
+  NC_TraceScope(const char *name) : m_name(NC_Trace::enabled() ? name : nullptr) { if (m_name) m_begin = NC_Trace::Clock::now(); }
+  ~NC_TraceScope() { if (m_name) NC_Trace::addSpan(m_name, m_begin, NC_Trace::Clock::now()); }
+
+private:
+
+  const char *m_name;
+  NC_Trace::Clock::time_point m_begin;
+
+};
+
+
+void NC_Trace::start(Level level_value) {
+  State &trace = state();
+  lock_guard<mutex> guard(trace.lock);
+  trace.origin = Clock::now();
+  trace.stages.clear();
+  trace.stage_order.clear();
+  trace.counters.clear();
+  trace.counter_order.clear();
+  trace.events.clear();
+  trace.trace_file.clear();
+  level().store(level_value, memory_order_relaxed);
+  // The calling thread is the first track
+  threadNumber();
+}
+
+
+void NC_Trace::startFromEnvironment() {
+  const char *value = getenv("NC_TRACE");
+  string setting = value ? value : "";
+  if (setting.empty() || setting == "0") return;
+  if (setting == "1" || setting == "summary") {
+	start(kSummary);
+	return;
+  }
+  start(kSpans);
+  state().trace_file = setting;
+}
+
+
+void NC_Trace::finish() {
+  if (!enabled()) return;
+  printSummary();
+  if (!state().trace_file.empty()) writeChromeTrace(state().trace_file);
+  level().store(kOff, memory_order_relaxed);
+}
+
+
+int NC_Trace::threadNumber() {
+  // A number is given back when its thread ends, so the short-lived workers of successive parallel loops share the same tracks
+  struct Slot {
+	static vector<bool> &used() { static vector<bool> value; return value; }
+	static mutex &lock() { static mutex value; return value; }
+	int number = 0;
+	Slot() {
+		lock_guard<mutex> guard(lock());
+		while (number < used().size() && used()[number]) ++number;
+		if (number == used().size()) used().push_back(true);
+		else used()[number] = true;
+	}
+	~Slot() {
+		lock_guard<mutex> guard(lock());
+		used()[number] = false;
+	}
+  };
+  thread_local Slot slot;
+  return slot.number;
+}
+
+
+void NC_Trace::addSpan(const char *name, Clock::time_point begin, Clock::time_point end) {
+  State &trace = state();
+  int thread = threadNumber();
+  double seconds = chrono::duration<double>(end - begin).count();
+  lock_guard<mutex> guard(trace.lock);
+  auto inserted = trace.stages.emplace(name, Stage());
+  if (inserted.second) trace.stage_order.push_back(name);
+  Stage &stage = inserted.first->second;
+  ++stage.calls;
+  stage.seconds += seconds;
+  stage.max_seconds = max(stage.max_seconds, seconds);
+  if (level().load(memory_order_relaxed) == kSpans) {
+	long begin_us = chrono::duration_cast<chrono::microseconds>(begin - trace.origin).count();
+	long duration_us = chrono::duration_cast<chrono::microseconds>(end - begin).count();
+	trace.events.push_back({name, thread, begin_us, duration_us, 0, false});
+  }
+}
+
+
+void NC_Trace::addCount(const char *name, long value) {
+  State &trace = state();
+  int thread = threadNumber();
+  Clock::time_point now = Clock::now();
+  lock_guard<mutex> guard(trace.lock);
+  auto inserted = trace.counters.emplace(name, 0);
+  if (inserted.second) trace.counter_order.push_back(name);
+  inserted.first->second += value;
+  // Counter events carry the running total, so the trace shows them as a growing curve
+  if (level().load(memory_order_relaxed) == kSpans) {
+	long time_us = chrono::duration_cast<chrono::microseconds>(now - trace.origin).count();
+	trace.events.push_back({name, thread, time_us, 0, inserted.first->second, true});
+  }
+}
+
+
+void NC_Trace::printSummary() {
+  State &trace = state();
+  lock_guard<mutex> guard(trace.lock);
+  double elapsed = chrono::duration<double>(Clock::now() - trace.origin).count();
+  printf("\nTrace summary after %.3f s\n", elapsed);
+  printf("  %-32s %10s %14s %14s %14s\n", "stage", "calls", "total [s]", "mean [ms]", "max [ms]");
+  for (const string &name : trace.stage_order) {
+	const Stage &stage = trace.stages[name];
+	printf("  %-32s %10ld %14.4f %14.3f %14.3f\n", name.c_str(), stage.calls, stage.seconds, 1e3 * stage.seconds / stage.calls, 1e3 * stage.max_seconds);
+  }
+  if (!trace.counter_order.empty()) printf("  %-32s %10s\n", "counter", "value");
+  for (const string &name : trace.counter_order) printf("  %-32s %10ld\n", name.c_str(), trace.counters[name]);
+  printf("\n");
+}
+
+
+bool NC_Trace::writeChromeTrace(string file_name) {
+  FILE *file = fopen(file_name.c_str(), "w");
+  if (!file) {
+	printf("...Could not write trace file '%s'\n", file_name.c_str());
+	return false;
+  }
+
+  State &trace = state();
+  lock_guard<mutex> guard(trace.lock);
+  int n_threads = 0;
+  for (const Event &event : trace.events) n_threads = max(n_threads, event.thread+1);
+  fprintf(file, "{\"traceEvents\":[\n");
+  fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"NC_DataChallenge\"}}");
+  for (int thread = 0; thread < n_threads; ++thread)
+	fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", thread, thread);
+  for (const Event &event : trace.events) {
+	if (event.counter) fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%ld,\"args\":{\"value\":%ld}}",
+		event.name, event.thread, event.begin_us, event.value);
+	else fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%ld,\"dur\":%ld}", event.name, event.thread, event.begin_us, event.duration_us);
+  }
+  fprintf(file, "\n]}\n");
+  fclose(file);
+  printf("Wrote %zu trace events to %s\n", trace.events.size(), file_name.c_str());
+
+  return true;
+}
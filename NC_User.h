@@ -4,104 +4,1081 @@
 
 #include <iostream>
 #include <fstream>
+#include <string>
+#include <vector>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <mutex>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "NC_Parallel.h"
+#include "NC_Schema.h"
+#include "NC_Trace.h"
 
 using namespace std;
 
+
+// A column of fixed-width values, either owned or a read-only view into a memory-mapped snapshot
+template<class T> class NC_Column {
+
+public:
+
+  NC_Column() {}
+  ~NC_Column() {}
+  const T &operator[](size_t n) const { return m_data[n]; }
+  T &operator[](size_t n) { return m_owned[n]; }
+  const T *data() const { return m_data; }
+  size_t size() const { return m_size; }
+  void resize(size_t n) { m_owned.resize(n); m_data = m_owned.data(); m_size = n; }
+  void shrink_to_fit() { m_owned.shrink_to_fit(); m_data = m_owned.data(); }
+  void view(const T *data, size_t n) { m_owned = vector<T>(); m_data = data; m_size = n; }
+
+private:
+
+  vector<T> m_owned;
+  const T *m_data = nullptr;
+  size_t m_size = 0;
+
+};
+
+
+// Translates between the labels of a categorical column and their dense integer codes
+class NC_Dictionary {
+
+public:
+
+  NC_Dictionary(string missing = "-1") : m_missing(missing) {}
+  ~NC_Dictionary() {}
+  // Codes are int16, so this many labels fit, codes past it would wrap into the negative missing code
+  static constexpr int kMaxLabels = INT16_MAX + 1;
+
+  // Forgets all labels, the missing one stays
+  void clear() { m_labels.clear(); m_codes.clear(); }
+  NC_Code encode(string_view label);
+  NC_Code find(string_view label) const;
+  const string &label(NC_Code code) const { return code < 0 ? m_missing : m_labels[code]; }
+  int size() const { return m_labels.size(); }
+  const vector<string> &labels() const { return m_labels; }
+
+private:
+
+  vector<string> m_labels;
+  // Code of every label, encode runs once per row and column
+  unordered_map<string,NC_Code> m_codes;
+  string m_missing;
+
+};
+
+
+// How far a growing input file has been read, so the next read can start where the last one stopped
+struct NC_ReadPosition {
+  uint64_t offset = 0;		// Bytes consumed, always the end of a complete line
+  uint64_t n_lines = 0;		// Lines consumed, including the header
+  uint64_t tail_hash = 0;	// Hash of the last bytes before offset, to notice if the file was replaced instead of appended to
+};
+
+
 class NC_Users {
 
 public:
 
-  NC_Users() {}
-  ~NC_Users() {}
-  void readData(string file_name);
-  int fillPregnantBefore(string label);
-  int number_of_users() { return m_users.size(); }
-  // Access handles
-  int index(int n) { return m_users[n].index; }
-  int age(int n) { return m_users[n].age; }
-  int pregnant_before(int n) { return m_users[n].pregnant_before; }
-  int n_cycles_trying(int n) { return m_users[n].n_cycles_trying; }
-  float bmi(int n) { return m_users[n].bmi; }
-  float dedication(int n) { return m_users[n].dedication; }
-  float average_cycle_length(int n) { return m_users[n].average_cycle_length; }
-  float cycle_length_std(int n) { return m_users[n].cycle_length_std; }
-  float intercourse_frequency(int n) { return m_users[n].intercourse_frequency; }
-  string country(int n) { return m_users[n].country; }
-  string education(int n) { return m_users[n].education; }
-  string sleeping_pattern(int n) { return m_users[n].sleeping_pattern; }
-  string regular_cycle(int n) { return m_users[n].regular_cycle; }
-  string outcome(int n) { return m_users[n].outcome; }
+  NC_Users();
+  ~NC_Users();
+  NC_Users(const NC_Users&) = delete;
+  NC_Users &operator=(const NC_Users&) = delete;
+  void readData(string file_name, int n_threads = 0, bool use_snapshot = true);
+  template<class F> void streamData(string file_name, F process_batch, size_t batch_size = 64 << 20, int n_threads = 0);
+  // Replaces the content with the complete rows after position only and moves position past them, a line still being written
+  // is left for the next call. The dictionaries are kept, so codes continue those of earlier reads; at offset 0 they start empty
+  void readAppended(string file_name, NC_ReadPosition &position, int n_threads = 0);
+  // True if the file still holds what was read up to position, i.e. it has only been appended to since
+  static bool extends(string file_name, const NC_ReadPosition &position);
+  // Dictionaries in binary form, for checkpoints of incremental reads
+  bool writeDictionaries(FILE *file) const;
+  bool readDictionaries(FILE *file);
+  // Adds the labels of other that are new to the dictionary of field, returns the code here for every code of other
+  vector<NC_Code> mergeDictionary(NC_Field field, const NC_Dictionary &other);
+  // Drops all rows but keeps the dictionaries
+  void clearRows();
+  // Replaces the content with the given rows of source, in the given order, the dictionaries are copied so codes stay the same
+  void selectRows(const NC_Users &source, const int *rows, int n_rows, int n_threads = 0);
+  int number_of_users() const { return get<kIndex>(m_columns).size(); }
+  int number_of_malformed_rows() const { return m_n_malformed; }
+  // Access handles, typed by the schema and resolved at compile time, e.g. value<kAge>(n) is an int and column<kBmi>() floats
+  template<NC_Field field> NC_FieldValue<field> value(int n) const { return get<field>(m_columns)[n]; }
+  template<NC_Field field> const NC_FieldValue<field> *column() const { return get<field>(m_columns).data(); }
+  // Label of a categorical entry, the code is value<field>(n)
+  template<NC_Field field> const string &label(int n) const { return m_dictionaries[field].label(value<field>(n)); }
+  bool pregnant(int n) const { return value<kOutcome>(n) == kPregnant; }
+  static constexpr NC_FieldType fieldType(NC_Field field) { return kNC_Schema[field].type; }
+  // Column name as in the header of the input file
+  static constexpr const char *fieldName(NC_Field field) { return field >= 0 && field < kNFields ? kNC_Schema[field].name : ""; }
+  // Raw column handles for fields only known at run time, so loops can scan just the columns they need;
+  // a null pointer means the field has a different type
+  const int *intColumn(NC_Field field) const;
+  const float *floatColumn(NC_Field field) const;
+  const NC_Code *codeColumn(NC_Field field) const;
+  const NC_Dictionary *dictionary(NC_Field field) const;
+  // Validity bitmap of a column, bit n is set if user n has a value there and not the -1 sentinel, bits past the last user are zero.
+  // Built on first use and kept until the rows change
+  const uint64_t *validBits(NC_Field field, int n_threads = 0) const;
 
 private:
 
-  struct User {
-	int index;
-	int age;
-	int pregnant_before;
-	int n_cycles_trying;
-	float bmi;
-	float dedication;
-	float average_cycle_length;
-	float cycle_length_std;
-	float intercourse_frequency;
-	string country;
-	string education;
-	string sleeping_pattern;
-	string regular_cycle;
-	string outcome;
+  // One contiguous column per field, so loops only touch the data they actually use; the types come from the schema
+  template<size_t... I> static tuple<NC_Column<NC_FieldValue<(NC_Field) I>>...> columnTuple(index_sequence<I...>);
+  typedef decltype(columnTuple(make_index_sequence<kNFields>())) Columns;
+  Columns m_columns;
+  // Only the categorical fields use theirs
+  NC_Dictionary m_dictionaries[kNFields];
+
+  int m_n_malformed = 0;
+
+  // Validity bitmaps, one word per 64 users
+  mutable vector<uint64_t> m_valid[kNFields];
+  mutable bool m_valid_built[kNFields] = {};
+  mutable mutex m_valid_lock;
+  void dropValidity();
+
+  // Mapping of the binary snapshot the columns currently point into, if any
+  void *m_snapshot = nullptr;
+  size_t m_snapshot_size = 0;
+
+  // Layout of the binary snapshot header, bump the version whenever the layout or the schema changes
+  static const uint32_t kSnapshotVersion = 2;
+  static const int kNColumns = kNFields;
+  struct SnapshotHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t n_columns;
+	uint64_t n_rows;
+	uint64_t n_malformed;
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint64_t source_hash;
+	uint64_t column_offset[kNColumns];
+	uint64_t dictionary_offset;
+	uint64_t file_size;
   };
 
-  vector<User> m_users;
+  // Everything a single parsing thread produces for its part of the input file
+  struct Chunk {
+	const char *begin;
+	const char *end;
+	size_t first_row;
+	size_t n_lines;
+	size_t n_rows;
+	NC_Dictionary dictionaries[kNFields];
+	vector<pair<size_t,string>> errors;
+  };
+
+  template<class F> void forEachColumn(F func);
+  template<class F> void forEachColumn(F func) const { const_cast<NC_Users*>(this)->forEachColumn([&](const auto &column) { func(column); }); }
+  template<class F> void forEachDictionary(F func);
+  template<class F> void forEachDictionary(F func) const { const_cast<NC_Users*>(this)->forEachDictionary([&](const NC_Dictionary &dict) { func(dict); }); }
+  size_t parseData(const char *data, size_t size, int n_threads, size_t first_line);
+  bool loadSnapshot(string snapshot_name, const struct stat &source_stat, const char *source, int n_threads);
+  void writeSnapshot(string snapshot_name, const struct stat &source_stat, uint64_t source_hash);
+  void releaseSnapshot();
+  void resetDictionaries() { resetDictionaries(m_dictionaries); }
+  static void resetDictionaries(NC_Dictionary *dictionaries);
+  static uint64_t hashData(const char *data, size_t size, int n_threads);
+  static uint64_t hashTail(int fd, uint64_t offset);
+  static const int kTailSize = 4096;
+  void parseChunk(Chunk &chunk);
+  bool parseRow(const char *&pos, const char *end, size_t row, Chunk &chunk, string &error);
+  void mergeChunk(const Chunk &chunk, size_t row);
+  static bool parseInt(string_view token, int &value);
+  static bool parseFloat(string_view token, float &value);
+  template<NC_Field field> static bool parseNumber(string_view token, NC_FieldValue<field> &value);
+  static int levelValue(const char *const *levels, string_view label);
 
 };
 
 
-void NC_Users::readData(string file_name) {
+// Function to look up the code of a label and add it to the dictionary if it is new
+NC_Code NC_Dictionary::encode(string_view label) {
+  NC_Code code = find(label);
+  if (code > -1 || label == m_missing) return code;
+  if (m_labels.size() >= kMaxLabels) {
+	printf("...Too many distinct labels in a categorical column, at most %d are supported\n", kMaxLabels);
+	exit (EXIT_FAILURE);
+  }
+  code = m_labels.size();
+  m_labels.push_back(string(label));
+  m_codes.emplace(m_labels.back(), code);
+  return code;
+}
+
+
+// Function to look up the code of a label, returns -1 for missing or unknown labels
+NC_Code NC_Dictionary::find(string_view label) const {
+  auto entry = m_codes.find(string(label));
+  return entry == m_codes.end() ? -1 : entry->second;
+}
+
+
+NC_Users::NC_Users() {
+  resetDictionaries();
+}
+
+
+NC_Users::~NC_Users() {
+  releaseSnapshot();
+}
+
+
+const int *NC_Users::intColumn(NC_Field field) const {
+  const int *data = nullptr;
+  NC_VisitField(field, [&](auto constant) { if constexpr (kNC_Schema[constant].type == kIntField) data = column<constant>(); });
+  return data;
+}
+
+
+const float *NC_Users::floatColumn(NC_Field field) const {
+  const float *data = nullptr;
+  NC_VisitField(field, [&](auto constant) { if constexpr (kNC_Schema[constant].type == kFloatField) data = column<constant>(); });
+  return data;
+}
+
+
+const NC_Code *NC_Users::codeColumn(NC_Field field) const {
+  const NC_Code *data = nullptr;
+  NC_VisitField(field, [&](auto constant) { if constexpr (kNC_Schema[constant].type == kCategoryField) data = column<constant>(); });
+  return data;
+}
+
+
+const NC_Dictionary *NC_Users::dictionary(NC_Field field) const {
+  return field >= 0 && field < kNFields && fieldType(field) == kCategoryField ? &m_dictionaries[field] : nullptr;
+}
+
+
+const uint64_t *NC_Users::validBits(NC_Field field, int n_threads) const {
+
+  lock_guard<mutex> guard(m_valid_lock);
+  vector<uint64_t> &words = m_valid[field];
+  if (m_valid_built[field]) return words.data();
+
+  NC_TraceScope trace_scope("validBits");
+  int n_rows = number_of_users();
+  words.assign((n_rows + 63) / 64, 0);
+  const int kWordsPerTask = 1 << 12;
+  NC_VisitField(field, [&](auto constant) {
+	const auto *x = column<constant>();
+	NC_Parallel::forEach((words.size() + kWordsPerTask - 1) / kWordsPerTask, n_threads, [&](int task, int) {
+		int end = min((int) words.size(), (task+1) * kWordsPerTask);
+		for (int i_word = task * kWordsPerTask; i_word < end; ++i_word) {
+			const auto *values = x + 64 * i_word;
+			int n_values = min(64, n_rows - 64 * i_word);
+			uint64_t word = 0;
+			for (int i = 0; i < n_values; ++i) word |= (uint64_t) (values[i] > -1) << i;
+			words[i_word] = word;
+		}
+	});
+  });
+  m_valid_built[field] = true;
+
+  return words.data();
+}
+
+
+// Called whenever the rows change, the bitmaps are built again when they are needed
+void NC_Users::dropValidity() {
+  lock_guard<mutex> guard(m_valid_lock);
+  for (int field = 0; field < kNFields; ++field) {
+	m_valid[field] = vector<uint64_t>();
+	m_valid_built[field] = false;
+  }
+}
+
+
+// Calls func on every column, in the order of the input file; handy for operations that treat all columns alike
+template<class F> void NC_Users::forEachColumn(F func) {
+  NC_ForEachField([&](auto constant) { func(get<constant>(m_columns)); });
+}
+
+
+// Calls func on the dictionary of every categorical field, in the order of the input file
+template<class F> void NC_Users::forEachDictionary(F func) {
+  NC_ForEachField([&](auto constant) { if constexpr (kNC_Schema[constant].type == kCategoryField) func(m_dictionaries[constant]); });
+}
+
+
+void NC_Users::readData(string file_name, int n_threads, bool use_snapshot) {
 
   printf("Reading input data from file '%s'\n", file_name.c_str());
-  ifstream file(file_name.c_str());
-  int n_data_read = 0;
+  NC_TraceScope trace_scope("readData");
+  releaseSnapshot();
+  resetDictionaries();
+  n_threads = NC_Parallel::nThreads(n_threads);
+
+  // Map the whole input file into memory, the kernel takes care of paging it in
+  int fd = open(file_name.c_str(), O_RDONLY);
+  struct stat file_stat;
+  if (fd < 0 || fstat(fd, &file_stat) != 0) {
+	printf("...Could not open input data file '%s'\n", file_name.c_str());
+	exit (EXIT_FAILURE);
+  }
+  size_t file_size = file_stat.st_size;
+  NC_Trace::count("bytes read", file_size);
+  const char *data = nullptr;
+  if (file_size > 0) {
+	void *mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mapping == MAP_FAILED) {
+		printf("...Could not map input data file '%s'\n", file_name.c_str());
+		exit (EXIT_FAILURE);
+	}
+	madvise(mapping, file_size, MADV_SEQUENTIAL);
+	data = (const char*) mapping;
+  }
+  close(fd);
 
-  // Read input file
-  if (file.is_open()) {
+  // An up-to-date snapshot saves us the parsing altogether
+  string snapshot_name = file_name + ".snapshot";
+  if (use_snapshot && loadSnapshot(snapshot_name, file_stat, data, n_threads)) {
+	if (data) munmap((void*) data, file_size);
+	printf("Loaded %d entries from snapshot %s\n", number_of_users(), snapshot_name.c_str());
+	NC_Trace::count("rows from snapshot", number_of_users());
+	return;
+  }
+
+  // First line is labels only, so we ignore it
+  const char *first_row = data ? (const char*) memchr(data, '\n', file_size) : nullptr;
+  first_row = first_row ? first_row+1 : data + file_size;
 
-	string prev_preg;
+  m_n_malformed = 0;
+  size_t n_lines = parseData(first_row, data + file_size - first_row, n_threads, 2);
+  if (m_n_malformed > 20) printf("...Skipped %d further malformed rows\n", m_n_malformed-20);
+  forEachColumn([&](auto &column) { column.shrink_to_fit(); });
+  printf("Read %zu input lines and transferred %d entries into analysable format\n", n_lines, number_of_users());
+  NC_Trace::count("rows parsed", number_of_users());
+  if (use_snapshot) writeSnapshot(snapshot_name, file_stat, hashData(data, file_size, n_threads));
+
+  if (data) munmap((void*) data, file_size);
+
+  return;
+}
+
+
+// Function to parse rows of text input into the columns, replacing their previous content; returns the number of lines
+size_t NC_Users::parseData(const char *first_row, size_t size, int n_threads, size_t first_line) {
+
+  NC_TraceScope trace_scope("parseData");
+
+  const char *data_end = first_row + size;
+
+  // Split the rest into newline-aligned chunks, a few per thread to even out the load
+  const size_t min_chunk_size = 1 << 20;
+  size_t n_chunks = min((size_t) n_threads*4, (size_t) (data_end-first_row) / min_chunk_size + 1);
+  vector<Chunk> chunks(n_chunks);
+  const char *chunk_begin = first_row;
+  for (size_t i_chunk = 0; i_chunk < n_chunks; ++i_chunk) {
+	const char *chunk_end = first_row + (data_end-first_row) * (i_chunk+1) / n_chunks;
+	if (chunk_end < chunk_begin) chunk_end = chunk_begin;
+	if (chunk_end < data_end) {
+		const char *newline = (const char*) memchr(chunk_end, '\n', data_end-chunk_end);
+		chunk_end = newline ? newline+1 : data_end;
+	}
+	chunks[i_chunk].begin = chunk_begin;
+	chunks[i_chunk].end = chunk_end;
+	chunk_begin = chunk_end;
+  }
+
+  // Count the lines of each chunk, so every chunk knows where its rows go
+  NC_Parallel::forEach(n_chunks, n_threads, [&](int i_chunk, int) {
+	Chunk &chunk = chunks[i_chunk];
+	chunk.n_lines = 0;
+	for (const char *pos = chunk.begin; pos < chunk.end; ++chunk.n_lines) {
+		const char *newline = (const char*) memchr(pos, '\n', chunk.end-pos);
+		pos = newline ? newline+1 : chunk.end;
+	}
+  });
+  size_t n_lines = 0;
+  for (Chunk &chunk : chunks) {
+	chunk.first_row = n_lines;
+	n_lines += chunk.n_lines;
+  }
+  forEachColumn([&](auto &column) { column.resize(n_lines); });
+
+  // Parse all chunks in parallel, each into its own slice of the columns
+  NC_Parallel::forEach(n_chunks, n_threads, [&](int i_chunk, int) { parseChunk(chunks[i_chunk]); });
+
+  // Merge in input order, translating the chunk codes and closing the gaps left by malformed or empty lines
+  size_t n_rows = 0;
+  for (Chunk &chunk : chunks) {
+	mergeChunk(chunk, n_rows);
+	n_rows += chunk.n_rows;
+	for (int i_error = 0; i_error < chunk.errors.size(); ++i_error) {
+		if (m_n_malformed < 20) printf("...Skipping malformed row in line %zu: %s\n", first_line + chunk.first_row + chunk.errors[i_error].first, chunk.errors[i_error].second.c_str());
+		++m_n_malformed;
+	}
+  }
+  forEachColumn([&](auto &column) { column.resize(n_rows); });
+  dropValidity();
+
+  return n_lines;
+}
+
+
+// Function to read the input in batches of at most batch_size bytes, process_batch(*this) is called for each batch before
+// it is dropped again, so memory stays constant whatever the size of the input; category codes stay valid across batches
+template<class F> void NC_Users::streamData(string file_name, F process_batch, size_t batch_size, int n_threads) {
+
+  printf("Streaming input data from file '%s'\n", file_name.c_str());
+  NC_TraceScope trace_scope("streamData");
+  releaseSnapshot();
+  resetDictionaries();
+  n_threads = NC_Parallel::nThreads(n_threads);
+
+  int fd = open(file_name.c_str(), O_RDONLY);
+  if (fd < 0) {
+	printf("...Could not open input data file '%s'\n", file_name.c_str());
+	exit (EXIT_FAILURE);
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  vector<char> buffer(batch_size);
+  size_t filled = 0, n_lines = 0, n_users = 0, next_line = 1;
+  bool header_skipped = false, at_end = false;
+  m_n_malformed = 0;
+
+  while (!at_end) {
+
+	// Fill the buffer as far as possible
+	while (filled < buffer.size()) {
+		ssize_t n_read = read(fd, buffer.data() + filled, buffer.size() - filled);
+		if (n_read < 0) {
+			printf("...Could not read input data file '%s'\n", file_name.c_str());
+			exit (EXIT_FAILURE);
+		}
+		if (n_read == 0) {
+			at_end = true;
+			break;
+		}
+		filled += n_read;
+		NC_Trace::count("bytes read", n_read);
+	}
+
+	// Only complete lines are parsed, the rest is kept for the next batch
+	size_t usable = filled;
+	if (!at_end) {
+		const char *last_newline = (const char*) memrchr(buffer.data(), '\n', filled);
+		if (!last_newline) {
+			// A single line longer than the whole batch, so make room for it
+			buffer.resize(buffer.size()*2);
+			continue;
+		}
+		usable = last_newline - buffer.data() + 1;
+	}
 
 	// First line is labels only, so we ignore it
-	string header;
-	std::getline(file, header);
+	const char *first_row = buffer.data();
+	if (!header_skipped && usable > 0) {
+		const char *newline = (const char*) memchr(first_row, '\n', usable);
+		first_row = newline ? newline+1 : first_row + usable;
+		header_skipped = true;
+		++next_line;
+	}
+
+	size_t n_batch_lines = parseData(first_row, buffer.data() + usable - first_row, n_threads, next_line);
+	next_line += n_batch_lines;
+	n_lines += n_batch_lines;
+	n_users += number_of_users();
+	NC_Trace::count("rows parsed", number_of_users());
+	if (number_of_users() > 0) {
+		NC_TraceScope batch_scope("processBatch");
+		process_batch(*this);
+	}
+
+	memmove(buffer.data(), buffer.data() + usable, filled - usable);
+	filled -= usable;
+  }
+  close(fd);
 
-	// start reading data
-	while (true) {
-		User user;
-		file >> user.index >> user.bmi >> user.age >> user.country >> prev_preg >> user.education >> user.sleeping_pattern >> user.n_cycles_trying >> user.outcome >> user.dedication >> user.average_cycle_length >> user.cycle_length_std >> user.regular_cycle >> user.intercourse_frequency;
+  // Nothing of the last batch is kept around
+  forEachColumn([&](auto &column) { column.resize(0); column.shrink_to_fit(); });
+  dropValidity();
 
-		if (file.eof()) break;
+  if (m_n_malformed > 20) printf("...Skipped %d further malformed rows\n", m_n_malformed-20);
+  printf("Streamed %zu input lines and processed %zu entries\n", n_lines, n_users);
 
-		// Translate the number of previous pregnancies into integer format
-		user.pregnant_before = fillPregnantBefore(prev_preg);
+  return;
+}
 
-		m_users.push_back(user);
 
-		++n_data_read;
-        }
+void NC_Users::readAppended(string file_name, NC_ReadPosition &position, int n_threads) {
+
+  printf("Reading rows appended to '%s' after byte %llu\n", file_name.c_str(), (unsigned long long) position.offset);
+  NC_TraceScope trace_scope("readAppended");
+  releaseSnapshot();
+  if (position.offset == 0) {
+	resetDictionaries();
+	position = NC_ReadPosition();
   }
-  else {
+  n_threads = NC_Parallel::nThreads(n_threads);
+
+  int fd = open(file_name.c_str(), O_RDONLY);
+  struct stat file_stat;
+  if (fd < 0 || fstat(fd, &file_stat) != 0) {
 	printf("...Could not open input data file '%s'\n", file_name.c_str());
 	exit (EXIT_FAILURE);
   }
+  if (file_stat.st_size < position.offset) {
+	printf("...Input data file '%s' is shorter than what was read before\n", file_name.c_str());
+	exit (EXIT_FAILURE);
+  }
 
-  printf("Read %d input lines from file %s and transferred %d entries into analysable format\n", n_data_read, file_name.c_str(), m_users.size());
+  // Only the new part is mapped, starting at the page the offset falls into
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t map_begin = position.offset / page_size * page_size, map_size = file_stat.st_size - map_begin;
+  const char *data = nullptr;
+  if (map_size > 0) {
+	void *mapping = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, map_begin);
+	if (mapping == MAP_FAILED) {
+		printf("...Could not map input data file '%s'\n", file_name.c_str());
+		exit (EXIT_FAILURE);
+	}
+	madvise(mapping, map_size, MADV_SEQUENTIAL);
+	data = (const char*) mapping;
+  }
+  const char *begin = data + (position.offset - map_begin), *end = data + map_size;
+  NC_Trace::count("bytes read", end - begin);
+
+  // Up to the end of the last complete line, and without the header if we are at the start
+  const char *last_newline = begin < end ? (const char*) memrchr(begin, '\n', end-begin) : nullptr;
+  end = last_newline ? last_newline+1 : begin;
+  const char *first_row = begin;
+  if (position.offset == 0 && begin < end) {
+	first_row = (const char*) memchr(begin, '\n', end-begin) + 1;
+	position.n_lines = 1;
+  }
+
+  m_n_malformed = 0;
+  size_t n_lines = parseData(first_row, end - first_row, n_threads, position.n_lines + 1);
+  if (m_n_malformed > 20) printf("...Skipped %d further malformed rows\n", m_n_malformed-20);
+  position.n_lines += n_lines;
+  position.offset += end - begin;
+  position.tail_hash = hashTail(fd, position.offset);
+  printf("Read %zu appended lines and transferred %d entries into analysable format\n", n_lines, number_of_users());
+  NC_Trace::count("rows parsed", number_of_users());
+
+  if (data) munmap((void*) data, map_size);
+  close(fd);
 
   return;
 }
 
 
-// Function to translate written previous pregnancy data to integer
-int NC_Users::fillPregnantBefore(string label) {
-  if (label == "No,never") return 0;
-  else if (label == "Yes,once") return 1;
-  else if (label == "Yes,twice") return 2;
-  else if (label == "Yes,3TimesOrMore") return 3;
+bool NC_Users::extends(string file_name, const NC_ReadPosition &position) {
+  int fd = open(file_name.c_str(), O_RDONLY);
+  struct stat file_stat;
+  bool extends = fd >= 0 && fstat(fd, &file_stat) == 0 && file_stat.st_size >= position.offset && hashTail(fd, position.offset) == position.tail_hash;
+  if (fd >= 0) close(fd);
+  return extends;
+}
+
+
+// Hash of the kTailSize bytes before offset, read without mapping the file
+uint64_t NC_Users::hashTail(int fd, uint64_t offset) {
+  char tail[kTailSize];
+  size_t size = min((uint64_t) kTailSize, offset);
+  if (pread(fd, tail, size, offset - size) != size) return 0;
+  return hashData(tail, size, 1);
+}
+
+
+// Same layout as in the snapshot: per dictionary a label count followed by length-prefixed labels
+bool NC_Users::writeDictionaries(FILE *file) const {
+  bool success = true;
+  forEachDictionary([&](const NC_Dictionary &dict) {
+	uint32_t n_labels = dict.size();
+	success = success && fwrite(&n_labels, sizeof(n_labels), 1, file) == 1;
+	for (int i_label = 0; i_label < dict.size() && success; ++i_label) {
+		uint32_t length = dict.label(i_label).size();
+		success = fwrite(&length, sizeof(length), 1, file) == 1 && fwrite(dict.label(i_label).data(), 1, length, file) == length;
+	}
+  });
+  return success;
+}
+
+
+bool NC_Users::readDictionaries(FILE *file) {
+  releaseSnapshot();
+  forEachColumn([&](auto &column) { column.resize(0); });
+  dropValidity();
+  bool success = true;
+  string label;
+  forEachDictionary([&](NC_Dictionary &dict) {
+	dict.clear();
+	uint32_t n_labels, length;
+	success = success && fread(&n_labels, sizeof(n_labels), 1, file) == 1 && n_labels <= NC_Dictionary::kMaxLabels;
+	for (uint32_t i_label = 0; i_label < n_labels && success; ++i_label) {
+		success = fread(&length, sizeof(length), 1, file) == 1 && length < (1 << 16);
+		if (!success) break;
+		label.resize(length);
+		success = fread(&label[0], 1, length, file) == length;
+		if (success) dict.encode(label);
+	}
+  });
+  // The codes of the levels in the schema are fixed, whatever the file says
+  NC_ForEachField([&](auto constant) {
+	constexpr NC_FieldInfo info = kNC_Schema[constant];
+	if constexpr (info.type == kCategoryField && info.levels != nullptr) {
+		for (int level = 0; info.levels[level]; ++level) success = success && m_dictionaries[constant].find(info.levels[level]) == level;
+	}
+  });
+  if (!success) {
+	resetDictionaries();
+	return false;
+  }
+  return true;
+}
+
+
+vector<NC_Code> NC_Users::mergeDictionary(NC_Field field, const NC_Dictionary &other) {
+  NC_Dictionary *dict = const_cast<NC_Dictionary*>(dictionary(field));
+  vector<NC_Code> codes(other.size());
+  for (int code = 0; code < other.size(); ++code) codes[code] = dict->encode(other.label(code));
+  return codes;
+}
+
+
+void NC_Users::clearRows() {
+  releaseSnapshot();
+  forEachColumn([&](auto &column) { column.resize(0); column.shrink_to_fit(); });
+  dropValidity();
+  m_n_malformed = 0;
+}
+
+
+// Function to map a snapshot written by an earlier run, returns false if there is none or it does not match the source file
+bool NC_Users::loadSnapshot(string snapshot_name, const struct stat &source_stat, const char *source, int n_threads) {
+
+  NC_TraceScope trace_scope("loadSnapshot");
+
+  int fd = open(snapshot_name.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat snapshot_stat;
+  if (fstat(fd, &snapshot_stat) != 0 || snapshot_stat.st_size < sizeof(SnapshotHeader)) {
+	close(fd);
+	return false;
+  }
+  void *mapping = mmap(nullptr, snapshot_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) return false;
+  m_snapshot = mapping;
+  m_snapshot_size = snapshot_stat.st_size;
+
+  // The cheap checks first. An unchanged size and modification time are trusted as they are, the source is only hashed
+  // when the time differs, e.g. after a copy, so an up-to-date snapshot loads without reading the input at all
+  const SnapshotHeader *header = (const SnapshotHeader*) mapping;
+  int64_t source_mtime = (int64_t) source_stat.st_mtim.tv_sec * 1000000000 + source_stat.st_mtim.tv_nsec;
+  if (memcmp(header->magic, "NCSNAP", 7) != 0 || header->version != kSnapshotVersion || header->n_columns != kNColumns ||
+	header->file_size != m_snapshot_size || header->source_size != source_stat.st_size ||
+	(header->source_mtime != source_mtime && header->source_hash != hashData(source, source_stat.st_size, n_threads))) {
+	printf("...Snapshot %s is missing or outdated, parsing the input file\n", snapshot_name.c_str());
+	releaseSnapshot();
+	return false;
+  }
+
+  // Everything read from here on has to lie inside the mapping, a damaged snapshot is parsed again like an outdated one
+  const char *base = (const char*) mapping;
+  const char *end = base + m_snapshot_size;
+  bool intact = header->n_rows <= INT_MAX && header->dictionary_offset <= m_snapshot_size;
+  int i_column = 0;
+  forEachColumn([&](auto &column) {
+	typedef typename remove_reference<decltype(column[0])>::type T;
+	uint64_t offset = header->column_offset[i_column++];
+	intact = intact && offset % alignof(T) == 0 && offset <= header->dictionary_offset &&
+		header->n_rows <= (header->dictionary_offset - offset) / sizeof(T);
+  });
+
+  // Dictionaries are stored as a label count followed by length-prefixed labels, each label has to get its position as code
+  const char *pos = base + header->dictionary_offset;
+  forEachDictionary([&](NC_Dictionary &dict) {
+	uint32_t n_labels, length;
+	intact = intact && end - pos >= sizeof(n_labels);
+	if (!intact) return;
+	memcpy(&n_labels, pos, sizeof(n_labels));
+	pos += sizeof(n_labels);
+	intact = n_labels <= NC_Dictionary::kMaxLabels;
+	for (uint32_t i_label = 0; i_label < n_labels && intact; ++i_label) {
+		intact = end - pos >= sizeof(length);
+		if (!intact) break;
+		memcpy(&length, pos, sizeof(length));
+		pos += sizeof(length);
+		intact = end - pos >= length && dict.encode(string_view(pos, length)) == (int) i_label;
+		pos += length;
+	}
+  });
+  if (!intact) {
+	printf("...Snapshot %s is damaged, parsing the input file\n", snapshot_name.c_str());
+	releaseSnapshot();
+	resetDictionaries();
+	return false;
+  }
+
+  // Columns are used in place, nothing gets copied
+  i_column = 0;
+  forEachColumn([&](auto &column) {
+	typedef typename remove_reference<decltype(column[0])>::type T;
+	column.view((const T*) (base + header->column_offset[i_column++]), header->n_rows);
+  });
+  m_n_malformed = header->n_malformed;
+  dropValidity();
+
+  return true;
+}
+
+
+// Function to store the parsed columns as a binary snapshot next to the input file
+void NC_Users::writeSnapshot(string snapshot_name, const struct stat &source_stat, uint64_t source_hash) {
+
+  NC_TraceScope trace_scope("writeSnapshot");
+
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "NCSNAP", 7);
+  header.version = kSnapshotVersion;
+  header.n_columns = kNColumns;
+  header.n_rows = number_of_users();
+  header.n_malformed = m_n_malformed;
+  header.source_size = source_stat.st_size;
+  header.source_mtime = (int64_t) source_stat.st_mtim.tv_sec * 1000000000 + source_stat.st_mtim.tv_nsec;
+  header.source_hash = source_hash;
+
+  // Columns start on cache line boundaries, so they can be used straight from the mapping
+  auto align = [](uint64_t offset) { return (offset + 63) / 64 * 64; };
+  uint64_t offset = align(sizeof(header));
+  int i_column = 0;
+  forEachColumn([&](auto &column) {
+	header.column_offset[i_column++] = offset;
+	offset = align(offset + column.size() * sizeof(column[0]));
+  });
+  header.dictionary_offset = offset;
+  forEachDictionary([&](NC_Dictionary &dict) {
+	offset += sizeof(uint32_t);
+	for (int i_label = 0; i_label < dict.size(); ++i_label) offset += sizeof(uint32_t) + dict.label(i_label).size();
+  });
+  header.file_size = offset;
+
+  // Write to a temporary file first, so a crash never leaves a half-written snapshot behind
+  string temp_name = snapshot_name + ".tmp";
+  FILE *file = fopen(temp_name.c_str(), "wb");
+  if (!file) {
+	printf("...Could not write snapshot %s, continuing without\n", snapshot_name.c_str());
+	return;
+  }
+  const char padding[64] = {0};
+  uint64_t written = fwrite(&header, 1, sizeof(header), file);
+  i_column = 0;
+  forEachColumn([&](auto &column) {
+	written += fwrite(padding, 1, header.column_offset[i_column] - written, file);
+	written += fwrite(column.data(), 1, column.size() * sizeof(column[0]), file);
+	++i_column;
+  });
+  written += fwrite(padding, 1, header.dictionary_offset - written, file);
+  forEachDictionary([&](NC_Dictionary &dict) {
+	uint32_t n_labels = dict.size();
+	written += fwrite(&n_labels, 1, sizeof(n_labels), file);
+	for (int i_label = 0; i_label < dict.size(); ++i_label) {
+		uint32_t length = dict.label(i_label).size();
+		written += fwrite(&length, 1, sizeof(length), file);
+		written += fwrite(dict.label(i_label).data(), 1, length, file);
+	}
+  });
+  bool success = fclose(file) == 0 && written == header.file_size;
+  if (!success || rename(temp_name.c_str(), snapshot_name.c_str()) != 0) {
+	printf("...Could not write snapshot %s, continuing without\n", snapshot_name.c_str());
+	remove(temp_name.c_str());
+	return;
+  }
+  printf("Wrote snapshot %s\n", snapshot_name.c_str());
+
+  return;
+}
+
+
+void NC_Users::selectRows(const NC_Users &source, const int *rows, int n_rows, int n_threads) {
+
+  NC_TraceScope trace_scope("selectRows");
+
+  releaseSnapshot();
+  m_n_malformed = 0;
+
+  vector<const NC_Dictionary*> dictionaries;
+  source.forEachDictionary([&](const NC_Dictionary &dict) { dictionaries.push_back(&dict); });
+  int i_dict = 0;
+  forEachDictionary([&](NC_Dictionary &dict) { dict = *dictionaries[i_dict++]; });
+
+  // Both sides list their columns in the same order
+  vector<const void*> columns;
+  source.forEachColumn([&](const auto &column) { columns.push_back(column.data()); });
+  forEachColumn([&](auto &column) { column.resize(n_rows); });
+
+  const int kRowsPerTask = 1 << 16;
+  NC_Parallel::forEach((n_rows + kRowsPerTask - 1) / kRowsPerTask, n_threads, [&](int task, int) {
+	int begin = task * kRowsPerTask, end = min(n_rows, begin + kRowsPerTask);
+	int i_column = 0;
+	forEachColumn([&](auto &column) {
+		auto source_data = (decltype(column.data())) columns[i_column++];
+		for (int i = begin; i < end; ++i) column[i] = source_data[rows[i]];
+	});
+  });
+  dropValidity();
+
+  return;
+}
+
+
+// Function to drop the snapshot mapping, columns pointing into it are emptied first
+void NC_Users::releaseSnapshot() {
+  if (!m_snapshot) return;
+  forEachColumn([&](auto &column) { column.resize(0); });
+  dropValidity();
+  munmap(m_snapshot, m_snapshot_size);
+  m_snapshot = nullptr;
+  m_snapshot_size = 0;
+}
+
+
+// Empty dictionaries with the missing label of their field, those with levels in the schema start with them so their codes are fixed
+void NC_Users::resetDictionaries(NC_Dictionary *dictionaries) {
+  NC_ForEachField([&](auto constant) {
+	constexpr NC_FieldInfo info = kNC_Schema[constant];
+	dictionaries[constant] = NC_Dictionary(info.missing);
+	if constexpr (info.type == kCategoryField && info.levels != nullptr) {
+		for (int level = 0; info.levels[level]; ++level) dictionaries[constant].encode(info.levels[level]);
+	}
+  });
+}
+
+
+// Function to hash the source file, blocks are hashed in parallel and then combined in order
+uint64_t NC_Users::hashData(const char *data, size_t size, int n_threads) {
+
+  const size_t block_size = 1 << 20;
+  const uint64_t prime = 0x100000001b3ULL;
+  int n_blocks = (size + block_size - 1) / block_size;
+  vector<uint64_t> block_hashes(n_blocks);
+
+  // FNV-1a style mixing, but eight bytes at a time
+  NC_Parallel::forEach(n_blocks, n_threads, [&](int i_block, int) {
+	const char *begin = data + i_block * block_size;
+	size_t n = min(block_size, size - i_block * block_size);
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		uint64_t word;
+		memcpy(&word, begin+i, 8);
+		hash = (hash ^ word) * prime;
+		hash ^= hash >> 29;
+	}
+	for (; i < n; ++i) hash = (hash ^ (unsigned char) begin[i]) * prime;
+	block_hashes[i_block] = hash;
+  });
+
+  uint64_t hash = 0xcbf29ce484222325ULL ^ size;
+  for (int i_block = 0; i_block < n_blocks; ++i_block) hash = (hash ^ block_hashes[i_block]) * prime;
+  return hash;
+}
+
+
+// Function to parse all rows of a chunk into the column slots reserved for it
+void NC_Users::parseChunk(Chunk &chunk) {
+
+  NC_TraceScope trace_scope("parseChunk");
+
+  // Pre-seeded like the global dictionaries, so the fixed codes match already
+  resetDictionaries(chunk.dictionaries);
+
+  chunk.n_rows = 0;
+  string error;
+  const char *pos = chunk.begin;
+  for (size_t i_line = 0; pos < chunk.end; ++i_line) {
+
+	// Skip empty lines silently
+	const char *line_begin = pos;
+	while (pos < chunk.end && (*pos == ' ' || *pos == '\t' || *pos == '\r')) ++pos;
+	if (pos == chunk.end) break;
+	if (*pos == '\n') {
+		++pos;
+		continue;
+	}
+	pos = line_begin;
+
+	if (parseRow(pos, chunk.end, chunk.first_row + chunk.n_rows, chunk, error)) ++chunk.n_rows;
+	else chunk.errors.push_back(make_pair(i_line, error));
+  }
+
+  return;
+}
+
+
+// Function to parse one row, on success the values are written to the given row and pos points to the next line
+bool NC_Users::parseRow(const char *&pos, const char *end, size_t row, Chunk &chunk, string &error) {
+
+  string_view tokens[kNFields];
+  int n_tokens = 0;
+
+  // Split the line into whitespace separated tokens
+  while (true) {
+	while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\r')) ++pos;
+	if (pos == end || *pos == '\n') break;
+	const char *token_begin = pos;
+	while (pos < end && *pos != ' ' && *pos != '\t' && *pos != '\r' && *pos != '\n') ++pos;
+	if (n_tokens < kNFields) tokens[n_tokens] = string_view(token_begin, pos-token_begin);
+	++n_tokens;
+  }
+  if (pos < end) ++pos;
+
+  if (n_tokens != kNFields) {
+	error = "expected " + to_string(kNFields) + " fields but found " + to_string(n_tokens);
+	return false;
+  }
+
+  // Numbers first, so a malformed row adds no labels to the dictionaries; the slot is not counted until the row is complete
+  const char *bad_field = nullptr;
+  NC_ForEachField([&](auto constant) {
+	constexpr NC_FieldInfo info = kNC_Schema[constant];
+	if constexpr (info.type != kCategoryField && info.levels == nullptr) {
+		if (!bad_field && !parseNumber<constant>(tokens[constant], get<constant>(m_columns)[row])) bad_field = info.name;
+	}
+  });
+  if (bad_field) {
+	error = "could not parse field " + string(bad_field);
+	return false;
+  }
+
+  // Labels: codes of the chunk dictionaries for categories, the position in the levels for int fields written as labels
+  NC_ForEachField([&](auto constant) {
+	constexpr NC_FieldInfo info = kNC_Schema[constant];
+	if constexpr (info.type == kCategoryField) get<constant>(m_columns)[row] = chunk.dictionaries[constant].encode(tokens[constant]);
+	else if constexpr (info.levels != nullptr) get<constant>(m_columns)[row] = levelValue(info.levels, tokens[constant]);
+  });
+
+  return true;
+}
+
+
+// Function to move the rows of a parsed chunk to their final position and translate its codes into the global dictionaries
+void NC_Users::mergeChunk(const Chunk &chunk, size_t row) {
+
+  if (row != chunk.first_row) {
+	forEachColumn([&](auto &column) {
+		memmove(&column[row], &column[chunk.first_row], chunk.n_rows * sizeof(column[0]));
+	});
+  }
+
+  auto translate = [&](NC_Column<NC_Code> &column, const NC_Dictionary &chunk_dict, NC_Dictionary &dict) {
+	vector<NC_Code> codes(chunk_dict.size());
+	bool identical = true;
+	for (int i_code = 0; i_code < codes.size(); ++i_code) {
+		codes[i_code] = dict.encode(chunk_dict.label(i_code));
+		if (codes[i_code] != i_code) identical = false;
+	}
+	if (identical) return;
+	for (size_t i = row; i < row + chunk.n_rows; ++i) {
+		if (column[i] > -1) column[i] = codes[column[i]];
+	}
+  };
+  NC_ForEachField([&](auto constant) {
+	if constexpr (kNC_Schema[constant].type == kCategoryField)
+		translate(get<constant>(m_columns), chunk.dictionaries[constant], m_dictionaries[constant]);
+  });
+
+  return;
+}
+
+
+// Function to translate an int field written as one of its levels, e.g. the number of previous pregnancies, -1 if it is none of them
+int NC_Users::levelValue(const char *const *levels, string_view label) {
+  for (int level = 0; levels[level]; ++level) {
+	if (label == levels[level]) return level;
+  }
   return -1;
 }
+
+
+// Parses a numeric field with the parser of its type, the missing token of the schema becomes -1
+template<NC_Field field> bool NC_Users::parseNumber(string_view token, NC_FieldValue<field> &value) {
+  constexpr NC_FieldInfo info = kNC_Schema[field];
+  // The usual -1 parses as -1 anyway, so only other tokens cost a comparison
+  if constexpr (!NC_SameText(info.missing, "-1")) {
+	if (token == info.missing) {
+		value = -1;
+		return true;
+	}
+  }
+  if constexpr (info.type == kFloatField) return parseFloat(token, value);
+  else return parseInt(token, value);
+}
+
+
+// Hand-written integer parsing, much faster than going through the stream locale machinery
+bool NC_Users::parseInt(string_view token, int &value) {
+  size_t i = 0;
+  bool negative = false;
+  if (i < token.size() && (token[i] == '-' || token[i] == '+')) negative = token[i++] == '-';
+  if (i == token.size()) return false;
+  // Values that do not fit into an int make the row malformed instead of wrapping around
+  const long limit = (long) INT_MAX + (negative ? 1 : 0);
+  long result = 0;
+  for (; i < token.size(); ++i) {
+	if (token[i] < '0' || token[i] > '9') return false;
+	result = result*10 + (token[i]-'0');
+	if (result > limit) return false;
+  }
+  value = negative ? -result : result;
+  return true;
+}
+
+
+// Hand-written decimal parsing for the plain numbers in the input file, exponents are supported as well
+bool NC_Users::parseFloat(string_view token, float &value) {
+  static const double powers_of_ten[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18};
+  size_t i = 0;
+  bool negative = false;
+  if (i < token.size() && (token[i] == '-' || token[i] == '+')) negative = token[i++] == '-';
+
+  // Collect the significant digits as an integer and keep track of the decimal exponent
+  uint64_t mantissa = 0;
+  int exponent = 0, n_digits = 0;
+  bool after_point = false;
+  for (; i < token.size(); ++i) {
+	char c = token[i];
+	if (c == '.' && !after_point) {
+		after_point = true;
+		continue;
+	}
+	if (c < '0' || c > '9') break;
+	++n_digits;
+	if (mantissa < 100000000000000000ULL) {
+		mantissa = mantissa*10 + (c-'0');
+		if (after_point) --exponent;
+	}
+	else if (!after_point) ++exponent;
+  }
+  if (n_digits == 0) return false;
+  if (i < token.size() && (token[i] == 'e' || token[i] == 'E')) {
+	int exp_value;
+	if (!parseInt(token.substr(i+1), exp_value)) return false;
+	exponent += exp_value;
+	i = token.size();
+  }
+  if (i != token.size()) return false;
+
+  double result = mantissa;
+  if (exponent < 0) result = exponent >= -18 ? result / powers_of_ten[-exponent] : result * pow(10.0, exponent);
+  else if (exponent > 0) result = exponent <= 18 ? result * powers_of_ten[exponent] : result * pow(10.0, exponent);
+  value = negative ? -result : result;
+  return true;
+}